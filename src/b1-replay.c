@@ -0,0 +1,552 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+/*
+ * Traffic Replay
+ *
+ * This reads a log written by b1_capture_start(), recreates the peers, nodes
+ * and handle transfers it recorded, and replays the recorded traffic on them,
+ * either at the recorded pace, or sped up by a given factor.
+ *
+ * Peers and nodes are recreated as they show up in the log. Destinations of
+ * sends that cannot be traced back to a recorded node, for instance handles
+ * that were passed in messages, are backed by nodes on a separate sink peer.
+ * Handles and file descriptors attached to messages are not replayed, only
+ * counted. Payloads are replayed if they were recorded, otherwise zeroed
+ * payloads of the recorded size are sent.
+ */
+
+#include <c-macro.h>
+#include <c-rbtree.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/bus1.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "capture.h"
+#include "org.bus1/b1-peer.h"
+
+typedef struct Replay Replay;
+typedef struct ReplayHandle ReplayHandle;
+typedef struct ReplayPeer ReplayPeer;
+
+struct ReplayPeer {
+        int fd; /* fd of the recorded peer */
+        B1Peer *peer;
+        CRBNode rb;
+};
+
+struct ReplayHandle {
+        int fd; /* fd of the recorded holder */
+        uint64_t id; /* id of the recorded handle */
+        B1Handle *handle; /* owned, unless backed by @node */
+        B1Node *node; /* set if the holder owns the node */
+        CRBNode rb;
+};
+
+struct Replay {
+        CRBTree peers;
+        CRBTree handles;
+        B1Peer *sink; /* owns nodes backing unresolved destinations */
+
+        double speed; /* 0 to replay as fast as possible */
+        uint8_t *zeroes;
+        size_t n_zeroes;
+
+        uint64_t n_sent;
+        uint64_t n_failed;
+        uint64_t n_received;
+        uint64_t n_unresolved;
+        uint64_t n_skipped_handles;
+        uint64_t n_skipped_fds;
+};
+
+static uint64_t replay_now(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static int replay_peers_compare(CRBTree *t, void *k, CRBNode *n) {
+        ReplayPeer *peer = c_container_of(n, ReplayPeer, rb);
+        int fd = *(int *)k;
+
+        if (fd < peer->fd)
+                return -1;
+        else if (fd > peer->fd)
+                return 1;
+        else
+                return 0;
+}
+
+static int replay_handles_compare(CRBTree *t, void *k, CRBNode *n) {
+        ReplayHandle *handle = c_container_of(n, ReplayHandle, rb);
+        ReplayHandle *key = k;
+
+        if (key->fd < handle->fd)
+                return -1;
+        else if (key->fd > handle->fd)
+                return 1;
+        else if (key->id < handle->id)
+                return -1;
+        else if (key->id > handle->id)
+                return 1;
+        else
+                return 0;
+}
+
+static int replay_get_peer(Replay *replay, int fd, B1Peer **peerp) {
+        ReplayPeer *peer;
+        CRBNode **slot, *p;
+        int r;
+
+        slot = c_rbtree_find_slot(&replay->peers, replay_peers_compare, &fd, &p);
+        if (!slot) {
+                *peerp = c_container_of(p, ReplayPeer, rb)->peer;
+                return 0;
+        }
+
+        peer = calloc(1, sizeof(*peer));
+        if (!peer)
+                return -ENOMEM;
+
+        r = b1_peer_new(&peer->peer);
+        if (r < 0) {
+                free(peer);
+                return r;
+        }
+
+        peer->fd = fd;
+        c_rbtree_add(&replay->peers, p, slot, &peer->rb);
+
+        *peerp = peer->peer;
+        return 0;
+}
+
+static ReplayHandle *replay_find_handle(Replay *replay, int fd, uint64_t id) {
+        ReplayHandle key = { .fd = fd, .id = id };
+        CRBNode *n;
+
+        n = c_rbtree_find_node(&replay->handles, replay_handles_compare, &key);
+
+        return n ? c_container_of(n, ReplayHandle, rb) : NULL;
+}
+
+static int replay_add_handle(Replay *replay, int fd, uint64_t id, B1Handle *handle, B1Node *node) {
+        ReplayHandle key = { .fd = fd, .id = id }, *entry;
+        CRBNode **slot, *p;
+
+        /* a recorded id is only ever resolved once */
+        slot = c_rbtree_find_slot(&replay->handles, replay_handles_compare, &key, &p);
+        if (!slot)
+                return -ENOTUNIQ;
+
+        entry = calloc(1, sizeof(*entry));
+        if (!entry)
+                return -ENOMEM;
+
+        entry->fd = fd;
+        entry->id = id;
+        entry->handle = handle;
+        entry->node = node;
+        c_rbtree_add(&replay->handles, p, slot, &entry->rb);
+
+        return 0;
+}
+
+static int replay_node(Replay *replay, const B1CaptureRecord *record) {
+        B1Node *node;
+        B1Peer *peer;
+        int r;
+
+        if (record->n_ids < 1)
+                return -EBADMSG;
+
+        if (replay_find_handle(replay, record->peer, record->ids[0]))
+                return 0;
+
+        r = replay_get_peer(replay, record->peer, &peer);
+        if (r < 0)
+                return r;
+
+        r = b1_node_new(peer, &node);
+        if (r < 0)
+                return r;
+
+        r = replay_add_handle(replay, record->peer, record->ids[0], b1_node_get_handle(node), node);
+        if (r < 0)
+                b1_node_free(node);
+
+        return r;
+}
+
+static int replay_transfer(Replay *replay, const B1CaptureRecord *record) {
+        ReplayHandle *src;
+        B1Handle *handle;
+        B1Peer *dst;
+        int r;
+
+        if (record->n_ids < 3)
+                return -EBADMSG;
+
+        if (replay_find_handle(replay, record->ids[1], record->ids[2]))
+                return 0;
+
+        src = replay_find_handle(replay, record->peer, record->ids[0]);
+        if (!src) {
+                ++replay->n_unresolved;
+                return 0;
+        }
+
+        r = replay_get_peer(replay, record->ids[1], &dst);
+        if (r < 0)
+                return r;
+
+        r = b1_handle_transfer(src->handle, dst, &handle);
+        if (r < 0)
+                return r;
+
+        r = replay_add_handle(replay, record->ids[1], record->ids[2], handle, NULL);
+        if (r < 0)
+                b1_handle_unref(handle);
+
+        return r;
+}
+
+static int replay_get_destination(Replay *replay, int fd, uint64_t id, B1Handle **handlep) {
+        ReplayHandle *entry;
+        B1Handle *handle;
+        B1Node *node;
+        B1Peer *peer;
+        int r;
+
+        entry = replay_find_handle(replay, fd, id);
+        if (entry) {
+                *handlep = entry->handle;
+                return 0;
+        }
+
+        ++replay->n_unresolved;
+
+        r = replay_get_peer(replay, fd, &peer);
+        if (r < 0)
+                return r;
+
+        r = b1_node_new(replay->sink, &node);
+        if (r < 0)
+                return r;
+
+        r = b1_handle_transfer(b1_node_get_handle(node), peer, &handle);
+        if (r < 0) {
+                b1_node_free(node);
+                return r;
+        }
+
+        /* the entry owns both the node on the sink and the handle to it */
+        r = replay_add_handle(replay, fd, id, handle, node);
+        if (r < 0) {
+                b1_handle_unref(handle);
+                b1_node_free(node);
+                return r;
+        }
+
+        *handlep = handle;
+        return 0;
+}
+
+static const void *replay_get_payload(Replay *replay, const B1CaptureRecord *record) {
+        uint8_t *zeroes;
+
+        if (record->n_payload == record->n_bytes)
+                return record->ids + record->n_ids;
+
+        if (record->n_bytes > replay->n_zeroes) {
+                zeroes = realloc(replay->zeroes, record->n_bytes);
+                if (!zeroes)
+                        return NULL;
+
+                memset(zeroes + replay->n_zeroes, 0, record->n_bytes - replay->n_zeroes);
+                replay->zeroes = zeroes;
+                replay->n_zeroes = record->n_bytes;
+        }
+
+        return replay->zeroes;
+}
+
+static int replay_send_to(Replay *replay, const B1CaptureRecord *record, B1Handle **destinations) {
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        B1Message *received;
+        const void *payload;
+        B1Peer *peer;
+        int r;
+
+        r = replay_get_peer(replay, record->peer, &peer);
+        if (r < 0)
+                return r;
+
+        for (size_t i = 0; i < record->n_ids; i++) {
+                r = replay_get_destination(replay, record->peer, record->ids[i], &destinations[i]);
+                if (r < 0)
+                        return r;
+        }
+
+        payload = replay_get_payload(replay, record);
+        if (!payload)
+                return -ENOMEM;
+
+        r = b1_message_new(peer, &message);
+        if (r < 0)
+                return r;
+
+        r = b1_message_set_payload(message, &(struct iovec){ (void *)payload, record->n_bytes }, 1);
+        if (r < 0)
+                return r;
+
+        r = b1_message_send(message, destinations, record->n_ids);
+        if (r < 0)
+                ++replay->n_failed;
+        else
+                ++replay->n_sent;
+
+        replay->n_skipped_handles += record->n_handles;
+        replay->n_skipped_fds += record->n_fds;
+
+        /* nobody was recorded receiving on the sink */
+        while (b1_peer_recv(replay->sink, &received) >= 0)
+                b1_message_unref(received);
+
+        return 0;
+}
+
+static int replay_send(Replay *replay, const B1CaptureRecord *record) {
+        B1Handle *buffer[64], **destinations = buffer;
+        int r;
+
+        if (record->type != BUS1_MSG_DATA)
+                return 0;
+
+        /* the number of ids comes from the log, do not put it on the stack */
+        if (record->n_ids > C_ARRAY_SIZE(buffer)) {
+                destinations = malloc(record->n_ids * sizeof(*destinations));
+                if (!destinations)
+                        return -ENOMEM;
+        }
+
+        r = replay_send_to(replay, record, destinations);
+
+        if (destinations != buffer)
+                free(destinations);
+
+        return r;
+}
+
+static int replay_recv(Replay *replay, const B1CaptureRecord *record) {
+        B1Message *message;
+        B1Peer *peer;
+        int r;
+
+        r = replay_get_peer(replay, record->peer, &peer);
+        if (r < 0)
+                return r;
+
+        r = b1_peer_recv(peer, &message);
+        if (r == -EAGAIN)
+                return 0;
+        else if (r < 0)
+                return r;
+
+        ++replay->n_received;
+        b1_message_unref(message);
+
+        return 0;
+}
+
+static void replay_wait(Replay *replay, uint64_t start, uint64_t timestamp) {
+        uint64_t deadline;
+        struct timespec ts;
+
+        if (replay->speed <= 0)
+                return;
+
+        deadline = start + (uint64_t)(timestamp / replay->speed);
+        ts.tv_sec = deadline / UINT64_C(1000000000);
+        ts.tv_nsec = deadline % UINT64_C(1000000000);
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+                ;
+}
+
+static int replay_run(Replay *replay, const uint8_t *log, size_t n_log) {
+        const B1CaptureHeader *header = (const B1CaptureHeader *)log;
+        const B1CaptureRecord *record;
+        uint64_t start, n_bytes;
+        size_t offset;
+        int r;
+
+        if (n_log < sizeof(*header) ||
+            header->magic != B1_CAPTURE_MAGIC ||
+            header->version != B1_CAPTURE_VERSION)
+                return -EBADMSG;
+
+        n_bytes = c_min(header->n_bytes, (uint64_t)n_log);
+        start = replay_now();
+
+        for (offset = sizeof(*header); offset + sizeof(*record) <= n_bytes; offset += record->size) {
+                record = (const B1CaptureRecord *)(log + offset);
+
+                if (!record->size)
+                        break;
+
+                if (record->size < sizeof(*record) ||
+                    record->size > n_bytes - offset ||
+                    record->n_ids > (record->size - sizeof(*record)) / sizeof(uint64_t) ||
+                    record->n_payload > record->size - sizeof(*record) - record->n_ids * sizeof(uint64_t))
+                        return -EBADMSG;
+
+                replay_wait(replay, start, record->timestamp);
+
+                switch (record->kind) {
+                case B1_CAPTURE_RECORD_NODE:
+                        r = replay_node(replay, record);
+                        break;
+                case B1_CAPTURE_RECORD_TRANSFER:
+                        r = replay_transfer(replay, record);
+                        break;
+                case B1_CAPTURE_RECORD_SEND:
+                        r = replay_send(replay, record);
+                        break;
+                case B1_CAPTURE_RECORD_RECV:
+                        r = replay_recv(replay, record);
+                        break;
+                default:
+                        r = 0;
+                        break;
+                }
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+static void replay_deinit(Replay *replay) {
+        ReplayHandle *handle;
+        ReplayPeer *peer;
+        CRBNode *n;
+
+        while ((n = c_rbtree_first(&replay->handles))) {
+                handle = c_container_of(n, ReplayHandle, rb);
+                c_rbnode_unlink(n);
+
+                if (!handle->node || b1_node_get_handle(handle->node) != handle->handle)
+                        b1_handle_unref(handle->handle);
+                b1_node_free(handle->node);
+                free(handle);
+        }
+
+        while ((n = c_rbtree_first(&replay->peers))) {
+                peer = c_container_of(n, ReplayPeer, rb);
+                c_rbnode_unlink(n);
+
+                b1_peer_unref(peer->peer);
+                free(peer);
+        }
+
+        b1_peer_unref(replay->sink);
+        free(replay->zeroes);
+}
+
+static void help(void) {
+        printf("%s [OPTIONS...] LOG\n\n"
+               "Replay traffic captured with b1_capture_start().\n\n"
+               "  -h --help            Show this help\n"
+               "  -s --speed FACTOR    Speed up the recorded pace by FACTOR,\n"
+               "                       or replay as fast as possible if 0\n"
+               , program_invocation_short_name);
+}
+
+int main(int argc, char **argv) {
+        static const struct option options[] = {
+                { "help",       no_argument,            NULL,   'h' },
+                { "speed",      required_argument,      NULL,   's' },
+                {}
+        };
+        Replay replay = { .speed = 1 };
+        uint64_t start, end;
+        struct stat st;
+        uint8_t *log;
+        int c, fd, r;
+
+        while ((c = getopt_long(argc, argv, "hs:", options, NULL)) >= 0) {
+                switch (c) {
+                case 'h':
+                        help();
+                        return 0;
+                case 's':
+                        replay.speed = strtod(optarg, NULL);
+                        if (replay.speed < 0) {
+                                fprintf(stderr, "Invalid speed factor: %s\n", optarg);
+                                return 1;
+                        }
+                        break;
+                default:
+                        return 1;
+                }
+        }
+
+        if (optind + 1 != argc) {
+                fprintf(stderr, "%s: expects exactly one log file\n", program_invocation_short_name);
+                return 1;
+        }
+
+        fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &st) < 0 || !st.st_size) {
+                fprintf(stderr, "Cannot open %s\n", argv[optind]);
+                return 1;
+        }
+
+        log = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (log == MAP_FAILED) {
+                fprintf(stderr, "Cannot map %s: %m\n", argv[optind]);
+                return 1;
+        }
+
+        r = b1_peer_new(&replay.sink);
+        if (r >= 0) {
+                start = replay_now();
+                r = replay_run(&replay, log, st.st_size);
+                end = replay_now();
+        }
+
+        if (r < 0) {
+                fprintf(stderr, "Replay failed: %s\n", strerror(-r));
+        } else {
+                printf("%" PRIu64 " messages replayed in %.3f s (%.0f msgs/s)\n",
+                       replay.n_sent, (end - start) / 1e9,
+                       end > start ? replay.n_sent * 1e9 / (end - start) : 0.0);
+                printf("%" PRIu64 " failed, %" PRIu64 " received, %" PRIu64 " unresolved destinations\n",
+                       replay.n_failed, replay.n_received, replay.n_unresolved);
+                printf("%" PRIu64 " handles and %" PRIu64 " fds not replayed\n",
+                       replay.n_skipped_handles, replay.n_skipped_fds);
+        }
+
+        replay_deinit(&replay);
+        munmap(log, st.st_size);
+
+        return r < 0 ? 1 : 0;
+}
@@ -0,0 +1,302 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+/*
+ * Peer Monitor
+ *
+ * This lists the stats pages published by peers created with
+ * B1_PEER_FLAG_STATS, and periodically prints per-peer message and ioctl
+ * rates, object counts, pool usage and the receive latency percentiles of
+ * stamped messages, see B1_PEER_FLAG_TIMESTAMPS. Rates and percentiles are
+ * computed over the last interval.
+ *
+ * Pages are mapped read-only, the monitored processes are never interrupted.
+ * Pages of processes that no longer exist are skipped.
+ */
+
+#include <c-macro.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "stats.h"
+
+typedef struct Top Top;
+typedef struct TopPeer TopPeer;
+
+struct TopPeer {
+        char *name;
+        ino_t ino;
+        const B1StatsPage *page;
+        B1StatsPage last;
+        bool seen;
+};
+
+struct Top {
+        TopPeer *peers;
+        size_t n_peers;
+        size_t n_peers_max;
+};
+
+static TopPeer *top_find_peer(Top *top, const char *name) {
+        for (size_t i = 0; i < top->n_peers; i++)
+                if (!strcmp(top->peers[i].name, name))
+                        return &top->peers[i];
+
+        return NULL;
+}
+
+static int top_add_peer(Top *top, const char *name) {
+        char path[PATH_MAX];
+        B1StatsPage *page;
+        TopPeer *peer, *peers;
+        struct stat st;
+        int fd, r;
+
+        if (top->n_peers >= top->n_peers_max) {
+                peers = realloc(top->peers, (top->n_peers_max * 2 + 8) * sizeof(*peers));
+                if (!peers)
+                        return -ENOMEM;
+
+                top->peers = peers;
+                top->n_peers_max = top->n_peers_max * 2 + 8;
+        }
+
+        snprintf(path, sizeof(path), B1_STATS_DIRECTORY "/%s", name);
+        fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+        if (fd < 0)
+                return 0;
+
+        /* accessing a mapping beyond the end of the file raises SIGBUS */
+        r = fstat(fd, &st);
+        if (r < 0 || st.st_size < (off_t)sizeof(*page)) {
+                close(fd);
+                return 0;
+        }
+
+        page = mmap(NULL, sizeof(*page), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (page == MAP_FAILED)
+                return 0;
+
+        /* not initialized yet, or of an incompatible version */
+        if (page->magic != B1_STATS_MAGIC || page->version != B1_STATS_VERSION) {
+                munmap(page, sizeof(*page));
+                return 0;
+        }
+
+        peer = &top->peers[top->n_peers];
+        *peer = (TopPeer){};
+
+        peer->name = strdup(name);
+        if (!peer->name) {
+                munmap(page, sizeof(*page));
+                return -ENOMEM;
+        }
+
+        peer->ino = st.st_ino;
+        peer->page = page;
+        peer->seen = true;
+        b1_stats_read(page, &peer->last);
+        ++top->n_peers;
+
+        return 0;
+}
+
+static void top_remove_peer(Top *top, size_t index) {
+        munmap((void *)top->peers[index].page, sizeof(B1StatsPage));
+        free(top->peers[index].name);
+        top->peers[index] = top->peers[--top->n_peers];
+}
+
+static int top_scan(Top *top) {
+        struct dirent *de;
+        TopPeer *peer;
+        DIR *dir;
+        int r = 0;
+
+        dir = opendir(B1_STATS_DIRECTORY);
+        if (!dir)
+                return -errno;
+
+        for (size_t i = 0; i < top->n_peers; i++)
+                top->peers[i].seen = false;
+
+        while ((de = readdir(dir))) {
+                if (strncmp(de->d_name, B1_STATS_PREFIX, strlen(B1_STATS_PREFIX)))
+                        continue;
+
+                /*
+                 * A new peer may reuse the fd, and thus the name, of one that
+                 * went away since the last scan. Map the new page then, the
+                 * old one is dropped below.
+                 */
+                peer = top_find_peer(top, de->d_name);
+                if (peer && peer->ino == de->d_ino) {
+                        peer->seen = true;
+                        continue;
+                }
+
+                r = top_add_peer(top, de->d_name);
+                if (r < 0)
+                        break;
+        }
+
+        closedir(dir);
+
+        /* the page was removed, or its process died without removing it */
+        for (size_t i = top->n_peers; i-- > 0; ) {
+                if (!top->peers[i].seen ||
+                    (kill(top->peers[i].page->pid, 0) < 0 && errno == ESRCH))
+                        top_remove_peer(top, i);
+        }
+
+        return r;
+}
+
+static uint64_t top_percentile(const uint64_t *latency, uint64_t n, unsigned int percent) {
+        uint64_t target, sum = 0;
+
+        if (!n)
+                return 0;
+
+        /* report the upper bound of the bucket holding the percentile */
+        target = (n * percent + 99) / 100;
+        for (unsigned int i = 0; i < B1_STATS_LATENCY_BUCKETS; i++) {
+                sum += latency[i];
+                if (sum >= target)
+                        return UINT64_C(2) << i;
+        }
+
+        return UINT64_C(2) << (B1_STATS_LATENCY_BUCKETS - 1);
+}
+
+static void top_print(Top *top, double interval) {
+        uint64_t latency[B1_STATS_LATENCY_BUCKETS], n_ioctls, n_received;
+        B1StatsPage now, *last;
+
+        printf("%7s %4s %10s %10s %10s %10s %8s %8s %7s %9s %9s %9s\n",
+               "PID", "FD", "SENT/s", "RECV/s", "RECV-KB/s", "IOCTL/s",
+               "NODES", "HANDLES", "SLICES", "POOL-KB", "P50-us", "P99-us");
+
+        for (size_t i = 0; i < top->n_peers; i++) {
+                last = &top->peers[i].last;
+                b1_stats_read(top->peers[i].page, &now);
+
+                n_ioctls = 0;
+                for (unsigned int j = 0; j < _B1_STATS_IOCTL_N; j++)
+                        n_ioctls += now.n_ioctls[j] - last->n_ioctls[j];
+
+                n_received = 0;
+                for (unsigned int j = 0; j < B1_STATS_LATENCY_BUCKETS; j++) {
+                        latency[j] = now.latency[j] - last->latency[j];
+                        n_received += latency[j];
+                }
+
+                printf("%7d %4d %10.0f %10.0f %10.1f %10.0f %8" PRId64 " %8" PRId64 " %7" PRIu64 " %9" PRIu64 " %9.1f %9.1f\n",
+                       now.pid, now.fd,
+                       (now.n_sent - last->n_sent) / interval,
+                       (now.n_received - last->n_received) / interval,
+                       (now.n_received_bytes - last->n_received_bytes) / 1024.0 / interval,
+                       n_ioctls / interval,
+                       (int64_t)now.n_nodes, (int64_t)now.n_handles,
+                       now.n_pool_slices, now.n_pool_bytes / 1024,
+                       top_percentile(latency, n_received, 50) / 1000.0,
+                       top_percentile(latency, n_received, 99) / 1000.0);
+
+                *last = now;
+        }
+}
+
+static void top_deinit(Top *top) {
+        while (top->n_peers)
+                top_remove_peer(top, top->n_peers - 1);
+        free(top->peers);
+}
+
+static void help(void) {
+        printf("%s [OPTIONS...]\n\n"
+               "Monitor bus1 peers that publish their stats.\n\n"
+               "  -h --help                  Show this help\n"
+               "  -d --delay SECONDS         Delay between updates (default: 1)\n"
+               "  -n --iterations N          Exit after N updates\n"
+               "  -b --batch                 Do not clear the screen between updates\n",
+               program_invocation_short_name);
+}
+
+int main(int argc, char **argv) {
+        static const struct option options[] = {
+                { "help",       no_argument,            NULL,   'h' },
+                { "delay",      required_argument,      NULL,   'd' },
+                { "iterations", required_argument,      NULL,   'n' },
+                { "batch",      no_argument,            NULL,   'b' },
+                {}
+        };
+        uint64_t start, end, n_iterations = 0;
+        double delay = 1;
+        bool batch = false;
+        Top top = {};
+        int c, r = 0;
+
+        while ((c = getopt_long(argc, argv, "hd:n:b", options, NULL)) >= 0) {
+                switch (c) {
+                case 'h':
+                        help();
+                        return 0;
+                case 'd':
+                        delay = strtod(optarg, NULL);
+                        if (delay <= 0) {
+                                fprintf(stderr, "Invalid delay: %s\n", optarg);
+                                return 1;
+                        }
+                        break;
+                case 'n':
+                        n_iterations = strtoull(optarg, NULL, 10);
+                        break;
+                case 'b':
+                        batch = true;
+                        break;
+                default:
+                        return 1;
+                }
+        }
+
+        r = top_scan(&top);
+        start = b1_stats_now();
+
+        for (uint64_t i = 0; r >= 0 && (!n_iterations || i < n_iterations); i++) {
+                usleep(delay * 1000000);
+
+                end = b1_stats_now();
+                if (!batch)
+                        printf("\033[H\033[2J");
+
+                top_print(&top, (end - start) / 1e9);
+                fflush(stdout);
+                start = end;
+
+                r = top_scan(&top);
+        }
+
+        if (r < 0)
+                fprintf(stderr, "Cannot list %s: %s\n", B1_STATS_DIRECTORY, strerror(-r));
+
+        top_deinit(&top);
+
+        return r < 0 ? 1 : 0;
+}
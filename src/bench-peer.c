@@ -0,0 +1,975 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+/*
+ * Peer Benchmarks
+ *
+ * Each benchmark runs a fixed number of iterations of a hot path and prints
+ * the average wall-clock time per iteration.
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <c-macro.h>
+#include <linux/bus1.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#include "org.bus1/b1-peer.h"
+
+#define BENCH_ITERATIONS (100000)
+
+static uint64_t bench_now(void) {
+        struct timespec ts;
+
+        assert(clock_gettime(CLOCK_MONOTONIC, &ts) >= 0);
+
+        return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static uint64_t bench_faults(void) {
+        struct rusage usage;
+
+        assert(getrusage(RUSAGE_SELF, &usage) >= 0);
+
+        return usage.ru_minflt + usage.ru_majflt;
+}
+
+static void bench_report(const char *name, uint64_t nsecs, size_t n) {
+        printf("%-40s %10.1f ns/op\n", name, (double)nsecs / n);
+}
+
+static void bench_report_faults(const char *name, uint64_t nsecs, uint64_t faults, size_t n) {
+        printf("%-40s %10.1f ns/op %10.3f faults/op\n", name, (double)nsecs / n, (double)faults / n);
+}
+
+static uint64_t bench_send_recv_one(uint64_t flags, size_t n_payload, uint64_t *faultsp) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        uint64_t start, nsecs, faults;
+        uint8_t payload[n_payload];
+        struct iovec vec = {
+                .iov_base = payload,
+                .iov_len = n_payload,
+        };
+        int r;
+
+        memset(payload, 0, n_payload);
+
+        r = b1_peer_new_with_flags(&src, flags);
+        assert(r >= 0);
+
+        r = b1_peer_new_with_flags(&dst, flags);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
+        assert(r >= 0);
+
+        /* map the pool outside of the measurement */
+        r = b1_peer_recv(dst, &message);
+        assert(r == -EAGAIN);
+
+        faults = bench_faults();
+        start = bench_now();
+
+        for (unsigned int i = 0; i < BENCH_ITERATIONS; i++) {
+                r = b1_message_new(src, &message);
+                assert(r >= 0);
+
+                r = b1_message_set_payload(message, &vec, 1);
+                assert(r >= 0);
+
+                r = b1_message_send(message, &handle, 1);
+                assert(r >= 0);
+
+                message = b1_message_unref(message);
+
+                r = b1_peer_recv(dst, &message);
+                assert(r >= 0);
+
+                message = b1_message_unref(message);
+        }
+
+        nsecs = bench_now() - start;
+
+        if (faultsp)
+                *faultsp = bench_faults() - faults;
+
+        return nsecs;
+}
+
+static void bench_send_recv(void) {
+        bench_report("send/recv (atomic refs)",
+                     bench_send_recv_one(0, 8, NULL),
+                     BENCH_ITERATIONS);
+        bench_report("send/recv (single-threaded refs)",
+                     bench_send_recv_one(B1_PEER_FLAG_SINGLE_THREADED, 8, NULL),
+                     BENCH_ITERATIONS);
+}
+
+static void bench_pool(void) {
+        static const struct {
+                const char *name;
+                uint64_t flags;
+        } configs[] = {
+                { "recv 4KiB (default pool)", 0 },
+                { "recv 4KiB (populated pool)", B1_PEER_FLAG_POOL_POPULATE },
+                { "recv 4KiB (hugepage pool)", B1_PEER_FLAG_POOL_HUGEPAGE },
+                { "recv 4KiB (node-local pool)", B1_PEER_FLAG_POOL_LOCAL },
+                { "recv 4KiB (all pool options)", B1_PEER_FLAG_POOL_POPULATE |
+                                                  B1_PEER_FLAG_POOL_HUGEPAGE |
+                                                  B1_PEER_FLAG_POOL_LOCAL },
+        };
+        uint64_t nsecs, faults;
+
+        for (size_t i = 0; i < C_ARRAY_SIZE(configs); i++) {
+                nsecs = bench_send_recv_one(configs[i].flags, 4096, &faults);
+                bench_report_faults(configs[i].name, nsecs, faults, BENCH_ITERATIONS);
+        }
+}
+
+static uint64_t bench_startup_one(B1PeerFactory *factory, B1Handle *dst_handle) {
+        uint64_t payload = 0, start, nsecs = 0;
+        struct iovec vec = {
+                .iov_base = &payload,
+                .iov_len = sizeof(payload),
+        };
+        B1Peer *dst = b1_handle_get_peer(dst_handle);
+        int r;
+
+        for (unsigned int i = 0; i < BENCH_ITERATIONS / 100; i++) {
+                _c_cleanup_(b1_peer_unrefp) B1Peer *peer = NULL;
+                _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
+                _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+
+                start = bench_now();
+
+                if (factory)
+                        r = b1_peer_factory_take(factory, &peer);
+                else
+                        r = b1_peer_new(&peer);
+                assert(r >= 0);
+
+                r = b1_handle_transfer(dst_handle, peer, &handle);
+                assert(r >= 0);
+
+                r = b1_message_new(peer, &message);
+                assert(r >= 0);
+
+                r = b1_message_set_payload(message, &vec, 1);
+                assert(r >= 0);
+
+                r = b1_message_send(message, &handle, 1);
+                assert(r >= 0);
+
+                nsecs += bench_now() - start;
+
+                if (factory) {
+                        r = b1_peer_factory_fill(factory);
+                        assert(r >= 0);
+                }
+
+                message = b1_message_unref(message);
+                handle = b1_handle_unref(handle);
+                peer = b1_peer_unref(peer);
+
+                /* drain the message and the release notification */
+                while (b1_peer_recv(dst, &message) >= 0)
+                        message = b1_message_unref(message);
+        }
+
+        return nsecs;
+}
+
+static void bench_startup(void) {
+        _c_cleanup_(b1_peer_factory_freep) B1PeerFactory *factory = NULL;
+        _c_cleanup_(b1_peer_unrefp) B1Peer *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        int r;
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
+
+        r = b1_peer_factory_new(&factory, 4, 0, true);
+        assert(r >= 0);
+
+        bench_report("startup to first send (b1_peer_new)",
+                     bench_startup_one(NULL, b1_node_get_handle(node)),
+                     BENCH_ITERATIONS / 100);
+        bench_report("startup to first send (factory)",
+                     bench_startup_one(factory, b1_node_get_handle(node)),
+                     BENCH_ITERATIONS / 100);
+}
+
+static void bench_transfer(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
+        B1Handle *tmp;
+        uint64_t start;
+        int r;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_node_new(src, &node);
+        assert(r >= 0);
+
+        /* keep one reference, so the destination handle stays cached */
+        r = b1_handle_transfer(b1_node_get_handle(node), dst, &handle);
+        assert(r >= 0);
+
+        start = bench_now();
+
+        for (unsigned int i = 0; i < BENCH_ITERATIONS; i++) {
+                r = b1_handle_transfer(b1_node_get_handle(node), dst, &tmp);
+                assert(r >= 0);
+                assert(tmp == handle);
+
+                b1_handle_unref(tmp);
+        }
+
+        bench_report("repeated handle transfer", bench_now() - start, BENCH_ITERATIONS);
+}
+
+static uint64_t bench_first_send_one(bool reserve) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        B1Message *message;
+        uint64_t start, nsecs = 0;
+        int r;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        for (unsigned int i = 0; i < BENCH_ITERATIONS / 100; i++) {
+                _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+                B1Handle *tmp;
+
+                if (reserve) {
+                        r = b1_peer_reserve_nodes(dst, 1);
+                        assert(r >= 0);
+                }
+
+                start = bench_now();
+
+                r = b1_node_new(dst, &node);
+                assert(r >= 0);
+
+                r = b1_handle_transfer(b1_node_get_handle(node), src, &tmp);
+                assert(r >= 0);
+
+                nsecs += bench_now() - start;
+
+                b1_handle_unref(tmp);
+                node = b1_node_free(node);
+
+                while (b1_peer_recv(dst, &message) >= 0)
+                        b1_message_unref(message);
+        }
+
+        return nsecs;
+}
+
+static void bench_first_send(void) {
+        bench_report("node to first transfer (lazy)",
+                     bench_first_send_one(false), BENCH_ITERATIONS / 100);
+        bench_report("node to first transfer (reserved)",
+                     bench_first_send_one(true), BENCH_ITERATIONS / 100);
+}
+
+static uint64_t bench_forward_one(bool forward) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *router = NULL, *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *router_node = NULL, *dst_node = NULL, *node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *router_handle = NULL, *dst_handle = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        uint8_t payload[1024] = {};
+        struct iovec vec = {
+                .iov_base = payload,
+                .iov_len = sizeof(payload),
+        };
+        B1Handle *handle;
+        uint64_t start, nsecs = 0;
+        int r, fd;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&router);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_node_new(router, &router_node);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &dst_node);
+        assert(r >= 0);
+
+        r = b1_node_new(src, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(router_node), src, &router_handle);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(dst_node), router, &dst_handle);
+        assert(r >= 0);
+
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        r = b1_message_set_payload(message, &vec, 1);
+        assert(r >= 0);
+
+        handle = b1_node_get_handle(node);
+        r = b1_message_set_handles(message, &handle, 1);
+        assert(r >= 0);
+
+        fd = b1_peer_get_fd(src);
+        r = b1_message_set_fds(message, &fd, 1);
+        assert(r >= 0);
+
+        for (unsigned int i = 0; i < BENCH_ITERATIONS / 10; i++) {
+                B1Message *received, *copy;
+                struct iovec *vecs;
+                size_t n_vecs;
+
+                r = b1_message_send(message, &router_handle, 1);
+                assert(r >= 0);
+
+                r = b1_peer_recv(router, &received);
+                assert(r >= 0);
+
+                start = bench_now();
+
+                if (forward) {
+                        r = b1_message_forward(received, &dst_handle, 1);
+                        assert(r >= 0);
+                } else {
+                        r = b1_message_new(router, &copy);
+                        assert(r >= 0);
+
+                        r = b1_message_get_payload(received, &vecs, &n_vecs);
+                        assert(r >= 0);
+                        r = b1_message_set_payload(copy, vecs, n_vecs);
+                        assert(r >= 0);
+
+                        r = b1_message_get_handle(received, 0, &handle);
+                        assert(r >= 0);
+                        r = b1_message_set_handles(copy, &handle, 1);
+                        assert(r >= 0);
+
+                        r = b1_message_get_fd(received, 0, &fd);
+                        assert(r >= 0);
+                        r = b1_message_set_fds(copy, &fd, 1);
+                        assert(r >= 0);
+
+                        r = b1_message_send(copy, &dst_handle, 1);
+                        assert(r >= 0);
+
+                        b1_message_unref(copy);
+                }
+
+                nsecs += bench_now() - start;
+
+                b1_message_unref(received);
+
+                r = b1_peer_recv(dst, &received);
+                assert(r >= 0);
+                b1_message_unref(received);
+
+                while (b1_peer_discard(src) >= 0)
+                        ;
+        }
+
+        return nsecs;
+}
+
+static void bench_forward(void) {
+        bench_report("forward 1KiB, 1 handle, 1 fd (rebuild)",
+                     bench_forward_one(false), BENCH_ITERATIONS / 10);
+        bench_report("forward 1KiB, 1 handle, 1 fd (forward)",
+                     bench_forward_one(true), BENCH_ITERATIONS / 10);
+}
+
+static uint64_t bench_drop_one(bool discard) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        B1Node *nodes[4] = {};
+        B1Handle *handles[4];
+        uint64_t start, nsecs = 0;
+        int r;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
+        assert(r >= 0);
+
+        for (unsigned int i = 0; i < C_ARRAY_SIZE(nodes); i++) {
+                r = b1_node_new(src, &nodes[i]);
+                assert(r >= 0);
+
+                handles[i] = b1_node_get_handle(nodes[i]);
+        }
+
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        r = b1_message_set_handles(message, handles, C_ARRAY_SIZE(handles));
+        assert(r >= 0);
+
+        for (unsigned int i = 0; i < BENCH_ITERATIONS / 10; i++) {
+                B1Message *received;
+
+                r = b1_message_send(message, &handle, 1);
+                assert(r >= 0);
+
+                start = bench_now();
+
+                if (discard) {
+                        r = b1_peer_discard(dst);
+                        assert(r >= 0);
+                } else {
+                        r = b1_peer_recv(dst, &received);
+                        assert(r >= 0);
+                        b1_message_unref(received);
+                }
+
+                nsecs += bench_now() - start;
+
+                /* drain the release notifications of the payload handles */
+                while (b1_peer_discard(src) >= 0)
+                        ;
+        }
+
+        message = b1_message_unref(message);
+
+        for (unsigned int i = 0; i < C_ARRAY_SIZE(nodes); i++)
+                b1_node_free(nodes[i]);
+
+        return nsecs;
+}
+
+static void bench_drop(void) {
+        bench_report("drop message with 4 handles (recv)",
+                     bench_drop_one(false), BENCH_ITERATIONS / 10);
+        bench_report("drop message with 4 handles (discard)",
+                     bench_drop_one(true), BENCH_ITERATIONS / 10);
+}
+
+#define BENCH_TEARDOWN_NODES (16384)
+
+static uint64_t bench_teardown_one(bool reset) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *peer = NULL;
+        static B1Node *nodes[BENCH_TEARDOWN_NODES];
+        uint64_t start;
+        int r;
+
+        r = b1_peer_new(&peer);
+        assert(r >= 0);
+
+        r = b1_peer_reserve_nodes(peer, BENCH_TEARDOWN_NODES);
+        assert(r >= 0);
+
+        for (size_t i = 0; i < BENCH_TEARDOWN_NODES; i++) {
+                r = b1_node_new(peer, &nodes[i]);
+                assert(r >= 0);
+        }
+
+        start = bench_now();
+
+        if (reset) {
+                r = b1_peer_reset(peer, 0);
+                assert(r >= 0);
+        }
+
+        for (size_t i = 0; i < BENCH_TEARDOWN_NODES; i++)
+                nodes[i] = b1_node_free(nodes[i]);
+
+        return bench_now() - start;
+}
+
+static void bench_teardown(void) {
+        bench_report("teardown per node (one by one)",
+                     bench_teardown_one(false), BENCH_TEARDOWN_NODES);
+        bench_report("teardown per node (peer reset)",
+                     bench_teardown_one(true), BENCH_TEARDOWN_NODES);
+}
+
+static uint64_t bench_bootstrap_one(B1Handle **handles, size_t n_handles, bool batch) {
+        B1Peer *src = b1_handle_get_peer(handles[0]);
+        B1Handle *dst_handles[n_handles];
+        B1Message *message;
+        uint64_t start, nsecs = 0;
+        int r;
+
+        for (unsigned int i = 0; i < 16; i++) {
+                _c_cleanup_(b1_peer_unrefp) B1Peer *dst = NULL;
+
+                r = b1_peer_new(&dst);
+                assert(r >= 0);
+
+                start = bench_now();
+
+                if (batch) {
+                        r = b1_handles_transfer(handles, n_handles, dst, dst_handles);
+                        assert(r >= 0);
+                } else {
+                        for (size_t j = 0; j < n_handles; j++) {
+                                r = b1_handle_transfer(handles[j], dst, &dst_handles[j]);
+                                assert(r >= 0);
+                        }
+                }
+
+                nsecs += bench_now() - start;
+
+                for (size_t j = 0; j < n_handles; j++)
+                        b1_handle_unref(dst_handles[j]);
+
+                /* drain the release notifications */
+                while (b1_peer_recv(src, &message) >= 0)
+                        b1_message_unref(message);
+        }
+
+        return nsecs / 16;
+}
+
+static void bench_bootstrap(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL;
+        static const size_t sizes[] = { 1, 16, 256, 2048 };
+        static B1Node *nodes[2048];
+        static B1Handle *handles[2048];
+        char name[64];
+        int r;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        for (size_t i = 0; i < C_ARRAY_SIZE(nodes); i++) {
+                r = b1_node_new(src, &nodes[i]);
+                assert(r >= 0);
+
+                handles[i] = b1_node_get_handle(nodes[i]);
+        }
+
+        for (size_t i = 0; i < C_ARRAY_SIZE(sizes); i++) {
+                snprintf(name, sizeof(name), "bootstrap %zu handles (one by one)", sizes[i]);
+                bench_report(name, bench_bootstrap_one(handles, sizes[i], false), 1);
+                snprintf(name, sizeof(name), "bootstrap %zu handles (batched)", sizes[i]);
+                bench_report(name, bench_bootstrap_one(handles, sizes[i], true), 1);
+        }
+
+        for (size_t i = 0; i < C_ARRAY_SIZE(nodes); i++)
+                nodes[i] = b1_node_free(nodes[i]);
+}
+
+#define BENCH_EXECUTOR_PEERS (64)
+#define BENCH_EXECUTOR_MESSAGES (64)
+
+static void bench_executor_fn(B1Peer *peer, B1Message *message, void *userdata) {
+        atomic_fetch_add_explicit((_Atomic uint64_t *)userdata, 1, memory_order_relaxed);
+}
+
+static uint64_t bench_executor_one(size_t n_workers, uint64_t *n_stealsp) {
+        _c_cleanup_(b1_executor_freep) B1Executor *executor = NULL;
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        B1Peer *dsts[BENCH_EXECUTOR_PEERS] = {};
+        B1Node *nodes[BENCH_EXECUTOR_PEERS] = {};
+        B1Handle *handles[BENCH_EXECUTOR_PEERS] = {};
+        _Atomic uint64_t n_received = 0;
+        uint64_t start, nsecs;
+        int r;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_executor_new(&executor, n_workers, true, bench_executor_fn, &n_received);
+        assert(r >= 0);
+
+        /*
+         * Place peers unevenly: half of them on the first worker, the rest
+         * spread over all workers. Idle workers have to steal to keep up.
+         */
+        for (unsigned int i = 0; i < BENCH_EXECUTOR_PEERS; i++) {
+                r = b1_peer_new_with_flags(&dsts[i], B1_PEER_FLAG_SINGLE_THREADED);
+                assert(r >= 0);
+
+                r = b1_node_new(dsts[i], &nodes[i]);
+                assert(r >= 0);
+
+                r = b1_handle_transfer(b1_node_get_handle(nodes[i]), src, &handles[i]);
+                assert(r >= 0);
+
+                r = b1_executor_add_peer(executor, dsts[i],
+                                         (i % 2) ? 0 : (i / 2) % n_workers);
+                assert(r >= 0);
+        }
+
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        for (unsigned int i = 0; i < BENCH_EXECUTOR_MESSAGES; i++) {
+                r = b1_message_send(message, handles, BENCH_EXECUTOR_PEERS);
+                assert(r >= 0);
+        }
+
+        start = bench_now();
+
+        r = b1_executor_start(executor);
+        assert(r >= 0);
+
+        while (atomic_load_explicit(&n_received, memory_order_relaxed) <
+               BENCH_EXECUTOR_PEERS * BENCH_EXECUTOR_MESSAGES)
+                sched_yield();
+
+        nsecs = bench_now() - start;
+
+        b1_executor_get_stats(executor, NULL, n_stealsp);
+        executor = b1_executor_free(executor);
+
+        for (unsigned int i = 0; i < BENCH_EXECUTOR_PEERS; i++) {
+                b1_handle_unref(handles[i]);
+                b1_node_free(nodes[i]);
+                b1_peer_unref(dsts[i]);
+        }
+
+        return nsecs;
+}
+
+static void bench_executor(void) {
+        long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        uint64_t nsecs, n_steals;
+        char name[64];
+
+        for (size_t n_workers = 1; n_workers <= 64 && n_workers <= (size_t)n_cpus; n_workers *= 2) {
+                nsecs = bench_executor_one(n_workers, &n_steals);
+
+                snprintf(name, sizeof(name), "executor dispatch (%zu workers)", n_workers);
+                printf("%-40s %10.1f ns/op %10" PRIu64 " steals\n",
+                       name, (double)nsecs / (BENCH_EXECUTOR_PEERS * BENCH_EXECUTOR_MESSAGES),
+                       n_steals);
+        }
+}
+
+static uint64_t bench_flow_one(size_t n_window) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL, *credit = NULL;
+        _c_cleanup_(b1_flow_freep) B1Flow *flow = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        B1Message *received;
+        uint8_t payload[64] = {};
+        uint64_t start, end;
+        size_t n_consumed = 0;
+        int r;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
+        assert(r >= 0);
+
+        r = b1_flow_new(&flow, handle, n_window, 0);
+        assert(r >= 0);
+
+        r = b1_peer_recv(dst, &received);
+        assert(r >= 0);
+        r = b1_flow_accept(received, &credit);
+        assert(r >= 0);
+        b1_message_unref(received);
+
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        r = b1_message_set_payload(message, &(struct iovec){ payload, sizeof(payload) }, 1);
+        assert(r >= 0);
+
+        /* fill the window, drain it, and grant credits in batches of half a window */
+        start = bench_now();
+        for (unsigned int i = 0; i < BENCH_ITERATIONS; i++) {
+                r = b1_flow_send(flow, message, false);
+                if (r == -EAGAIN) {
+                        while (b1_peer_recv(dst, &received) >= 0) {
+                                b1_message_unref(received);
+                                if (++n_consumed >= (n_window + 1) / 2) {
+                                        r = b1_flow_grant(credit, n_consumed);
+                                        assert(r >= 0);
+                                        n_consumed = 0;
+                                }
+                        }
+
+                        if (n_consumed) {
+                                r = b1_flow_grant(credit, n_consumed);
+                                assert(r >= 0);
+                                n_consumed = 0;
+                        }
+
+                        r = b1_flow_send(flow, message, true);
+                }
+                assert(r == 0);
+        }
+        end = bench_now();
+
+        return end - start;
+}
+
+static void bench_flow(void) {
+        bench_report("send flow-controlled, window 16",
+                     bench_flow_one(16), BENCH_ITERATIONS);
+        bench_report("send flow-controlled, window 256",
+                     bench_flow_one(256), BENCH_ITERATIONS);
+}
+
+static uint64_t bench_send_queue_one(size_t n_batch) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
+        _c_cleanup_(b1_send_queue_freep) B1SendQueue *queue = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        B1Message *received;
+        uint8_t payload[64] = {};
+        uint64_t start, end;
+        int r;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
+        assert(r >= 0);
+
+        r = b1_send_queue_new(&queue, src, NULL, NULL);
+        assert(r >= 0);
+
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        r = b1_message_set_payload(message, &(struct iovec){ payload, sizeof(payload) }, 1);
+        assert(r >= 0);
+
+        start = bench_now();
+        for (unsigned int i = 0; i < BENCH_ITERATIONS / n_batch; i++) {
+                for (unsigned int j = 0; j < n_batch; j++) {
+                        r = b1_send_queue_push(queue, message, &handle, 1);
+                        assert(r >= 0);
+                }
+
+                r = b1_send_queue_dispatch(queue);
+                assert(r == 0);
+
+                for (unsigned int j = 0; j < n_batch; j++) {
+                        r = b1_peer_recv(dst, &received);
+                        assert(r >= 0);
+                        b1_message_unref(received);
+                }
+        }
+        end = bench_now();
+
+        return end - start;
+}
+
+static void bench_send_queue(void) {
+        bench_report("send queue, batch 1",
+                     bench_send_queue_one(1), BENCH_ITERATIONS);
+        bench_report("send queue, batch 64",
+                     bench_send_queue_one(64), BENCH_ITERATIONS / 64 * 64);
+}
+
+static uint64_t bench_send_handles_one(size_t n_handles) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        B1Node *nodes[n_handles];
+        B1Handle *handles[n_handles];
+        uint64_t start, nsecs = 0;
+        int r;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
+        assert(r >= 0);
+
+        for (size_t i = 0; i < n_handles; i++) {
+                r = b1_node_new(src, &nodes[i]);
+                assert(r >= 0);
+
+                handles[i] = b1_node_get_handle(nodes[i]);
+        }
+
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        r = b1_message_set_handles(message, handles, n_handles);
+        assert(r >= 0);
+
+        /* only the send is measured, the receiver drops the handles */
+        for (unsigned int i = 0; i < BENCH_ITERATIONS / 10; i++) {
+                start = bench_now();
+
+                r = b1_message_send(message, &handle, 1);
+                assert(r >= 0);
+
+                nsecs += bench_now() - start;
+
+                r = b1_peer_discard(dst);
+                assert(r >= 0);
+        }
+
+        message = b1_message_unref(message);
+        for (size_t i = 0; i < n_handles; i++)
+                b1_node_free(nodes[i]);
+
+        return nsecs;
+}
+
+static void bench_send_handles(void) {
+        bench_report("send, 1 handle",
+                     bench_send_handles_one(1), BENCH_ITERATIONS / 10);
+        bench_report("send, 16 handles",
+                     bench_send_handles_one(16), BENCH_ITERATIONS / 10);
+        bench_report("send, 256 handles",
+                     bench_send_handles_one(256), BENCH_ITERATIONS / 10);
+}
+
+static uint64_t bench_messages_send_one(size_t n_batch, bool batched) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
+        B1Message *messages[n_batch];
+        B1Handle **destinations[n_batch];
+        size_t n_destinations[n_batch], n_sent;
+        uint64_t payload = 0, start, nsecs = 0;
+        int r;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
+        assert(r >= 0);
+
+        for (size_t i = 0; i < n_batch; i++) {
+                r = b1_message_new(src, &messages[i]);
+                assert(r >= 0);
+
+                r = B1_MESSAGE_SET_PAYLOAD(messages[i], &payload);
+                assert(r >= 0);
+
+                destinations[i] = &handle;
+                n_destinations[i] = 1;
+        }
+
+        /* only the sends are measured, the receiver drops the messages */
+        for (unsigned int i = 0; i < BENCH_ITERATIONS / n_batch; i++) {
+                start = bench_now();
+
+                if (batched) {
+                        n_sent = b1_messages_send(messages, destinations, n_destinations, n_batch, NULL);
+                        assert(n_sent == n_batch);
+                } else {
+                        for (size_t j = 0; j < n_batch; j++) {
+                                r = b1_message_send(messages[j], destinations[j], n_destinations[j]);
+                                assert(r >= 0);
+                        }
+                }
+
+                nsecs += bench_now() - start;
+
+                for (size_t j = 0; j < n_batch; j++) {
+                        r = b1_peer_discard(dst);
+                        assert(r >= 0);
+                }
+        }
+
+        for (size_t i = 0; i < n_batch; i++)
+                b1_message_unref(messages[i]);
+
+        return nsecs;
+}
+
+static void bench_messages_send(void) {
+        bench_report("send 64 messages, looped",
+                     bench_messages_send_one(64, false), BENCH_ITERATIONS / 64 * 64);
+        bench_report("send 64 messages, batched",
+                     bench_messages_send_one(64, true), BENCH_ITERATIONS / 64 * 64);
+}
+
+int main(int argc, char **argv) {
+        if (access("/dev/bus1", F_OK) < 0 && errno == ENOENT)
+                return 77;
+
+        bench_send_recv();
+        bench_pool();
+        bench_startup();
+        bench_transfer();
+        bench_bootstrap();
+        bench_first_send();
+        bench_teardown();
+        bench_drop();
+        bench_forward();
+        bench_executor();
+        bench_flow();
+        bench_send_queue();
+        bench_send_handles();
+        bench_messages_send();
+
+        return 0;
+}
@@ -109,10 +109,37 @@ _public_ int bus1_peer_ioctl(struct bus1_peer *peer,
 	return r >= 0 ? r : -errno;
 }
 
+_public_ int bus1_peer_submit(struct bus1_peer *peer,
+			      struct bus1_peer_cmd *cmds,
+			      size_t n_cmds)
+{
+	int r = 0;
+	size_t i;
+
+	/*
+	 * Run a batch of commands in order. Each command is run regardless of
+	 * whether earlier ones failed, and reports its own result. The return
+	 * value is the result of the first failed command, if any.
+	 *
+	 * The bus1 driver provides no batched entry point, nor does it
+	 * implement the io_uring command passthrough, so this currently issues
+	 * one ioctl per command. Callers that submit their commands in batches
+	 * get to benefit transparently, once the kernel side exists.
+	 */
+
+	for (i = 0; i < n_cmds; ++i) {
+		cmds[i].result = bus1_peer_ioctl(peer, cmds[i].cmd,
+						 cmds[i].arg);
+		if (cmds[i].result < 0 && r >= 0)
+			r = cmds[i].result;
+	}
+
+	return r;
+}
+
 _public_ int bus1_peer_mmap(struct bus1_peer *peer)
 {
 	const void *pool, *old_pool;
-	size_t pool_size;
 
 	/*
 	 * MMap the pool of @peer with size @pool_size. Note that this might
@@ -134,10 +161,8 @@ _public_ int bus1_peer_mmap(struct bus1_peer *peer)
 	 */
 
 	/* fastpath: sync'ed with atomic exchange (__ATOMIC_RELEASE) */
-	if (__atomic_load_n(&peer->pool, __ATOMIC_ACQUIRE)) {
-		assert(pool_size == peer->pool_size);
+	if (__atomic_load_n(&peer->pool, __ATOMIC_ACQUIRE))
 		return 0;
-	}
 
 	pool = mmap(NULL, peer->pool_size, PROT_READ, MAP_SHARED,
 		    peer->fd, 0);
@@ -155,9 +180,9 @@ _public_ int bus1_peer_mmap(struct bus1_peer *peer)
 	return 0;
 }
 
-_public_ int bus1_peer_reset(struct bus1_peer *peer)
+_public_ int bus1_peer_reset(struct bus1_peer *peer, uint64_t flags)
 {
-	return bus1_peer_ioctl(peer, BUS1_CMD_PEER_RESET, NULL);
+	return bus1_peer_ioctl(peer, BUS1_CMD_PEER_RESET, &flags);
 }
 
 _public_ int bus1_peer_handle_transfer(struct bus1_peer *src,
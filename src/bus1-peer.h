@@ -37,6 +37,17 @@ extern "C" {
 
 struct bus1_peer;
 
+/*
+ * A command submitted as part of a batch via bus1_peer_submit(). @cmd is the
+ * ioctl number and @arg its argument, @result receives the return value of
+ * the command.
+ */
+struct bus1_peer_cmd {
+	unsigned int cmd;
+	void *arg;
+	int result;
+};
+
 int bus1_peer_new_from_fd(struct bus1_peer **peerp, int fd);
 int bus1_peer_new_from_path(struct bus1_peer **peerp, const char *path);
 struct bus1_peer *bus1_peer_free(struct bus1_peer *peer);
@@ -46,8 +57,11 @@ size_t bus1_peer_get_pool_size(struct bus1_peer *peer);
 const void *bus1_peer_get_pool(struct bus1_peer *peer);
 
 int bus1_peer_ioctl(struct bus1_peer *peer, unsigned int cmd, void *arg);
+int bus1_peer_submit(struct bus1_peer *peer,
+		     struct bus1_peer_cmd *cmds,
+		     size_t n_cmds);
 int bus1_peer_mmap(struct bus1_peer *peer);
-int bus1_peer_reset(struct bus1_peer *peer);
+int bus1_peer_reset(struct bus1_peer *peer, uint64_t flags);
 int bus1_peer_handle_transfer(struct bus1_peer *src,
 			      struct bus1_peer *dst,
 			      uint64_t *src_handlep,
@@ -0,0 +1,326 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <assert.h>
+#include <c-macro.h>
+#include "capture.h"
+#include <errno.h>
+#include <fcntl.h>
+#include "message.h"
+#include "node.h"
+#include "peer.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * The capture is process-wide. Recording threads pin the active capture by
+ * counting themselves as users, and b1_capture_stop() waits for all of them
+ * before unmapping the log. While no capture runs, recording costs a single
+ * relaxed load.
+ */
+static pthread_mutex_t b1_capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static B1Capture *_Atomic b1_capture;
+static _Atomic unsigned long b1_capture_users;
+
+static uint64_t b1_capture_now(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static B1Capture *b1_capture_acquire(void) {
+        B1Capture *capture;
+
+        if (_c_likely_(!atomic_load_explicit(&b1_capture, memory_order_relaxed)))
+                return NULL;
+
+        atomic_fetch_add_explicit(&b1_capture_users, 1, memory_order_seq_cst);
+
+        capture = atomic_load_explicit(&b1_capture, memory_order_seq_cst);
+        if (!capture)
+                atomic_fetch_sub_explicit(&b1_capture_users, 1, memory_order_release);
+
+        return capture;
+}
+
+static void b1_capture_release(void) {
+        atomic_fetch_sub_explicit(&b1_capture_users, 1, memory_order_release);
+}
+
+static void b1_capture_write(B1Capture *capture,
+                             uint16_t kind,
+                             uint16_t type,
+                             int peer,
+                             const uint64_t *ids,
+                             size_t n_ids,
+                             uint64_t n_bytes,
+                             size_t n_handles,
+                             size_t n_fds,
+                             const struct iovec *vecs,
+                             size_t n_vecs) {
+        B1CaptureHeader *header = (B1CaptureHeader *)capture->map;
+        B1CaptureRecord *record;
+        uint64_t offset, n_payload = 0;
+        size_t size;
+        uint8_t *p;
+
+        if (vecs && (capture->flags & B1_CAPTURE_FLAG_PAYLOAD))
+                n_payload = n_bytes;
+
+        size = c_align_to(sizeof(*record) + n_ids * sizeof(uint64_t) + n_payload, 8);
+
+        offset = atomic_fetch_add_explicit(&header->n_bytes, size, memory_order_relaxed);
+        if (offset + size > capture->n_map) {
+                atomic_fetch_add_explicit(&header->n_dropped, 1, memory_order_relaxed);
+                return;
+        }
+
+        record = (B1CaptureRecord *)(capture->map + offset);
+        record->size = size;
+        record->kind = kind;
+        record->type = type;
+        record->timestamp = b1_capture_now() - capture->start;
+        record->peer = peer;
+        record->n_ids = n_ids;
+        record->n_bytes = n_bytes;
+        record->n_handles = n_handles;
+        record->n_fds = n_fds;
+        record->n_payload = n_payload;
+        memcpy(record->ids, ids, n_ids * sizeof(uint64_t));
+
+        p = (uint8_t *)(record->ids + n_ids);
+        for (size_t i = 0; n_payload && i < n_vecs; i++) {
+                memcpy(p, vecs[i].iov_base, vecs[i].iov_len);
+                p += vecs[i].iov_len;
+        }
+}
+
+void b1_capture_node(B1Node *node) {
+        B1Capture *capture;
+
+        capture = b1_capture_acquire();
+        if (!capture)
+                return;
+
+        b1_capture_write(capture, B1_CAPTURE_RECORD_NODE, 0,
+                         bus1_peer_get_fd(node->owner->peer),
+                         &node->id, 1, 0, 0, 0, NULL, 0);
+
+        b1_capture_release();
+}
+
+void b1_capture_transfer(B1Handle *src, B1Handle *dst) {
+        B1Capture *capture;
+        uint64_t ids[3];
+
+        capture = b1_capture_acquire();
+        if (!capture)
+                return;
+
+        ids[0] = src->id;
+        ids[1] = bus1_peer_get_fd(dst->holder->peer);
+        ids[2] = dst->id;
+
+        b1_capture_write(capture, B1_CAPTURE_RECORD_TRANSFER, 0,
+                         bus1_peer_get_fd(src->holder->peer),
+                         ids, C_ARRAY_SIZE(ids), 0, 0, 0, NULL, 0);
+
+        b1_capture_release();
+}
+
+void b1_capture_send(B1Message *message, B1Handle **destinations, size_t n_destinations) {
+        B1CaptureHeader *header;
+        B1Capture *capture;
+        uint64_t buffer[64], *ids = buffer;
+        uint64_t n_bytes = 0;
+
+        capture = b1_capture_acquire();
+        if (!capture)
+                return;
+
+        /* a record we cannot build is dropped, like one that does not fit */
+        if (n_destinations > C_ARRAY_SIZE(buffer)) {
+                ids = malloc(n_destinations * sizeof(*ids));
+                if (!ids) {
+                        header = (B1CaptureHeader *)capture->map;
+                        atomic_fetch_add_explicit(&header->n_dropped, 1, memory_order_relaxed);
+                        b1_capture_release();
+                        return;
+                }
+        }
+
+        for (size_t i = 0; i < n_destinations; i++)
+                ids[i] = destinations[i]->id;
+
+        for (size_t i = 0; i < message->n_vecs; i++)
+                n_bytes += message->vecs[i].iov_len;
+
+        b1_capture_write(capture, B1_CAPTURE_RECORD_SEND, message->type,
+                         bus1_peer_get_fd(message->peer->peer),
+                         ids, n_destinations, n_bytes,
+                         message->n_handles, message->n_fds,
+                         message->vecs, message->n_vecs);
+
+        if (ids != buffer)
+                free(ids);
+
+        b1_capture_release();
+}
+
+void b1_capture_recv(B1Message *message) {
+        B1Capture *capture;
+
+        capture = b1_capture_acquire();
+        if (!capture)
+                return;
+
+        b1_capture_write(capture, B1_CAPTURE_RECORD_RECV, message->type,
+                         bus1_peer_get_fd(message->peer->peer),
+                         &message->destination, 1,
+                         message->n_vecs ? message->vecs[0].iov_len : 0,
+                         message->n_handles, message->n_fds,
+                         NULL, 0);
+
+        b1_capture_release();
+}
+
+/**
+ * b1_capture_start() - start capturing traffic of the process
+ * @path:               path of the log file to create
+ * @n_bytes:            maximum size of the log
+ * @flags:              B1_CAPTURE_FLAG_* flags
+ *
+ * This records every message sent and received by any peer of the process,
+ * as well as node creation and handle transfers, so the peer and node topology
+ * can be recreated by the b1-replay tool. Records are appended to a shared
+ * memory mapping of @path, so recording does not involve any syscall. Once the
+ * log is full, further records are dropped and counted.
+ *
+ * Payloads are only recorded with B1_CAPTURE_FLAG_PAYLOAD, otherwise just
+ * their sizes are.
+ *
+ * Return: 0 on success, -EBUSY if a capture is running already, or a negative
+ *         error code on failure.
+ */
+_c_public_ int b1_capture_start(const char *path, size_t n_bytes, uint64_t flags) {
+        B1CaptureHeader *header;
+        B1Capture *capture;
+        int r;
+
+        assert(path);
+
+        if (n_bytes < sizeof(*header))
+                return -EINVAL;
+
+        pthread_mutex_lock(&b1_capture_lock);
+
+        if (atomic_load_explicit(&b1_capture, memory_order_relaxed)) {
+                r = -EBUSY;
+                goto exit;
+        }
+
+        capture = calloc(1, sizeof(*capture));
+        if (!capture) {
+                r = -ENOMEM;
+                goto exit;
+        }
+
+        capture->n_map = n_bytes;
+        capture->flags = flags;
+
+        capture->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (capture->fd < 0) {
+                r = -errno;
+                free(capture);
+                goto exit;
+        }
+
+        if (ftruncate(capture->fd, n_bytes) < 0) {
+                r = -errno;
+                goto error;
+        }
+
+        capture->map = mmap(NULL, n_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, capture->fd, 0);
+        if (capture->map == MAP_FAILED) {
+                r = -errno;
+                goto error;
+        }
+
+        header = (B1CaptureHeader *)capture->map;
+        header->magic = B1_CAPTURE_MAGIC;
+        header->version = B1_CAPTURE_VERSION;
+        header->flags = flags;
+        header->n_bytes = sizeof(*header);
+        header->n_dropped = 0;
+
+        capture->start = b1_capture_now();
+        atomic_store_explicit(&b1_capture, capture, memory_order_release);
+        r = 0;
+        goto exit;
+
+error:
+        close(capture->fd);
+        unlink(path);
+        free(capture);
+exit:
+        pthread_mutex_unlock(&b1_capture_lock);
+        return r;
+}
+
+/**
+ * b1_capture_stop() - stop capturing traffic
+ * @n_droppedp:         number of records that did not fit in the log, or NULL
+ *
+ * This waits for records being written concurrently, and truncates the log
+ * to the size actually used. If no capture is running, this is a no-op.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_capture_stop(uint64_t *n_droppedp) {
+        B1CaptureHeader *header;
+        B1Capture *capture;
+        uint64_t n_used;
+        int r = 0;
+
+        pthread_mutex_lock(&b1_capture_lock);
+
+        capture = atomic_exchange_explicit(&b1_capture, NULL, memory_order_seq_cst);
+        if (!capture) {
+                pthread_mutex_unlock(&b1_capture_lock);
+                return 0;
+        }
+
+        while (atomic_load_explicit(&b1_capture_users, memory_order_acquire))
+                sched_yield();
+
+        /* reservations past the end failed, and were never written */
+        header = (B1CaptureHeader *)capture->map;
+        n_used = c_min(atomic_load_explicit(&header->n_bytes, memory_order_relaxed), (uint64_t)capture->n_map);
+        header->n_bytes = n_used;
+
+        if (n_droppedp)
+                *n_droppedp = atomic_load_explicit(&header->n_dropped, memory_order_relaxed);
+
+        munmap(capture->map, capture->n_map);
+        if (ftruncate(capture->fd, n_used) < 0)
+                r = -errno;
+
+        close(capture->fd);
+        free(capture);
+
+        pthread_mutex_unlock(&b1_capture_lock);
+        return r;
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+/*
+ * Capture Log Format
+ *
+ * A capture log starts with a B1CaptureHeader, followed by a sequence of
+ * B1CaptureRecord entries, each padded to a multiple of 8 bytes. A record of
+ * size 0 terminates the log early. All values are in host byte order.
+ *
+ * Peers are identified by their file descriptor, nodes and handles by the id
+ * the kernel assigned them in their peer. Depending on the kind, the trailing
+ * ids of a record are:
+ *
+ *   NODE:      the id of the node, which is owned by @peer
+ *   TRANSFER:  source handle id, destination peer fd, destination handle id
+ *   SEND:      the destination handle ids held by @peer
+ *   RECV:      the id of the destination node, or handle for notifications
+ */
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include "org.bus1/b1-peer.h"
+
+#define B1_CAPTURE_MAGIC UINT64_C(0x7275747061633162) /* "b1captur" */
+#define B1_CAPTURE_VERSION (1)
+
+typedef struct B1Capture B1Capture;
+typedef struct B1CaptureHeader B1CaptureHeader;
+typedef struct B1CaptureRecord B1CaptureRecord;
+
+enum {
+        B1_CAPTURE_RECORD_NODE,
+        B1_CAPTURE_RECORD_TRANSFER,
+        B1_CAPTURE_RECORD_SEND,
+        B1_CAPTURE_RECORD_RECV,
+};
+
+struct B1CaptureHeader {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t flags; /* B1_CAPTURE_FLAG_* */
+        _Atomic uint64_t n_bytes; /* log size, including the header */
+        _Atomic uint64_t n_dropped; /* records that did not fit */
+};
+
+struct B1CaptureRecord {
+        uint32_t size; /* including ids and payload */
+        uint16_t kind; /* B1_CAPTURE_RECORD_* */
+        uint16_t type; /* BUS1_MSG_* */
+        uint64_t timestamp; /* nsecs since the capture was started */
+        int32_t peer;
+        uint32_t n_ids;
+        uint64_t n_bytes;
+        uint32_t n_handles;
+        uint32_t n_fds;
+        uint64_t n_payload; /* payload bytes following the ids */
+        uint64_t ids[];
+};
+
+struct B1Capture {
+        int fd;
+        uint8_t *map;
+        size_t n_map;
+        uint64_t flags; /* B1_CAPTURE_FLAG_* */
+        uint64_t start;
+};
+
+void b1_capture_node(B1Node *node);
+void b1_capture_transfer(B1Handle *src, B1Handle *dst);
+void b1_capture_send(B1Message *message, B1Handle **destinations, size_t n_destinations);
+void b1_capture_recv(B1Message *message);
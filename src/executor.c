@@ -0,0 +1,407 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <assert.h>
+#include <c-macro.h>
+#include <errno.h>
+#include "executor.h"
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#define B1_EXECUTOR_BATCH (64)
+#define B1_EXECUTOR_EVENTS (64)
+
+/*
+ * Re-arm the one-shot registration of a peer with its owner. While a peer is
+ * pending or run, its level-triggered fd is kept disarmed, so the owner does
+ * not keep waking up for a peer another worker is busy with.
+ */
+static void b1_executor_arm(B1ExecutorEntry *entry) {
+        struct epoll_event event = {
+                .events = EPOLLIN | EPOLLONESHOT,
+                .data.ptr = entry,
+        };
+
+        (void)epoll_ctl(entry->owner->fd_epoll, EPOLL_CTL_MOD, b1_peer_get_fd(entry->peer), &event);
+}
+
+/*
+ * Run a batch of messages of one peer. The busy flag guarantees that only a
+ * single worker ever operates on a given peer at a time, no matter whether it
+ * owns the peer or steals it. Acquiring and releasing it orders all accesses
+ * to the peer across workers.
+ */
+static bool b1_executor_run(B1ExecutorWorker *worker, B1ExecutorEntry *entry) {
+        B1Executor *executor = worker->executor;
+        B1Message *message;
+        bool expected = false;
+        unsigned int i;
+
+        if (!atomic_load_explicit(&entry->pending, memory_order_acquire))
+                return false;
+
+        if (!atomic_compare_exchange_strong_explicit(&entry->busy, &expected, true,
+                                                     memory_order_acquire,
+                                                     memory_order_relaxed))
+                return false;
+
+        /* somebody else might have run the peer since we checked */
+        if (!atomic_load_explicit(&entry->pending, memory_order_relaxed)) {
+                atomic_store_explicit(&entry->busy, false, memory_order_release);
+                return false;
+        }
+
+        for (i = 0; i < B1_EXECUTOR_BATCH; i++) {
+                if (b1_peer_recv(entry->peer, &message) < 0)
+                        break;
+
+                executor->fn(entry->peer, message, executor->userdata);
+                b1_message_unref(message);
+                atomic_fetch_add_explicit(&worker->n_messages, 1, memory_order_relaxed);
+        }
+
+        atomic_store_explicit(&entry->pending, false, memory_order_relaxed);
+        atomic_store_explicit(&entry->busy, false, memory_order_release);
+
+        /* only re-arm once idle, so a new event always finds the peer runnable */
+        b1_executor_arm(entry);
+
+        return true;
+}
+
+static bool b1_executor_steal(B1ExecutorWorker *worker) {
+        B1Executor *executor = worker->executor;
+        B1ExecutorWorker *victim;
+        bool stolen = false;
+
+        for (size_t i = 1; i < executor->n_workers; i++) {
+                victim = &executor->workers[(worker->index + i) % executor->n_workers];
+
+                for (size_t j = 0; j < victim->n_entries; j++) {
+                        if (b1_executor_run(worker, victim->entries[j])) {
+                                atomic_fetch_add_explicit(&worker->n_steals, 1, memory_order_relaxed);
+                                stolen = true;
+                        }
+                }
+        }
+
+        return stolen;
+}
+
+/*
+ * Wake one idle worker, if any, to steal from us. Pairs with the fence in
+ * b1_executor_thread(): either the idle worker sees the pending peers before
+ * it blocks, or we see it counted as idle.
+ */
+static void b1_executor_wake(B1Executor *executor) {
+        uint64_t one = 1;
+
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(&executor->n_idle, memory_order_relaxed))
+                (void)write(executor->fd_wake, &one, sizeof(one));
+}
+
+static void *b1_executor_thread(void *userdata) {
+        B1ExecutorWorker *worker = userdata;
+        B1Executor *executor = worker->executor;
+        struct epoll_event events[B1_EXECUTOR_EVENTS];
+        B1ExecutorEntry *entry;
+        uint64_t value;
+        bool idle = false;
+        cpu_set_t cpus;
+        int n, n_ready, timeout;
+
+        if (executor->pin) {
+                CPU_ZERO(&cpus);
+                CPU_SET(worker->index, &cpus);
+                (void)pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        }
+
+        for (;;) {
+                timeout = 0;
+                if (idle) {
+                        /* announce ourselves before the final check for work */
+                        atomic_fetch_add_explicit(&executor->n_idle, 1, memory_order_relaxed);
+                        atomic_thread_fence(memory_order_seq_cst);
+                        if (!b1_executor_steal(worker))
+                                timeout = -1;
+                        else
+                                atomic_fetch_sub_explicit(&executor->n_idle, 1, memory_order_relaxed);
+                }
+
+                n = epoll_wait(worker->fd_epoll, events, C_ARRAY_SIZE(events), timeout);
+                if (timeout < 0)
+                        atomic_fetch_sub_explicit(&executor->n_idle, 1, memory_order_relaxed);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        break;
+                }
+
+                /* publish all ready peers first, so idle workers can steal them */
+                n_ready = 0;
+                for (int i = 0; i < n; i++) {
+                        entry = events[i].data.ptr;
+                        if (!entry)
+                                return NULL;
+
+                        if (entry == (void *)executor) {
+                                (void)read(executor->fd_wake, &value, sizeof(value));
+                                continue;
+                        }
+
+                        atomic_store_explicit(&entry->pending, true, memory_order_release);
+                        events[n_ready++].data.ptr = entry;
+                }
+
+                if (n_ready > 1)
+                        b1_executor_wake(executor);
+
+                for (int i = 0; i < n_ready; i++)
+                        b1_executor_run(worker, events[i].data.ptr);
+
+                idle = !n_ready && !b1_executor_steal(worker);
+        }
+
+        return NULL;
+}
+
+/**
+ * b1_executor_new() - create a multi-peer executor
+ * @executorp:          the new executor object
+ * @n_workers:          number of worker threads
+ * @pin:                whether to pin worker N to CPU N
+ * @fn:                 callback to invoke for each received message
+ * @userdata:           userdata to pass to @fn
+ *
+ * An executor runs one loop thread per worker, each owning a set of peers
+ * assigned with b1_executor_add_peer(). A worker receives messages of its
+ * ready peers in batches and dispatches them to @fn. Workers that run out of
+ * work block until woken to steal ready peers from the other workers, which
+ * happens whenever a worker has more than one ready peer.
+ *
+ * At any moment only a single worker operates on any given peer, so the peers
+ * need not be thread-safe, and may even be B1_PEER_FLAG_SINGLE_THREADED. The
+ * message passed to @fn is only valid for the duration of the callback, unless
+ * the callback takes a reference, and must not be used outside of it.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_executor_new(B1Executor **executorp,
+                               size_t n_workers,
+                               bool pin,
+                               B1ExecutorFn fn,
+                               void *userdata) {
+        _c_cleanup_(b1_executor_freep) B1Executor *executor = NULL;
+        struct epoll_event event = {
+                .events = EPOLLIN,
+                .data.ptr = NULL,
+        };
+        struct epoll_event event_wake = {
+                .events = EPOLLIN | EPOLLEXCLUSIVE,
+        };
+        int r;
+
+        assert(executorp);
+        assert(fn);
+
+        if (!n_workers)
+                return -EINVAL;
+
+        executor = calloc(1, sizeof(*executor));
+        if (!executor)
+                return -ENOMEM;
+
+        executor->fn = fn;
+        executor->userdata = userdata;
+        executor->pin = pin;
+        executor->fd_wake = -1;
+
+        executor->fd_stop = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (executor->fd_stop < 0)
+                return -errno;
+
+        executor->fd_wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (executor->fd_wake < 0)
+                return -errno;
+
+        event_wake.data.ptr = executor;
+
+        executor->workers = calloc(n_workers, sizeof(*executor->workers));
+        if (!executor->workers)
+                return -ENOMEM;
+
+        for (size_t i = 0; i < n_workers; i++) {
+                B1ExecutorWorker *worker = &executor->workers[i];
+
+                worker->executor = executor;
+                worker->index = i;
+
+                worker->fd_epoll = epoll_create1(EPOLL_CLOEXEC);
+                if (worker->fd_epoll < 0)
+                        return -errno;
+
+                ++executor->n_workers;
+
+                r = epoll_ctl(worker->fd_epoll, EPOLL_CTL_ADD, executor->fd_stop, &event);
+                if (r < 0)
+                        return -errno;
+
+                r = epoll_ctl(worker->fd_epoll, EPOLL_CTL_ADD, executor->fd_wake, &event_wake);
+                if (r < 0)
+                        return -errno;
+        }
+
+        *executorp = executor;
+        executor = NULL;
+        return 0;
+}
+
+/**
+ * b1_executor_free() - stop and destroy an executor
+ * @executor:           executor to destroy, or NULL
+ *
+ * This stops all worker threads and drops the references to all peers.
+ *
+ * Return: NULL is returned.
+ */
+_c_public_ B1Executor *b1_executor_free(B1Executor *executor) {
+        uint64_t one = 1;
+
+        if (!executor)
+                return NULL;
+
+        if (executor->fd_stop >= 0)
+                (void)write(executor->fd_stop, &one, sizeof(one));
+
+        for (size_t i = 0; i < executor->n_workers; i++) {
+                B1ExecutorWorker *worker = &executor->workers[i];
+
+                if (worker->running)
+                        pthread_join(worker->thread, NULL);
+
+                for (size_t j = 0; j < worker->n_entries; j++) {
+                        b1_peer_unref(worker->entries[j]->peer);
+                        free(worker->entries[j]);
+                }
+
+                free(worker->entries);
+                close(worker->fd_epoll);
+        }
+
+        free(executor->workers);
+
+        if (executor->fd_wake >= 0)
+                close(executor->fd_wake);
+        if (executor->fd_stop >= 0)
+                close(executor->fd_stop);
+
+        free(executor);
+
+        return NULL;
+}
+
+/**
+ * b1_executor_add_peer() - assign a peer to a worker
+ * @executor:           the executor
+ * @peer:               the peer
+ * @worker_index:       index of the owning worker
+ *
+ * Peers must be added before the executor is started. From then on, the peer
+ * must not be used outside of the executor callback, until the executor is
+ * freed.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_executor_add_peer(B1Executor *executor, B1Peer *peer, unsigned int worker_index) {
+        struct epoll_event event = {
+                .events = EPOLLIN | EPOLLONESHOT,
+        };
+        B1ExecutorWorker *worker;
+        B1ExecutorEntry *entry, **entries;
+        int r;
+
+        if (worker_index >= executor->n_workers)
+                return -ERANGE;
+
+        worker = &executor->workers[worker_index];
+        if (worker->running)
+                return -EBUSY;
+
+        entries = realloc(worker->entries, sizeof(*entries) * (worker->n_entries + 1));
+        if (!entries)
+                return -ENOMEM;
+        worker->entries = entries;
+
+        entry = calloc(1, sizeof(*entry));
+        if (!entry)
+                return -ENOMEM;
+
+        event.data.ptr = entry;
+        r = epoll_ctl(worker->fd_epoll, EPOLL_CTL_ADD, b1_peer_get_fd(peer), &event);
+        if (r < 0) {
+                r = -errno;
+                free(entry);
+                return r;
+        }
+
+        entry->peer = b1_peer_ref(peer);
+        entry->owner = worker;
+        worker->entries[worker->n_entries++] = entry;
+
+        return 0;
+}
+
+/**
+ * b1_executor_start() - start all workers of an executor
+ * @executor:           the executor
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_executor_start(B1Executor *executor) {
+        int r;
+
+        for (size_t i = 0; i < executor->n_workers; i++) {
+                B1ExecutorWorker *worker = &executor->workers[i];
+
+                if (worker->running)
+                        continue;
+
+                r = pthread_create(&worker->thread, NULL, b1_executor_thread, worker);
+                if (r > 0)
+                        return -r;
+
+                worker->running = true;
+        }
+
+        return 0;
+}
+
+/**
+ * b1_executor_get_stats() - query executor metrics
+ * @executor:           the executor
+ * @n_messagesp:        total number of dispatched messages, or NULL
+ * @n_stealsp:          total number of peer batches run by non-owners, or NULL
+ */
+_c_public_ void b1_executor_get_stats(B1Executor *executor, uint64_t *n_messagesp, uint64_t *n_stealsp) {
+        uint64_t n_messages = 0, n_steals = 0;
+
+        for (size_t i = 0; i < executor->n_workers; i++) {
+                n_messages += atomic_load_explicit(&executor->workers[i].n_messages, memory_order_relaxed);
+                n_steals += atomic_load_explicit(&executor->workers[i].n_steals, memory_order_relaxed);
+        }
+
+        if (n_messagesp)
+                *n_messagesp = n_messages;
+        if (n_stealsp)
+                *n_stealsp = n_steals;
+}
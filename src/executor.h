@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include "org.bus1/b1-peer.h"
+
+typedef struct B1ExecutorEntry B1ExecutorEntry;
+typedef struct B1ExecutorWorker B1ExecutorWorker;
+
+struct B1ExecutorEntry {
+        B1Peer *peer;
+        B1ExecutorWorker *owner;
+
+        _Atomic bool busy; /* a worker currently operates on the peer */
+        _Atomic bool pending; /* the peer was reported readable */
+};
+
+struct B1ExecutorWorker {
+        B1Executor *executor;
+        unsigned int index;
+
+        pthread_t thread;
+        bool running;
+        int fd_epoll;
+
+        B1ExecutorEntry **entries;
+        size_t n_entries;
+
+        _Atomic uint64_t n_messages;
+        _Atomic uint64_t n_steals;
+};
+
+struct B1Executor {
+        B1ExecutorFn fn;
+        void *userdata;
+        bool pin;
+
+        int fd_stop;
+        int fd_wake; /* wakes a single idle worker to steal */
+        _Atomic size_t n_idle;
+
+        B1ExecutorWorker *workers;
+        size_t n_workers;
+};
@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <assert.h>
+#include <c-macro.h>
+#include <errno.h>
+#include "factory.h"
+#include "peer.h"
+#include <stdlib.h>
+
+/**
+ * b1_peer_factory_new() - create a new peer factory
+ * @factoryp:           the new factory object
+ * @n_stock:            number of peers to keep in stock
+ * @flags:              B1_PEER_FLAG_* flags for the produced peers
+ * @prefault:           whether to map and fault in the pools of stocked peers
+ *
+ * A peer factory keeps a stock of pre-opened peers, so handing out a new peer
+ * is merely a pointer handoff. If @prefault is true, the pools of the stocked
+ * peers are mapped in advance as well, and all their pages are faulted in, as
+ * with B1_PEER_FLAG_POOL_POPULATE.
+ *
+ * The factory is not thread-safe. It is filled on creation, and should be
+ * refilled with b1_peer_factory_fill() outside of latency-critical paths.
+ *
+ * Return: 0 on success, -EINVAL if @n_stock is 0, or a negative error code on
+ *         failure.
+ */
+_c_public_ int b1_peer_factory_new(B1PeerFactory **factoryp,
+                                   size_t n_stock,
+                                   uint64_t flags,
+                                   bool prefault) {
+        _c_cleanup_(b1_peer_factory_freep) B1PeerFactory *factory = NULL;
+        int r;
+
+        assert(factoryp);
+
+        if (!n_stock)
+                return -EINVAL;
+
+        factory = calloc(1, sizeof(*factory));
+        if (!factory)
+                return -ENOMEM;
+
+        factory->flags = flags;
+        factory->prefault = prefault;
+        factory->n_stock = n_stock;
+
+        factory->peers = calloc(n_stock, sizeof(*factory->peers));
+        if (!factory->peers)
+                return -ENOMEM;
+
+        r = b1_peer_factory_fill(factory);
+        if (r < 0)
+                return r;
+
+        *factoryp = factory;
+        factory = NULL;
+        return 0;
+}
+
+/**
+ * b1_peer_factory_free() - destroy a peer factory
+ * @factory:            factory to destroy, or NULL
+ *
+ * This releases all peers still in stock.
+ *
+ * Return: NULL is returned.
+ */
+_c_public_ B1PeerFactory *b1_peer_factory_free(B1PeerFactory *factory) {
+        if (!factory)
+                return NULL;
+
+        for (size_t i = 0; i < factory->n_peers; i++)
+                b1_peer_unref(factory->peers[i]);
+
+        free(factory->peers);
+        free(factory);
+
+        return NULL;
+}
+
+/**
+ * b1_peer_factory_fill() - refill the stock of a peer factory
+ * @factory:            the factory
+ *
+ * Create new peers until the stock is full again.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_peer_factory_fill(B1PeerFactory *factory) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *peer = NULL;
+        int r;
+
+        while (factory->n_peers < factory->n_stock) {
+                /* the populate hint only takes effect when the pool is mapped */
+                r = b1_peer_new_with_flags(&peer,
+                                           factory->flags |
+                                           (factory->prefault ? B1_PEER_FLAG_POOL_POPULATE : 0));
+                if (r < 0)
+                        return r;
+
+                if (factory->prefault) {
+                        r = b1_peer_map(peer);
+                        if (r < 0)
+                                return r;
+                }
+
+                factory->peers[factory->n_peers++] = peer;
+                peer = NULL;
+        }
+
+        return 0;
+}
+
+/**
+ * b1_peer_factory_take() - take a peer from a peer factory
+ * @factory:            the factory
+ * @peerp:              the new peer object
+ *
+ * Hand out a peer from the stock. If the stock is exhausted, a new peer is
+ * created on demand.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_peer_factory_take(B1PeerFactory *factory, B1Peer **peerp) {
+        assert(peerp);
+
+        if (factory->n_peers > 0) {
+                *peerp = factory->peers[--factory->n_peers];
+                return 0;
+        }
+
+        return b1_peer_new_with_flags(peerp, factory->flags);
+}
@@ -0,0 +1,21 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include "org.bus1/b1-peer.h"
+
+struct B1PeerFactory {
+        uint64_t flags; /* B1_PEER_FLAG_* of the produced peers */
+        bool prefault; /* map and populate the pool of stocked peers */
+
+        B1Peer **peers;
+        size_t n_peers;
+        size_t n_stock;
+};
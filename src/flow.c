@@ -0,0 +1,383 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <assert.h>
+#include <c-macro.h>
+#include <errno.h>
+#include "flow.h"
+#include <poll.h>
+#include <stdlib.h>
+#include "linux/bus1.h"
+
+static int b1_flow_send_control(B1Handle *destination, B1Handle *handle, uint64_t n_credits) {
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        B1FlowControl control = {
+                .magic = B1_FLOW_MAGIC,
+                .n_credits = n_credits,
+        };
+        int r;
+
+        r = b1_message_new(b1_handle_get_peer(destination), &message);
+        if (r < 0)
+                return r;
+
+        r = B1_MESSAGE_SET_PAYLOAD(message, &control);
+        if (r < 0)
+                return r;
+
+        if (handle) {
+                r = b1_message_set_handles(message, &handle, 1);
+                if (r < 0)
+                        return r;
+        }
+
+        return b1_message_send(message, &destination, 1);
+}
+
+static int b1_flow_hello(B1Flow *flow, size_t n_window) {
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
+        int r;
+
+        /* the receiver gets its own handle to the credit node */
+        r = b1_handle_transfer(b1_node_get_handle(flow->credit_node),
+                               b1_handle_get_peer(flow->destination),
+                               &handle);
+        if (r < 0)
+                return r;
+
+        return b1_flow_send_control(flow->destination, handle, n_window);
+}
+
+/**
+ * b1_flow_new() - create a flow-controlled channel to a destination
+ * @flowp:              the new flow object
+ * @destination:        the handle to send to
+ * @n_window:           credits initially granted to the sender
+ * @n_queue_max:        number of messages queued locally when out of credit
+ *
+ * A flow limits the number of messages in flight to a receiver, so the
+ * receiver's pool and quota never overflow and no message is dropped. Every
+ * message sent through the flow consumes one credit, and the receiver hands
+ * credits back with b1_flow_grant() once it consumed messages.
+ *
+ * Credits are granted by messages to a node owned by a private peer of the
+ * flow, so they never interleave with the traffic of the sending peer. On
+ * creation, a hello message carrying a handle to that node is sent to
+ * @destination, to be picked up with b1_flow_accept(). As the receiver cannot
+ * tell senders apart, the destination node must not be shared with other
+ * flows.
+ *
+ * The flow object is not thread-safe.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_flow_new(B1Flow **flowp, B1Handle *destination, size_t n_window, size_t n_queue_max) {
+        _c_cleanup_(b1_flow_freep) B1Flow *flow = NULL;
+        int r;
+
+        assert(flowp);
+        assert(destination);
+
+        if (!n_window)
+                return -EINVAL;
+
+        flow = calloc(1, sizeof(*flow));
+        if (!flow)
+                return -ENOMEM;
+
+        flow->destination = b1_handle_ref(destination);
+        flow->n_credits = n_window;
+        flow->n_queue_max = n_queue_max;
+
+        if (n_queue_max) {
+                flow->queue = calloc(n_queue_max, sizeof(*flow->queue));
+                if (!flow->queue)
+                        return -ENOMEM;
+        }
+
+        r = b1_peer_new_with_flags(&flow->credit_peer, B1_PEER_FLAG_SINGLE_THREADED);
+        if (r < 0)
+                return r;
+
+        r = b1_node_new(flow->credit_peer, &flow->credit_node);
+        if (r < 0)
+                return r;
+
+        r = b1_flow_hello(flow, n_window);
+        if (r < 0)
+                return r;
+
+        *flowp = flow;
+        flow = NULL;
+        return 0;
+}
+
+/**
+ * b1_flow_free() - destroy a flow
+ * @flow:               flow to destroy, or NULL
+ *
+ * Messages still queued for lack of credit are dropped. The credit node is
+ * destroyed, so the receiver is notified that the flow is gone.
+ *
+ * Return: NULL is returned.
+ */
+_c_public_ B1Flow *b1_flow_free(B1Flow *flow) {
+        if (!flow)
+                return NULL;
+
+        for (size_t i = 0; i < flow->n_queue; i++)
+                b1_message_unref(flow->queue[(flow->i_queue + i) % flow->n_queue_max]);
+
+        b1_node_free(flow->credit_node);
+        b1_peer_unref(flow->credit_peer);
+        free(flow->queue);
+        b1_handle_unref(flow->destination);
+        free(flow);
+
+        return NULL;
+}
+
+/*
+ * Collect all credit grants queued on the credit peer. If @block is set, and
+ * no credit is available afterwards, wait for the next grant.
+ */
+static int b1_flow_collect(B1Flow *flow, bool block) {
+        const B1FlowControl *control;
+        struct pollfd pfd = {
+                .fd = b1_peer_get_fd(flow->credit_peer),
+                .events = POLLIN,
+        };
+        int r;
+
+        for (;;) {
+                _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+
+                if (flow->broken)
+                        return -ECONNRESET;
+
+                r = b1_peer_recv(flow->credit_peer, &message);
+                if (r == -EAGAIN) {
+                        if (!block || flow->n_credits)
+                                return 0;
+
+                        r = poll(&pfd, 1, -1);
+                        if (r < 0 && errno != EINTR)
+                                return -errno;
+
+                        continue;
+                } else if (r < 0) {
+                        return r;
+                }
+
+                switch (b1_message_get_type(message)) {
+                case BUS1_MSG_DATA:
+                        r = B1_MESSAGE_PEEK_PAYLOAD(message, 0, B1FlowControl, &control);
+                        if (r < 0 || control->magic != B1_FLOW_MAGIC)
+                                break;
+
+                        flow->n_credits += control->n_credits;
+                        ++flow->n_grants;
+                        break;
+                case BUS1_MSG_NODE_RELEASE:
+                        /* the receiver dropped its handle, no credit will ever arrive */
+                        flow->broken = true;
+                        break;
+                }
+        }
+}
+
+static int b1_flow_transmit(B1Flow *flow, B1Message *message) {
+        int r;
+
+        assert(flow->n_credits);
+
+        r = b1_message_send(message, &flow->destination, 1);
+        if (r < 0)
+                return r;
+
+        --flow->n_credits;
+        ++flow->n_sent;
+        return 0;
+}
+
+static int b1_flow_flush(B1Flow *flow) {
+        B1Message *message;
+        int r;
+
+        while (flow->n_queue && flow->n_credits) {
+                message = flow->queue[flow->i_queue];
+
+                /* on failure, the message stays queued for the next attempt */
+                r = b1_flow_transmit(flow, message);
+                if (r < 0)
+                        return r;
+
+                flow->queue[flow->i_queue] = NULL;
+                flow->i_queue = (flow->i_queue + 1) % flow->n_queue_max;
+                --flow->n_queue;
+                b1_message_unref(message);
+        }
+
+        return 0;
+}
+
+/**
+ * b1_flow_send() - send a message subject to flow control
+ * @flow:               the flow
+ * @message:            the message to send
+ * @block:              wait for credit rather than queueing
+ *
+ * If credit is available and no earlier message is still queued, the message
+ * is sent right away. Otherwise, this either waits for the receiver to grant
+ * credit, or, if @block is not set, queues a reference to the message, to be
+ * sent by a later call to b1_flow_send() or b1_flow_dispatch(). Queued
+ * messages must not be modified. Either way, messages are sent in order.
+ *
+ * Return: 0 if the message was sent, 1 if it was queued, -EAGAIN if the queue
+ *         is full, -ECONNRESET if the receiver went away, or a negative error
+ *         code on failure.
+ */
+_c_public_ int b1_flow_send(B1Flow *flow, B1Message *message, bool block) {
+        int r;
+
+        r = b1_flow_collect(flow, false);
+        if (r < 0)
+                return r;
+
+        r = b1_flow_flush(flow);
+        if (r < 0)
+                return r;
+
+        if (flow->n_queue || !flow->n_credits) {
+                ++flow->n_stalls;
+
+                if (!block) {
+                        if (flow->n_queue >= flow->n_queue_max)
+                                return -EAGAIN;
+
+                        flow->queue[(flow->i_queue + flow->n_queue) % flow->n_queue_max] = b1_message_ref(message);
+                        ++flow->n_queue;
+                        flow->n_depth_max = c_max(flow->n_depth_max, (uint64_t)flow->n_queue);
+                        return 1;
+                }
+
+                do {
+                        r = b1_flow_collect(flow, true);
+                        if (r < 0)
+                                return r;
+
+                        r = b1_flow_flush(flow);
+                        if (r < 0)
+                                return r;
+                } while (flow->n_queue || !flow->n_credits);
+        }
+
+        return b1_flow_transmit(flow, message);
+}
+
+/**
+ * b1_flow_dispatch() - process credit grants
+ * @flow:               the flow
+ *
+ * This collects pending credit grants without blocking, and sends as many
+ * queued messages as the credit allows. It should be called whenever the file
+ * descriptor returned by b1_flow_get_fd() becomes readable.
+ *
+ * Return: the number of messages still queued, or a negative error code on
+ *         failure.
+ */
+_c_public_ int b1_flow_dispatch(B1Flow *flow) {
+        int r;
+
+        r = b1_flow_collect(flow, false);
+        if (r < 0)
+                return r;
+
+        r = b1_flow_flush(flow);
+        if (r < 0)
+                return r;
+
+        return flow->n_queue;
+}
+
+/**
+ * b1_flow_get_fd() - get file descriptor signalling credit grants
+ * @flow:               the flow
+ *
+ * Return: the file descriptor.
+ */
+_c_public_ int b1_flow_get_fd(B1Flow *flow) {
+        return b1_peer_get_fd(flow->credit_peer);
+}
+
+/**
+ * b1_flow_get_stats() - query flow metrics
+ * @flow:               the flow
+ * @stats:              the returned metrics
+ *
+ * A stall is counted for every message that could not be sent right away.
+ */
+_c_public_ void b1_flow_get_stats(B1Flow *flow, B1FlowStats *stats) {
+        stats->n_credits = flow->n_credits;
+        stats->n_sent = flow->n_sent;
+        stats->n_grants = flow->n_grants;
+        stats->n_stalls = flow->n_stalls;
+        stats->n_depth = flow->n_queue;
+        stats->n_depth_max = flow->n_depth_max;
+}
+
+/**
+ * b1_flow_accept() - accept a flow on the receiving side
+ * @message:            a received message
+ * @credit_handlep:     the handle to grant credits to
+ *
+ * This checks whether @message is the hello sent by b1_flow_new(), and returns
+ * the handle to be passed to b1_flow_grant() for all messages that arrive on
+ * the same destination node.
+ *
+ * Return: 0 on success, -EBADMSG if @message is not a flow hello.
+ */
+_c_public_ int b1_flow_accept(B1Message *message, B1Handle **credit_handlep) {
+        const B1FlowControl *control;
+        B1Handle *handle;
+        int r;
+
+        assert(credit_handlep);
+
+        if (b1_message_get_type(message) != BUS1_MSG_DATA)
+                return -EBADMSG;
+
+        r = B1_MESSAGE_PEEK_PAYLOAD(message, 0, B1FlowControl, &control);
+        if (r < 0 || control->magic != B1_FLOW_MAGIC)
+                return -EBADMSG;
+
+        r = b1_message_get_handle(message, 0, &handle);
+        if (r < 0)
+                return -EBADMSG;
+
+        *credit_handlep = b1_handle_ref(handle);
+        return 0;
+}
+
+/**
+ * b1_flow_grant() - hand credits back to a sender
+ * @credit_handle:      the handle returned by b1_flow_accept()
+ * @n_credits:          number of credits to grant
+ *
+ * Every grant is a message to the sender, so credits for consumed messages
+ * should be granted in batches rather than one by one.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_flow_grant(B1Handle *credit_handle, size_t n_credits) {
+        if (!n_credits)
+                return 0;
+
+        return b1_flow_send_control(credit_handle, NULL, n_credits);
+}
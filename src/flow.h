@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include "org.bus1/b1-peer.h"
+
+#define B1_FLOW_MAGIC UINT64_C(0x776f6c6631627562) /* "bub1flow" */
+
+typedef struct B1FlowControl B1FlowControl;
+
+/* payload of the hello and of credit grants */
+struct B1FlowControl {
+        uint64_t magic;
+        uint64_t n_credits;
+};
+
+struct B1Flow {
+        B1Handle *destination;
+
+        B1Peer *credit_peer; /* private peer owning the credit node */
+        B1Node *credit_node; /* grants from the receiver end up here */
+        bool broken; /* the receiver released the credit node */
+
+        uint64_t n_credits;
+
+        B1Message **queue; /* ring of messages waiting for credit */
+        size_t i_queue;
+        size_t n_queue;
+        size_t n_queue_max;
+
+        uint64_t n_sent;
+        uint64_t n_stalls;
+        uint64_t n_depth_max;
+        uint64_t n_grants;
+};
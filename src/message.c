@@ -9,11 +9,13 @@
 
 #include <assert.h>
 #include <c-macro.h>
+#include "capture.h"
 #include <c-rbtree.h>
 #include <errno.h>
 #include "message.h"
 #include "node.h"
 #include "peer.h"
+#include "slice.h"
 #include <stdlib.h>
 #include <string.h>
 #include "bus1-peer.h"
@@ -72,12 +74,14 @@ _c_public_ int b1_message_new(B1Peer *peer, B1Message **messagep) {
  */
 _c_public_ B1Message *b1_message_ref(B1Message *message) {
         if (message)
-                c_ref_inc(&message->ref);
+                b1_ref_inc(message->peer, &message->ref);
 
         return message;
 }
 
 static void b1_message_free_vecs(B1Message *message) {
+        free(message->variant_header);
+        message->variant_header = NULL;
         free(message->vecs);
         message->vecs = NULL;
         message->n_vecs = 0;
@@ -91,18 +95,31 @@ static void b1_message_free_handles(B1Message *message) {
         message->handles = NULL;
 }
 
+static void b1_message_close_fds(const int *fds, size_t n_fds) {
+        for (size_t i = 0; i < n_fds; i++)
+                if (fds[i] >= 0)
+                        close(fds[i]);
+}
+
 static void b1_message_free_fds(B1Message *message) {
-        for (unsigned int i = 0; i < message->n_fds; i++)
-                if (message->fds[i] >= 0)
-                        close(message->fds[i]);
+        if (message->fds)
+                b1_message_close_fds(message->fds, message->n_fds);
 
         free(message->fds);
         message->fds = NULL;
+        free(message->fds_used);
+        message->fds_used = NULL;
 }
 
 static void b1_message_free(_Atomic unsigned long *ref, void *userdata) {
         B1Message *message = userdata;
 
+        /* a reset of the peer released all slices already */
+        if (message->slice_ref)
+                b1_slice_unref(message->slice_ref);
+        else if (message->slice && message->generation == message->peer->generation)
+                b1_peer_release_slice(message->peer, &message->pool_entry, message->slice);
+
         b1_message_free_vecs(message);
         b1_message_free_handles(message);
         b1_message_free_fds(message);
@@ -119,11 +136,30 @@ static void b1_message_free(_Atomic unsigned long *ref, void *userdata) {
  */
 _c_public_ B1Message *b1_message_unref(B1Message *message) {
         if (message)
-                c_ref_dec(&message->ref, b1_message_free, message);
+                b1_ref_dec(message->peer, &message->ref, b1_message_free, message);
 
         return NULL;
 }
 
+/*
+ * Return the size of the trailer at the end of a received payload, or 0 if it
+ * carries none. A payload that merely ends in the magic by accident is taken
+ * for a stamped one, this is why stamping is opt-in on both ends.
+ */
+size_t b1_message_parse_trailer(const void *slice, size_t n_bytes, uint64_t *timestampp) {
+        B1MessageTrailer trailer;
+
+        if (n_bytes < sizeof(trailer))
+                return 0;
+
+        memcpy(&trailer, (const uint8_t *)slice + n_bytes - sizeof(trailer), sizeof(trailer));
+        if (trailer.magic != B1_MESSAGE_TRAILER_MAGIC)
+                return 0;
+
+        *timestampp = trailer.timestamp;
+        return sizeof(trailer);
+}
+
 int b1_message_new_from_slice(B1Peer *peer,
                               B1Message **messagep,
                               const void *slice,
@@ -135,16 +171,55 @@ int b1_message_new_from_slice(B1Peer *peer,
                               pid_t tid,
                               size_t n_bytes,
                               size_t n_handles,
-                              size_t n_fds) {
+                              size_t n_fds,
+                              bool fds_installed) {
         _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
         struct iovec *vec;
         uint64_t *handle_ids;
+        const int *fds;
         int r;
 
+        /* the fd array follows the 64bit handle ids */
+        handle_ids = (uint64_t*)((uint8_t*)slice + c_align_to(n_bytes, 8));
+        fds = (const int *)(handle_ids + n_handles);
+
+        /*
+         * Installed fds are owned by us from now on. Take them over before
+         * anything else can fail, so the cleanup closes them.
+         */
         r = b1_message_new_internal(peer, &message);
-        if (r < 0)
+        if (r < 0) {
+                if (fds_installed)
+                        b1_message_close_fds(fds, n_fds);
                 return r;
+        }
+
         message->slice = slice;
+        message->generation = peer->generation;
+
+        /* notifications do not carry a slice */
+        if (slice)
+                b1_peer_track_slice(peer, &message->pool_entry,
+                                    c_align_to(n_bytes, 8) + n_handles * sizeof(uint64_t) + n_fds * sizeof(int));
+
+        if (n_fds) {
+                message->fds = malloc(n_fds * sizeof(int));
+                if (!message->fds) {
+                        if (fds_installed)
+                                b1_message_close_fds(fds, n_fds);
+                        return -ENOMEM;
+                }
+
+                if (fds_installed) {
+                        memcpy(message->fds, fds, n_fds * sizeof(int));
+                        atomic_fetch_add_explicit(&peer->n_fds_installed, n_fds, memory_order_relaxed);
+                } else {
+                        memset(message->fds, -1, n_fds * sizeof(int));
+                        atomic_fetch_add_explicit(&peer->n_fds_dropped, n_fds, memory_order_relaxed);
+                }
+
+                message->n_fds = n_fds;
+        }
 
         message->type = type;
         message->destination = destination;
@@ -153,6 +228,14 @@ int b1_message_new_from_slice(B1Peer *peer,
         message->pid = pid;
         message->tid = tid;
 
+        if (type == BUS1_MSG_NODE_DESTROY) {
+                B1Handle *handle = b1_handle_lookup(peer, destination);
+
+                /* the node is gone, do not hand out cached transfers of it */
+                if (handle)
+                        b1_handle_flush_transfers(handle);
+        }
+
         message->vecs = calloc(1, sizeof(*vec));
         if (!message->vecs)
                 return -ENOMEM;
@@ -161,14 +244,18 @@ int b1_message_new_from_slice(B1Peer *peer,
         message->vecs->iov_len = n_bytes;
         message->n_vecs = 1;
 
+        if (type == BUS1_MSG_DATA && (peer->flags & B1_PEER_FLAG_TIMESTAMPS)) {
+                message->n_trailer = b1_message_parse_trailer(slice, n_bytes, &message->send_time);
+                if (message->n_trailer)
+                        message->vecs->iov_len -= message->n_trailer;
+        }
+
         message->handles = calloc(n_handles, sizeof(B1Handle*));
         if (!message->handles)
                 return -ENOMEM;
 
         message->n_handles = n_handles;
 
-        handle_ids = (uint64_t*)((uint8_t*)slice + c_align_to(n_bytes, 8));
-
         for (unsigned int i = 0; i < n_handles; i++) {
                 B1Handle *handle;
 
@@ -179,11 +266,12 @@ int b1_message_new_from_slice(B1Peer *peer,
                 message->handles[i] = handle;
         }
 
-        message->fds = calloc(n_fds, sizeof(int));
-        if (!message->fds)
-                return -ENOMEM;
-        memcpy(message->fds, (uint8_t*)handle_ids + c_align_to(n_handles, 8), n_fds * sizeof(int));
-        message->n_fds = n_fds;
+        /* installed fds are accounted once handed out, see b1_message_get_fd() */
+        if (fds_installed && n_fds) {
+                message->fds_used = calloc((n_fds + 63) / 64, sizeof(*message->fds_used));
+                if (!message->fds_used)
+                        return -ENOMEM;
+        }
 
         *messagep = message;
         message = NULL;
@@ -191,24 +279,79 @@ int b1_message_new_from_slice(B1Peer *peer,
         return 0;
 }
 
-/**
- * b1_message_send() - send a message to the given handles
- * @message             the message to be sent
- * @destinations        the destination handles
- * @n_destinations      the number of destinations
- *
- * Return: 0 on succes, or a negative error code on failure.
+/*
+ * Get the payload vecs to pass to the kernel. On peers that stamp their
+ * messages, this is a copy of the payload vecs with @trailer appended, in
+ * @buffer if it is large enough, or allocated otherwise. The caller frees the
+ * returned array, unless it is either @buffer or the vecs of @message.
  */
-_c_public_ int b1_message_send(B1Message *message,
-                               B1Handle **destinations,
-                               size_t n_destinations) {
-        /* limit number of destinations? */
-        uint64_t destination_ids[n_destinations];
-        uint64_t *handle_ids;
-        struct bus1_cmd_send send = {
-                .ptr_destinations = n_destinations > 0 ? (uintptr_t)destination_ids : 0,
-                .n_destinations = n_destinations,
+static int b1_message_get_send_vecs(B1Message *message,
+                                    B1MessageTrailer *trailer,
+                                    struct iovec *buffer,
+                                    size_t n_buffer,
+                                    struct iovec **vecsp,
+                                    size_t *n_vecsp) {
+        struct iovec *vecs = buffer;
+
+        if (!(message->peer->flags & B1_PEER_FLAG_TIMESTAMPS)) {
+                *vecsp = message->vecs;
+                *n_vecsp = message->n_vecs;
+                return 0;
+        }
+
+        if (message->n_vecs + 1 > n_buffer) {
+                vecs = malloc((message->n_vecs + 1) * sizeof(*vecs));
+                if (!vecs)
+                        return -ENOMEM;
+        }
+
+        *trailer = (B1MessageTrailer){
+                .timestamp = b1_stats_now(),
+                .magic = B1_MESSAGE_TRAILER_MAGIC,
+        };
+
+        if (message->n_vecs)
+                memcpy(vecs, message->vecs, message->n_vecs * sizeof(*vecs));
+        vecs[message->n_vecs] = (struct iovec){
+                .iov_base = trailer,
+                .iov_len = sizeof(*trailer),
         };
+
+        *vecsp = vecs;
+        *n_vecsp = message->n_vecs + 1;
+        return 0;
+}
+
+static void b1_message_count_send(B1Message *message) {
+        uint64_t n_bytes = 0;
+
+        if (!message->peer->stats)
+                return;
+
+        for (size_t i = 0; i < message->n_vecs; i++)
+                n_bytes += message->vecs[i].iov_len;
+
+        b1_stats_count_send(message->peer->stats, n_bytes);
+}
+
+/*
+ * Fill @send for sending @message, with the id and vec arrays carved out of
+ * @scratchp, which is advanced past them. Nothing is modified until the send
+ * succeeded, see b1_message_complete_send().
+ *
+ * Return: 0 on success, 1 if the message allocates new nodes, or a negative
+ *         error code on failure.
+ */
+static int b1_message_prepare_send(B1Message *message,
+                                   B1Handle **destinations,
+                                   size_t n_destinations,
+                                   struct bus1_cmd_send *send,
+                                   uint8_t **scratchp) {
+        B1MessageTrailer *trailer;
+        struct iovec *vecs;
+        uint64_t *ids;
+        size_t n_vecs;
+        bool unlinked = false;
         int r;
 
         assert(!n_destinations || destinations);
@@ -216,52 +359,55 @@ _c_public_ int b1_message_send(B1Message *message,
         if (!message || message->type != BUS1_MSG_DATA)
                 return -EINVAL;
 
-        handle_ids = malloc(sizeof(uint64_t) * message->n_handles);
-        if (!handle_ids)
-                return -ENOMEM;
+        r = b1_handles_check_unique(message->handles, message->n_handles);
+        if (r < 0)
+                return r;
 
-        send.ptr_vecs = (uintptr_t)message->vecs;
-        send.n_vecs = message->n_vecs;
-        send.ptr_handles = (uintptr_t)handle_ids;
-        send.n_handles = message->n_handles;
-        send.ptr_fds = (uintptr_t)message->fds;
-        send.n_fds = message->n_fds;
+        for (size_t i = 0; i < n_destinations; i++)
+                if (destinations[i]->holder != message->peer)
+                        return -EINVAL;
 
-        for (unsigned int i = 0; i < message->n_handles; i++) {
-                B1Handle *handle = message->handles[i];
+        trailer = (B1MessageTrailer *)*scratchp;
+        vecs = (struct iovec *)(trailer + 1);
+        ids = (uint64_t *)(vecs + message->n_vecs + 1);
+        *scratchp = (uint8_t *)(ids + message->n_handles + n_destinations);
 
-                if (handle->marked) {
-                        r = -ENOTUNIQ;
-                        goto error;
-                }
+        for (size_t i = 0; i < message->n_handles; i++) {
+                ids[i] = b1_handle_get_transfer_id(message->handles[i]);
+                if (message->handles[i]->id == BUS1_HANDLE_INVALID)
+                        unlinked = true;
+        }
 
-                handle->marked = true;
+        for (size_t i = 0; i < n_destinations; i++)
+                ids[message->n_handles + i] = destinations[i]->id;
 
-                if (handle->id == BUS1_HANDLE_INVALID)
-                        handle_ids[i] = BUS1_NODE_FLAG_MANAGED |
-                                        BUS1_NODE_FLAG_ALLOCATE;
-                else
-                        handle_ids[i] = handle->id;
-        }
+        r = b1_message_get_send_vecs(message, trailer, vecs, message->n_vecs + 1, &vecs, &n_vecs);
+        assert(r >= 0);
 
-        for (unsigned int i = 0; i < n_destinations; i++) {
-                if (destinations[i]->holder != message->peer) {
-                        r = -EINVAL;
-                        goto error;
-                }
+        *send = (struct bus1_cmd_send){
+                .ptr_destinations = n_destinations > 0 ? (uintptr_t)(ids + message->n_handles) : 0,
+                .n_destinations = n_destinations,
+                .ptr_vecs = (uintptr_t)vecs,
+                .n_vecs = n_vecs,
+                .ptr_handles = (uintptr_t)ids,
+                .n_handles = message->n_handles,
+                .ptr_fds = (uintptr_t)message->fds,
+                .n_fds = message->n_fds,
+        };
 
-                destination_ids[i] = destinations[i]->id;
-        }
+        return unlinked;
+}
 
-        r = bus1_peer_send(message->peer->peer, &send);
-        if (r < 0)
-                goto error;
+static void b1_message_complete_send(B1Message *message,
+                                     const struct bus1_cmd_send *send,
+                                     B1Handle **destinations,
+                                     size_t n_destinations) {
+        const uint64_t *handle_ids = (const uint64_t *)(uintptr_t)send->ptr_handles;
 
-        for (unsigned int i = 0; i < message->n_handles; i++) {
+        /* the kernel returned the ids of the nodes it allocated */
+        for (size_t i = 0; i < message->n_handles; i++) {
                 B1Handle *handle = message->handles[i];
 
-                handle->marked = false;
-
                 if (handle->id != BUS1_HANDLE_INVALID)
                         continue;
 
@@ -271,20 +417,254 @@ _c_public_ int b1_message_send(B1Message *message,
                         assert(b1_node_link(handle->node, handle_ids[i]) >= 0);
         }
 
-        free(handle_ids);
+        b1_message_count_send(message);
+        b1_capture_send(message, destinations, n_destinations);
+}
 
-        return 0;
+static size_t b1_messages_submit(B1Message **messages,
+                                 B1Handle ***destinations,
+                                 size_t *n_destinations,
+                                 int *errors,
+                                 struct bus1_peer_cmd *cmds,
+                                 const size_t *indices,
+                                 size_t n_cmds) {
+        B1Peer *peer = messages[indices[0]]->peer;
+        size_t n_sent = 0;
+
+        b1_stats_count_ioctl(peer->stats, B1_STATS_IOCTL_SEND, n_cmds);
+        (void)bus1_peer_submit(peer->peer, cmds, n_cmds);
+
+        for (size_t i = 0; i < n_cmds; i++) {
+                if (errors)
+                        errors[indices[i]] = cmds[i].result < 0 ? cmds[i].result : 0;
+                if (cmds[i].result < 0)
+                        continue;
 
-error:
-        free(handle_ids);
+                b1_message_complete_send(messages[indices[i]],
+                                         cmds[i].arg,
+                                         destinations[indices[i]],
+                                         n_destinations[indices[i]]);
+                ++n_sent;
+        }
 
-        /* unmark handles */
-        for (unsigned int i = 0; i < message->n_handles; i++)
-                message->handles[i]->marked = false;
+        return n_sent;
+}
+
+/**
+ * b1_messages_send() - send a batch of messages
+ * @messages            the messages to be sent
+ * @destinations        the destination handles, for each message
+ * @n_destinations      the number of destinations, for each message
+ * @n_messages          the number of messages
+ * @errors              the result of each message, or NULL
+ *
+ * This sends each message to its own destinations, as b1_message_send()
+ * would. The scratch space for the whole batch is allocated at once, or not at
+ * all for small batches, and consecutive messages of the same peer are
+ * submitted to the kernel together.
+ *
+ * Messages are sent in order, and independently of each other: a message that
+ * fails does not affect the others. If given, @errors is set to 0 for each
+ * message sent, and to a negative error code for each message that failed.
+ *
+ * Return: the number of messages sent.
+ */
+_c_public_ size_t b1_messages_send(B1Message **messages,
+                                   B1Handle ***destinations,
+                                   size_t *n_destinations,
+                                   size_t n_messages,
+                                   int *errors) {
+        uint64_t buffer[128];
+        struct bus1_peer_cmd *cmds;
+        struct bus1_cmd_send *sends;
+        size_t n_scratch, n_run = 0, *indices;
+        uint8_t *scratch, *p;
+        size_t n_sent = 0;
+        int r;
+
+        assert(!n_messages || (messages && destinations && n_destinations));
+
+        n_scratch = n_messages * (sizeof(*cmds) + sizeof(*sends) + sizeof(*indices));
+        for (size_t i = 0; i < n_messages; i++)
+                if (messages[i])
+                        n_scratch += sizeof(B1MessageTrailer) +
+                                     (messages[i]->n_vecs + 1) * sizeof(struct iovec) +
+                                     (messages[i]->n_handles + n_destinations[i]) * sizeof(uint64_t);
+
+        scratch = (uint8_t *)buffer;
+        if (n_scratch > sizeof(buffer)) {
+                scratch = malloc(n_scratch);
+                if (!scratch) {
+                        for (size_t i = 0; errors && i < n_messages; i++)
+                                errors[i] = -ENOMEM;
+                        return 0;
+                }
+        }
+
+        cmds = (struct bus1_peer_cmd *)scratch;
+        sends = (struct bus1_cmd_send *)(cmds + n_messages);
+        indices = (size_t *)(sends + n_messages);
+        p = (uint8_t *)(indices + n_messages);
+
+        for (size_t i = 0; i < n_messages; i++) {
+                /* a submission is issued on a single peer */
+                if (n_run && messages[i] && messages[i]->peer != messages[indices[0]]->peer) {
+                        n_sent += b1_messages_submit(messages, destinations, n_destinations, errors,
+                                                     cmds, indices, n_run);
+                        n_run = 0;
+                }
+
+                r = b1_message_prepare_send(messages[i], destinations[i], n_destinations[i],
+                                            &sends[n_run], &p);
+                if (r < 0) {
+                        if (errors)
+                                errors[i] = r;
+                        continue;
+                }
+
+                cmds[n_run] = (struct bus1_peer_cmd){
+                        .cmd = BUS1_CMD_SEND,
+                        .arg = &sends[n_run],
+                };
+                indices[n_run++] = i;
+
+                /*
+                 * Ids of new nodes are only known once the send returns, later
+                 * messages carrying the same handles must wait for them.
+                 */
+                if (r > 0) {
+                        n_sent += b1_messages_submit(messages, destinations, n_destinations, errors,
+                                                     cmds, indices, n_run);
+                        n_run = 0;
+                }
+        }
+
+        if (n_run)
+                n_sent += b1_messages_submit(messages, destinations, n_destinations, errors,
+                                             cmds, indices, n_run);
+
+        if (scratch != (uint8_t *)buffer)
+                free(scratch);
+
+        return n_sent;
+}
+
+/**
+ * b1_message_send() - send a message to the given handles
+ * @message             the message to be sent
+ * @destinations        the destination handles
+ * @n_destinations      the number of destinations
+ *
+ * A handle must not be attached to the message more than once. Checking this
+ * only reads the attached handles. Handles that were sent or received before
+ * may therefore be attached to messages sent concurrently on other threads.
+ * The first send of a handle to a new node allocates the node, though, which
+ * is not serialized: until that send has returned, no other thread may send
+ * the same handle.
+ *
+ * Return: 0 on succes, -ENOTUNIQ if a handle is attached more than once, or a
+ *         negative error code on failure.
+ */
+_c_public_ int b1_message_send(B1Message *message,
+                               B1Handle **destinations,
+                               size_t n_destinations) {
+        int r;
+
+        b1_messages_send(&message, &destinations, &n_destinations, 1, &r);
 
         return r;
 }
 
+/**
+ * b1_message_forward() - send a received message on to the given handles
+ * @message             the received message
+ * @destinations        the destination handles
+ * @n_destinations      the number of destinations
+ *
+ * This sends an unmodified received message to new destinations. The payload
+ * is passed straight from the pool slice, the handles are passed by the ids
+ * stored in the slice, and the fds by the numbers they were installed as.
+ * Nothing is duplicated or reference counted, and no memory is allocated
+ * unless there are more than 64 destinations.
+ *
+ * The destinations must be held by the peer that received the message. If
+ * the message carries fds, they must have been installed on receive.
+ *
+ * Return: 0 on succes, or a negative error code on failure.
+ */
+_c_public_ int b1_message_forward(B1Message *message,
+                                  B1Handle **destinations,
+                                  size_t n_destinations) {
+        uint64_t ids_buffer[64], *destination_ids = ids_buffer;
+        const uint64_t *handle_ids;
+        struct bus1_cmd_send send = {
+                .n_destinations = n_destinations,
+        };
+        struct iovec buffer[2], *vecs;
+        B1MessageTrailer trailer;
+        size_t n_vecs;
+        int r;
+
+        assert(!n_destinations || destinations);
+
+        if (!message || message->type != BUS1_MSG_DATA || !message->slice)
+                return -EINVAL;
+
+        /* the payload must still be the slice it was received in */
+        if (message->n_vecs != 1 || message->vecs[0].iov_base != message->slice)
+                return -EINVAL;
+
+        if (message->generation != message->peer->generation)
+                return -ESTALE;
+
+        handle_ids = (const uint64_t *)((const uint8_t *)message->slice +
+                                        c_align_to(message->vecs[0].iov_len + message->n_trailer, 8));
+
+        for (unsigned int i = 0; i < message->n_handles; i++)
+                if (!message->handles[i] || message->handles[i]->id != handle_ids[i])
+                        return -EINVAL;
+
+        for (unsigned int i = 0; i < message->n_fds; i++)
+                if (message->fds[i] < 0)
+                        return -EBADF;
+
+        for (size_t i = 0; i < n_destinations; i++)
+                if (destinations[i]->holder != message->peer)
+                        return -EINVAL;
+
+        if (n_destinations > C_ARRAY_SIZE(ids_buffer)) {
+                destination_ids = malloc(n_destinations * sizeof(*destination_ids));
+                if (!destination_ids)
+                        return -ENOMEM;
+        }
+
+        for (size_t i = 0; i < n_destinations; i++)
+                destination_ids[i] = destinations[i]->id;
+
+        /* a single payload vec always fits the buffer */
+        r = b1_message_get_send_vecs(message, &trailer, buffer, C_ARRAY_SIZE(buffer), &vecs, &n_vecs);
+        assert(r >= 0);
+
+        send.ptr_destinations = n_destinations > 0 ? (uintptr_t)destination_ids : 0;
+        send.ptr_vecs = (uintptr_t)vecs;
+        send.n_vecs = n_vecs;
+        send.ptr_handles = (uintptr_t)handle_ids;
+        send.n_handles = message->n_handles;
+        send.ptr_fds = (uintptr_t)message->fds;
+        send.n_fds = message->n_fds;
+
+        b1_stats_count_ioctl(message->peer->stats, B1_STATS_IOCTL_SEND, 1);
+        r = bus1_peer_send(message->peer->peer, &send);
+        if (destination_ids != ids_buffer)
+                free(destination_ids);
+        if (r < 0)
+                return r;
+
+        b1_message_count_send(message);
+        b1_capture_send(message, destinations, n_destinations);
+        return 0;
+}
+
 /**
  * b1_message_set_payload() - set the message payload
  * @message             the message to be sent
@@ -321,6 +701,70 @@ _c_public_ int b1_message_set_payload(B1Message *message, struct iovec *vecs, si
         return 0;
 }
 
+/**
+ * b1_message_set_variant() - set a variant as the message payload
+ * @message             the message to be sent
+ * @cv                  the variant to set as payload
+ *
+ * The variant is sealed, if it is not already, and its type and serialized
+ * data become the payload of the message. The iovecs backing @cv are passed to
+ * the kernel as they are, no copy of the data is made. Receivers can decode the
+ * payload with b1_message_get_variant().
+ *
+ * The caller must ensure that the variant remains valid for the lifetime of
+ * the message.
+ *
+ * Return: 0 on succes, or a negative error code on failure.
+ */
+_c_public_ int b1_message_set_variant(B1Message *message, CVariant *cv) {
+        const struct iovec *cv_vecs;
+        struct iovec *vecs_new;
+        size_t n_cv_vecs, n_type, n_header;
+        const char *type;
+        uint8_t *header;
+        int r;
+
+        assert(cv);
+
+        if (!message)
+                return -EINVAL;
+
+        if (!c_variant_is_sealed(cv)) {
+                r = c_variant_seal(cv);
+                if (r < 0)
+                        return r;
+        }
+
+        type = c_variant_peek_type(cv, &n_type);
+        cv_vecs = c_variant_get_vecs(cv, &n_cv_vecs);
+
+        /* the type is prepended as 64bit length and 8-byte aligned string */
+        n_header = sizeof(uint64_t) + c_align_to(n_type, 8);
+        header = calloc(1, n_header);
+        if (!header)
+                return -ENOMEM;
+
+        *(uint64_t*)header = n_type;
+        memcpy(header + sizeof(uint64_t), type, n_type);
+
+        vecs_new = malloc(sizeof(*vecs_new) * (n_cv_vecs + 1));
+        if (!vecs_new) {
+                free(header);
+                return -ENOMEM;
+        }
+
+        vecs_new[0].iov_base = header;
+        vecs_new[0].iov_len = n_header;
+        memcpy(vecs_new + 1, cv_vecs, sizeof(*cv_vecs) * n_cv_vecs);
+
+        b1_message_free_vecs(message);
+        message->vecs = vecs_new;
+        message->n_vecs = n_cv_vecs + 1;
+        message->variant_header = header;
+
+        return 0;
+}
+
 /**
  * b1_message_set_handles() - attach the given handles to the message
  * @message             the message to be sent
@@ -508,6 +952,24 @@ _c_public_ pid_t b1_message_get_tid(B1Message *message) {
         return message->tid;
 }
 
+/**
+ * b1_message_get_send_time() - get time the message was sent
+ * @message:            the received message
+ *
+ * Messages sent by peers created with B1_PEER_FLAG_TIMESTAMPS carry the time
+ * they were sent at, if they are received by a peer created with the same
+ * flag. The time is taken from CLOCK_MONOTONIC, so it is only comparable on
+ * the same machine.
+ *
+ * Return: the send time in nanoseconds, or 0 if the message is not stamped.
+ */
+_c_public_ uint64_t b1_message_get_send_time(B1Message *message) {
+        if (!message)
+                return 0;
+
+        return message->send_time;
+}
+
 /**
  * b1_message_get_payload() - get the message payload
  * @message:            the message
@@ -516,7 +978,8 @@ _c_public_ pid_t b1_message_get_tid(B1Message *message) {
  *
  * Both the returned array and the underlying data remain owned by the message,
  * so the caller must either pin the message or make a copy of the data for as
- * long as the data is needed.
+ * long as the data is needed. For received messages, b1_message_detach_payload()
+ * allows keeping just the data.
  *
  * Returns: 0 on success, or a negative error code on failure.
  */
@@ -533,6 +996,264 @@ _c_public_ int b1_message_get_payload(B1Message *message, struct iovec **vecsp,
         return 0;
 }
 
+static int b1_message_parse_variant(B1Message *message,
+                                    const char **typep,
+                                    size_t *n_typep,
+                                    struct iovec *vec,
+                                    struct iovec **vecsp,
+                                    size_t *n_vecsp) {
+        size_t n_header;
+        const uint8_t *header;
+        uint64_t n_type;
+
+        if (!message || message->n_vecs < 1)
+                return -EINVAL;
+
+        header = message->vecs[0].iov_base;
+        if (message->vecs[0].iov_len < sizeof(uint64_t))
+                return -EBADMSG;
+
+        n_type = *(const uint64_t*)header;
+        if (!n_type || n_type > message->vecs[0].iov_len - sizeof(uint64_t))
+                return -EBADMSG;
+
+        n_header = sizeof(uint64_t) + c_align_to(n_type, 8);
+
+        if (message->n_vecs == 1) {
+                /* received messages are backed by a single slice */
+                if (n_header > message->vecs[0].iov_len)
+                        return -EBADMSG;
+
+                vec->iov_base = (void*)(header + n_header);
+                vec->iov_len = message->vecs[0].iov_len - n_header;
+                *vecsp = vec;
+                *n_vecsp = 1;
+        } else {
+                if (n_header != message->vecs[0].iov_len)
+                        return -EBADMSG;
+
+                *vecsp = message->vecs + 1;
+                *n_vecsp = message->n_vecs - 1;
+        }
+
+        *typep = (const char*)header + sizeof(uint64_t);
+        *n_typep = n_type;
+        return 0;
+}
+
+/**
+ * b1_message_get_variant() - decode the message payload as variant
+ * @message:            the message
+ * @cvp:                pointer to the returned variant
+ *
+ * This decodes a payload created by b1_message_set_variant(). The returned
+ * variant reads directly from the payload, which for received messages is the
+ * slice in the pool of the receiving peer, so no data is copied.
+ *
+ * The caller owns the returned variant and must free it with c_variant_free().
+ * As the variant references the payload, the message must be pinned for as
+ * long as the variant is used.
+ *
+ * Returns: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_message_get_variant(B1Message *message, CVariant **cvp) {
+        struct iovec vec, *vecs;
+        const char *type;
+        size_t n_type, n_vecs;
+        int r;
+
+        assert(cvp);
+
+        r = b1_message_parse_variant(message, &type, &n_type, &vec, &vecs, &n_vecs);
+        if (r < 0)
+                return r;
+
+        return c_variant_new_from_vecs(cvp, type, n_type, vecs, n_vecs);
+}
+
+/**
+ * b1_message_peek_variant_array() - access a variant array in place
+ * @message:            the message
+ * @element:            type of the array elements
+ * @datap:              pointer to the returned elements
+ * @n_elementsp:        pointer to the returned number of elements
+ *
+ * This gives direct access to the elements of a payload created by
+ * b1_message_set_variant() from a variant of type "a" followed by @element.
+ * Arrays of fixed-size elements are serialized as plain C arrays, so for
+ * received messages @datap points straight into the pool slice, suitably
+ * aligned for the element type.
+ *
+ * Only the basic fixed-size types ("y", "b", "n", "q", "i", "u", "x", "t",
+ * "h" and "d") are supported as @element, other arrays are decoded with
+ * b1_message_get_variant().
+ *
+ * As the elements reference the payload, the message must be pinned for as
+ * long as they are used.
+ *
+ * Returns: 0 on success, -EMEDIUMTYPE if the payload is not an array of
+ *          @element, or a negative error code on failure.
+ */
+_c_public_ int b1_message_peek_variant_array(B1Message *message,
+                                             const char *element,
+                                             const void **datap,
+                                             size_t *n_elementsp) {
+        struct iovec vec, *vecs;
+        const char *type;
+        size_t n_type, n_vecs, n_element;
+        int r;
+
+        assert(element);
+        assert(datap);
+        assert(n_elementsp);
+
+        if (strlen(element) != 1)
+                return -EINVAL;
+
+        switch (element[0]) {
+        case 'y':
+        case 'b':
+                n_element = 1;
+                break;
+        case 'n':
+        case 'q':
+                n_element = 2;
+                break;
+        case 'i':
+        case 'u':
+        case 'h':
+                n_element = 4;
+                break;
+        case 'x':
+        case 't':
+        case 'd':
+                n_element = 8;
+                break;
+        default:
+                return -EINVAL;
+        }
+
+        r = b1_message_parse_variant(message, &type, &n_type, &vec, &vecs, &n_vecs);
+        if (r < 0)
+                return r;
+
+        if (n_type != 2 || type[0] != 'a' || type[1] != element[0])
+                return -EMEDIUMTYPE;
+
+        /* the elements of a message about to be sent may be scattered */
+        if (n_vecs > 1)
+                return -EINVAL;
+
+        if (n_vecs == 0 || vecs[0].iov_len == 0) {
+                *datap = NULL;
+                *n_elementsp = 0;
+                return 0;
+        }
+
+        if (vecs[0].iov_len % n_element || (uintptr_t)vecs[0].iov_base % n_element)
+                return -EBADMSG;
+
+        *datap = vecs[0].iov_base;
+        *n_elementsp = vecs[0].iov_len / n_element;
+        return 0;
+}
+
+/**
+ * b1_message_detach_payload() - get a reference to the payload slice
+ * @message:            the received message
+ * @slicep:             pointer to the returned slice
+ *
+ * This returns a reference to the pool slice backing the payload of a received
+ * message. The slice is only returned to the pool once both the message and
+ * all references to the slice are gone, so the message can be freed right
+ * away, together with its handles and fds, while the payload is still in use.
+ *
+ * Slices are reference counted atomically and may be passed to and dropped on
+ * other threads. For peers with B1_PEER_FLAG_SINGLE_THREADED the final
+ * reference must be dropped on the thread of the peer, though. In any case,
+ * b1_peer_reset() must not run concurrently with dropping the final reference
+ * to a slice of the same peer.
+ *
+ * Return: 0 on success, -EINVAL if the message is not backed by a slice, or a
+ *         negative error code on failure.
+ */
+_c_public_ int b1_message_detach_payload(B1Message *message, B1Slice **slicep) {
+        int r;
+
+        assert(slicep);
+
+        if (!message || !message->slice)
+                return -EINVAL;
+
+        if (!message->slice_ref) {
+                r = b1_slice_new(message->peer,
+                                 &message->slice_ref,
+                                 message->slice,
+                                 message->vecs ? message->vecs[0].iov_len : 0,
+                                 message->generation);
+                if (r < 0)
+                        return r;
+
+                b1_peer_move_slice(message->peer, &message->pool_entry, &message->slice_ref->pool_entry);
+        }
+
+        *slicep = b1_slice_ref(message->slice_ref);
+        return 0;
+}
+
+/**
+ * b1_message_peek_payload() - get a view into the message payload
+ * @message:            the message
+ * @offset:             offset of the view in the payload, in bytes
+ * @n_bytes:            size of the view, in bytes
+ * @alignment:          required alignment of the view
+ * @datap:              pointer to the returned view
+ *
+ * This returns a pointer directly into the payload, without copying any data.
+ * For received messages this points into the pool of the receiving peer. The
+ * view must be fully contained in a single iovec of the payload, and it must be
+ * suitably aligned. B1_MESSAGE_PEEK_PAYLOAD() derives the size and alignment
+ * from a type.
+ *
+ * The underlying data remains owned by the message, the same rules as for
+ * b1_message_get_payload() apply.
+ *
+ * Returns: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_message_peek_payload(B1Message *message,
+                                       size_t offset,
+                                       size_t n_bytes,
+                                       size_t alignment,
+                                       const void **datap) {
+        assert(alignment && !(alignment & (alignment - 1)));
+        assert(datap);
+
+        if (!message)
+                return -EINVAL;
+
+        for (unsigned int i = 0; i < message->n_vecs; i++) {
+                const struct iovec *vec = &message->vecs[i];
+                const uint8_t *data;
+
+                if (offset >= vec->iov_len) {
+                        offset -= vec->iov_len;
+                        continue;
+                }
+
+                if (n_bytes > vec->iov_len - offset)
+                        return -ERANGE;
+
+                data = (const uint8_t*)vec->iov_base + offset;
+                if ((uintptr_t)data & (alignment - 1))
+                        return -EINVAL;
+
+                *datap = data;
+                return 0;
+        }
+
+        return -ERANGE;
+}
+
 /**
  * b1_message_get_handle() - get hande passed with a message
  * @message:            the message
@@ -570,9 +1291,15 @@ _c_public_ int b1_message_get_handle(B1Message *message, unsigned int index, B1H
  * The caller needs to duplicate a file descriptor if they want to keep it after
  * the message has been freed.
  *
+ * If the message was received on a peer with B1_PEER_FLAG_DEFER_FDS, via
+ * b1_peer_recv() rather than b1_peer_recv_with_fds(), its fds were never
+ * installed and -EBADF is returned.
+ *
  * Returns: 0 on success, or a negitave error code on failure.
  */
 _c_public_ int b1_message_get_fd(B1Message *message, unsigned int index, int *fdp) {
+        uint64_t bit;
+
         assert(fdp);
 
         if (!message)
@@ -581,6 +1308,16 @@ _c_public_ int b1_message_get_fd(B1Message *message, unsigned int index, int *fd
         if (index >= message->n_fds)
                 return -ERANGE;
 
+        if (message->fds[index] < 0)
+                return -EBADF;
+
+        /* a message may be shared by several threads, only the first one counts */
+        if (message->fds_used) {
+                bit = UINT64_C(1) << (index % 64);
+                if (!(atomic_fetch_or_explicit(&message->fds_used[index / 64], bit, memory_order_relaxed) & bit))
+                        atomic_fetch_add_explicit(&message->peer->n_fds_used, 1, memory_order_relaxed);
+        }
+
         *fdp = message->fds[index];
 
         return 0;
@@ -8,14 +8,20 @@
  */
 
 #include <c-ref.h>
+#include <c-variant.h>
 #include <stdlib.h>
 #include <stdatomic.h>
+#include "linux/bus1.h"
 #include "org.bus1/b1-peer.h"
+#include "pool.h"
 
 struct B1Message {
         _Atomic unsigned long ref;
         B1Peer *peer;
         const void *slice; /* NULL if not backed by a slice */
+        uint64_t generation; /* peer generation the slice belongs to */
+        B1Slice *slice_ref; /* owns the slice once the payload was detached */
+        B1PoolEntry pool_entry;
 
         uint64_t type; /* BUS1_MSG_* */
 
@@ -24,16 +30,33 @@ struct B1Message {
         gid_t gid;
         pid_t pid;
         pid_t tid;
+        uint64_t send_time; /* CLOCK_MONOTONIC nsecs, 0 if not stamped */
+        size_t n_trailer; /* size of the stripped trailer, part of the slice */
 
         /* each of the following arrays are owned by the message */
         struct iovec *vecs; /* message does not own the backing data */
         size_t n_vecs;
+        void *variant_header; /* type header prepended to variant payloads */
         B1Handle **handles; /* message owns a ref to each handle */
         size_t n_handles;
-        int *fds; /* message owns each fd */
+        int *fds; /* message owns each fd, -1 if not installed */
         size_t n_fds;
+        _Atomic uint64_t *fds_used; /* bitmap of fds handed out so far, NULL unless received with fds */
 };
 
+#define B1_MESSAGE_TRAILER_MAGIC UINT64_C(0x72656c6961727462) /* "btrailer" */
+
+/*
+ * Trailer appended to the payload of messages sent by peers with
+ * B1_PEER_FLAG_TIMESTAMPS. It follows the payload unaligned.
+ */
+typedef struct B1MessageTrailer {
+        uint64_t timestamp;
+        uint64_t magic;
+} B1MessageTrailer;
+
+size_t b1_message_parse_trailer(const void *slice, size_t n_bytes, uint64_t *timestampp);
+
 int b1_message_new_from_slice(B1Peer *peer,
                               B1Message **messagep,
                               const void *slice,
@@ -45,4 +68,5 @@ int b1_message_new_from_slice(B1Peer *peer,
                               pid_t tid,
                               size_t n_bytes,
                               size_t n_handles,
-                              size_t n_fds);
+                              size_t n_fds,
+                              bool fds_installed);
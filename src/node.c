@@ -9,8 +9,10 @@
 
 #include <assert.h>
 #include <c-macro.h>
+#include "capture.h"
 #include <errno.h>
 #include "linux/bus1.h"
+#include "message.h"
 #include "node.h"
 #include "peer.h"
 #include <stdlib.h>
@@ -40,6 +42,80 @@ static int handles_compare(CRBTree *t, void *k, CRBNode *n) {
                 return 0;
 }
 
+static int transfers_compare(CRBTree *t, void *k, CRBNode *n) {
+        B1HandleTransfer *transfer = c_container_of(n, B1HandleTransfer, rb_src);
+        uintptr_t peer = (uintptr_t)k;
+
+        if (peer < (uintptr_t)transfer->dst->holder)
+                return -1;
+        else if (peer > (uintptr_t)transfer->dst->holder)
+                return 1;
+        else
+                return 0;
+}
+
+static int transfers_in_compare(CRBTree *t, void *k, CRBNode *n) {
+        B1HandleTransfer *transfer = c_container_of(n, B1HandleTransfer, rb_dst);
+        uintptr_t handle = (uintptr_t)k;
+
+        if (handle < (uintptr_t)transfer->src)
+                return -1;
+        else if (handle > (uintptr_t)transfer->src)
+                return 1;
+        else
+                return 0;
+}
+
+static void b1_handle_transfer_free(B1HandleTransfer *transfer) {
+        c_rbnode_unlink(&transfer->rb_src);
+        c_rbnode_unlink(&transfer->rb_dst);
+        free(transfer);
+}
+
+/*
+ * Remember that transferring @src to the holder of @dst yields @dst. This is
+ * best-effort; if the entry cannot be allocated, the next transfer simply
+ * takes the slow path.
+ */
+static void b1_handle_cache_transfer(B1Handle *src, B1Handle *dst) {
+        B1HandleTransfer *transfer;
+        CRBNode **slot, *p, **slot_in, *p_in;
+
+        if (src == dst)
+                return;
+
+        slot = c_rbtree_find_slot(&src->transfers, transfers_compare, dst->holder, &p);
+        if (!slot)
+                return;
+
+        slot_in = c_rbtree_find_slot(&dst->transfers_in, transfers_in_compare, src, &p_in);
+        if (!slot_in)
+                return;
+
+        transfer = calloc(1, sizeof(*transfer));
+        if (!transfer)
+                return;
+
+        transfer->src = src;
+        transfer->dst = dst;
+        c_rbtree_add(&src->transfers, p, slot, &transfer->rb_src);
+        c_rbtree_add(&dst->transfers_in, p_in, slot_in, &transfer->rb_dst);
+}
+
+/*
+ * Drop all cached transfers from and to @handle. This must be called whenever
+ * the kernel handle behind @handle changes or goes away.
+ */
+void b1_handle_flush_transfers(B1Handle *handle) {
+        CRBNode *n;
+
+        while ((n = c_rbtree_first(&handle->transfers)))
+                b1_handle_transfer_free(c_container_of(n, B1HandleTransfer, rb_src));
+
+        while ((n = c_rbtree_first(&handle->transfers_in)))
+                b1_handle_transfer_free(c_container_of(n, B1HandleTransfer, rb_dst));
+}
+
 int b1_node_link(B1Node *node, uint64_t id) {
         CRBNode **slot, *p;
 
@@ -55,6 +131,7 @@ int b1_node_link(B1Node *node, uint64_t id) {
         node->id = id;
 
         c_rbtree_add(&node->owner->nodes, p, slot, &node->rb_nodes);
+        b1_capture_node(node);
 
         return 0;
 }
@@ -78,6 +155,23 @@ int b1_handle_link(B1Handle *handle, uint64_t id) {
         return 0;
 }
 
+/*
+ * The id to pass to the kernel when sending or transferring @handle. Handles
+ * of nodes that have not been allocated yet ask the kernel to allocate them.
+ */
+uint64_t b1_handle_get_transfer_id(B1Handle *handle) {
+        uint64_t id;
+
+        if (handle->id != BUS1_HANDLE_INVALID)
+                return handle->id;
+
+        id = BUS1_NODE_FLAG_MANAGED | BUS1_NODE_FLAG_ALLOCATE;
+        if (handle->node && handle->node->persistent)
+                id |= BUS1_NODE_FLAG_PERSISTENT;
+
+        return id;
+}
+
 static int b1_handle_new(B1Peer *peer, B1Handle **handlep) {
         _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
 
@@ -91,10 +185,11 @@ static int b1_handle_new(B1Peer *peer, B1Handle **handlep) {
         handle->ref = C_REF_INIT;
         handle->holder = b1_peer_ref(peer);
         handle->id = BUS1_HANDLE_INVALID;
-        handle->marked = false;
         handle->live = false;
         c_rbnode_init(&handle->rb);
 
+        b1_stats_add_objects(peer->stats, 0, 1);
+
         *handlep = handle;
         handle = NULL;
         return 0;
@@ -127,8 +222,9 @@ int b1_handle_acquire(B1Peer *peer, B1Handle **handlep, uint64_t handle_id) {
         } else {
                 handle = c_container_of(p, B1Handle, rb);
                 if (handle->live) {
-                        c_ref_inc(&handle->ref_kernel);
+                        b1_ref_inc(peer, &handle->ref_kernel);
                         /* reusing existing handle, drop redundant reference from kernel */
+                        b1_stats_count_ioctl(peer->stats, B1_STATS_IOCTL_HANDLE_RELEASE, 1);
                         r = bus1_peer_handle_release(handle->holder->peer, handle->id);
                         if (r < 0)
                                 return r;
@@ -136,21 +232,14 @@ int b1_handle_acquire(B1Peer *peer, B1Handle **handlep, uint64_t handle_id) {
                         handle->ref_kernel = C_REF_INIT;
                         handle->live = true;
                 }
-                c_ref_inc(&handle->ref);
+                b1_ref_inc(peer, &handle->ref);
         }
 
         *handlep = handle;
         return 0;
 }
 
-/**
- * b1_node_new() - create a new node for a peer
- * @peer:               the owning peer
- * @nodep:              pointer to the new node object
- *
- * Return: 0 on success, and a negative error code on failure.
- */
-_c_public_ int b1_node_new(B1Peer *peer, B1Node **nodep) {
+static int b1_node_new_internal(B1Peer *peer, B1Node **nodep) {
         _c_cleanup_(b1_node_freep) B1Node *node = NULL;
         int r;
 
@@ -161,6 +250,7 @@ _c_public_ int b1_node_new(B1Peer *peer, B1Node **nodep) {
         node->id = BUS1_HANDLE_INVALID;
         node->owner = b1_peer_ref(peer);
         c_rbnode_init(&node->rb_nodes);
+        b1_stats_add_objects(peer->stats, 1, 0);
 
         r = b1_handle_new(peer, &node->handle);
         if (r < 0)
@@ -173,6 +263,116 @@ _c_public_ int b1_node_new(B1Peer *peer, B1Node **nodep) {
         return 0;
 }
 
+/*
+ * Create a node that is already allocated in the kernel, for the reservoir of
+ * @peer. Transferring the owner handle to ourselves allocates the node id, and
+ * releasing the transferred reference leaves the node in the same state as a
+ * node whose handle was sent once.
+ *
+ * Reserved nodes do not pin their peer, otherwise the reservoir would keep the
+ * peer alive forever. The references are taken once the node is handed out.
+ */
+int b1_node_new_reserved(B1Peer *peer, B1Node **nodep) {
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        B1Handle *handle;
+        int r;
+
+        r = b1_node_new_internal(peer, &node);
+        if (r < 0)
+                return r;
+
+        r = b1_handle_transfer(node->handle, peer, &handle);
+        if (r < 0)
+                return r;
+
+        b1_handle_unref(handle);
+
+        b1_peer_unref(node->handle->holder);
+        b1_peer_unref(node->owner);
+
+        *nodep = node;
+        node = NULL;
+        return 0;
+}
+
+/*
+ * Free a node from the reservoir of its peer, without touching the peer
+ * references it does not hold. The kernel node goes away with the peer.
+ */
+void b1_node_free_reserved(B1Node *node) {
+        assert(!node->handle->live);
+
+        c_rbnode_unlink(&node->rb_nodes);
+        c_rbnode_unlink(&node->handle->rb);
+        b1_handle_flush_transfers(node->handle);
+        b1_stats_add_objects(node->owner->stats, -1, -1);
+
+        free(node->handle);
+        free(node);
+}
+
+/**
+ * b1_node_new_with_flags() - create a new node for a peer
+ * @peer:               the owning peer
+ * @nodep:              pointer to the new node object
+ * @flags:              B1_NODE_FLAG_* flags
+ *
+ * If B1_NODE_FLAG_PERSISTENT is given, the node survives b1_peer_reset(), and
+ * handles held by other peers stay valid across it. This is meant for
+ * long-lived service nodes.
+ *
+ * If the peer has reserved nodes, see b1_peer_reserve_nodes(), a regular node
+ * is taken from the reservoir. It is already allocated in the kernel, so
+ * sending or transferring its handle for the first time does not need to
+ * allocate and link it. Otherwise, the node is allocated lazily when its
+ * handle is first used.
+ *
+ * Return: 0 on success, and a negative error code on failure.
+ */
+_c_public_ int b1_node_new_with_flags(B1Peer *peer, B1Node **nodep, uint64_t flags) {
+        B1Node *node;
+        int r;
+
+        if (flags & ~B1_NODE_FLAG_PERSISTENT)
+                return -EINVAL;
+
+        if (flags & B1_NODE_FLAG_PERSISTENT) {
+                r = b1_node_new_internal(peer, &node);
+                if (r < 0)
+                        return r;
+
+                node->persistent = true;
+
+                *nodep = node;
+                return 0;
+        }
+
+        if (peer->n_reserved_nodes > 0) {
+                node = peer->reserved_nodes[--peer->n_reserved_nodes];
+
+                b1_peer_ref(node->owner);
+                b1_peer_ref(node->handle->holder);
+
+                *nodep = node;
+                return 0;
+        }
+
+        return b1_node_new_internal(peer, nodep);
+}
+
+/**
+ * b1_node_new() - create a new node for a peer
+ * @peer:               the owning peer
+ * @nodep:              pointer to the new node object
+ *
+ * This is equivalent to b1_node_new_with_flags() without flags.
+ *
+ * Return: 0 on success, and a negative error code on failure.
+ */
+_c_public_ int b1_node_new(B1Peer *peer, B1Node **nodep) {
+        return b1_node_new_with_flags(peer, nodep, 0);
+}
+
 /**
  * b1_node_free() - destroy a node
  * @node:               node to destroy
@@ -191,6 +391,7 @@ _c_public_ B1Node *b1_node_free(B1Node *node) {
         b1_node_destroy(node);
 
         b1_handle_unref(node->handle);
+        b1_stats_add_objects(node->owner->stats, -1, 0);
         b1_peer_unref(node->owner);
         free(node);
 
@@ -230,7 +431,8 @@ _c_public_ B1Handle *b1_node_get_handle(B1Node *node) {
  * peers. If any peers still hold handles, they will receive node destruction
  * notifications for this node.
  *
- * If NULL is passed, this is a no-op.
+ * If NULL is passed, or the node was never allocated in the kernel (or was
+ * destroyed by b1_peer_reset()), this is a no-op.
  *
  * Return: 0 on success, and a negative error code on failure.
  */
@@ -239,10 +441,24 @@ _c_public_ int b1_node_destroy(B1Node *node) {
                 .ptr_nodes = (uintptr_t)&node->id,
                 .n_nodes = 1,
         };
+        B1HandleTransfer *transfer;
+        CRBNode *n;
 
-        if (!node)
+        if (!node || node->id == BUS1_HANDLE_INVALID)
                 return 0;
 
+        /*
+         * Handles we transferred the node to are now stale, and so is anything
+         * they were transferred on to. The remaining holders drop their cached
+         * transfers when they receive the destruction notification.
+         */
+        while ((n = c_rbtree_first(&node->handle->transfers))) {
+                transfer = c_container_of(n, B1HandleTransfer, rb_src);
+                b1_handle_flush_transfers(transfer->dst);
+        }
+        b1_handle_flush_transfers(node->handle);
+
+        b1_stats_count_ioctl(node->owner->stats, B1_STATS_IOCTL_NODES_DESTROY, 1);
         return bus1_peer_nodes_destroy(node->owner->peer, &nodes_destroy);
 }
 
@@ -267,8 +483,8 @@ _c_public_ B1Handle *b1_handle_ref(B1Handle *handle) {
                         assert(r >= 0);
                         assert(new_handle == handle);
                 } else {
-                        c_ref_inc(&handle->ref_kernel);
-                        c_ref_inc(&handle->ref);
+                        b1_ref_inc(handle->holder, &handle->ref_kernel);
+                        b1_ref_inc(handle->holder, &handle->ref);
                 }
         }
 
@@ -280,6 +496,8 @@ static void b1_handle_release(_Atomic unsigned long *ref, void *userdata) {
         int r;
 
         handle->live = false;
+        b1_handle_flush_transfers(handle);
+        b1_stats_count_ioctl(handle->holder->stats, B1_STATS_IOCTL_HANDLE_RELEASE, 1);
         r = bus1_peer_handle_release(handle->holder->peer, handle->id);
         assert(r >= 0);
 }
@@ -289,9 +507,11 @@ static void b1_handle_free(_Atomic unsigned long *ref, void *userdata) {
 
         assert(!handle->live);
 
+        b1_handle_flush_transfers(handle);
 //        c_rbtree_remove_init(&handle->holder->handles, &handle->rb);
         c_rbnode_unlink(&handle->rb);
 
+        b1_stats_add_objects(handle->holder->stats, 0, -1);
         b1_peer_unref(handle->holder);
         free(handle);
 }
@@ -310,8 +530,8 @@ static void b1_handle_free(_Atomic unsigned long *ref, void *userdata) {
 _c_public_ B1Handle *b1_handle_unref(B1Handle *handle) {
         if (handle) {
                 if (handle->live)
-                        c_ref_dec(&handle->ref_kernel, b1_handle_release, handle);
-                c_ref_dec(&handle->ref, b1_handle_free, handle);
+                        b1_ref_dec(handle->holder, &handle->ref_kernel, b1_handle_release, handle);
+                b1_ref_dec(handle->holder, &handle->ref, b1_handle_free, handle);
         }
 
         return NULL;
@@ -329,6 +549,49 @@ _c_public_ B1Peer *b1_handle_get_peer(B1Handle *handle) {
         return handle->holder;
 }
 
+static void b1_handle_reset(B1Handle *handle) {
+        c_rbnode_unlink(&handle->rb);
+        b1_handle_flush_transfers(handle);
+
+        handle->id = BUS1_HANDLE_INVALID;
+        handle->live = false;
+        atomic_store_explicit(&handle->ref_kernel, 0, memory_order_relaxed);
+}
+
+/*
+ * Forget everything the kernel dropped in a BUS1_CMD_PEER_RESET. The objects
+ * themselves are owned by the application and stay around until their last
+ * reference is dropped, but they are unlinked and marked unallocated, so this
+ * no longer involves the kernel. Persistent nodes, and the owner handles of
+ * them, are retained unless the peer was disconnected.
+ */
+void b1_nodes_reset(B1Peer *peer, bool disconnect) {
+        B1Handle *handle;
+        B1Node *node;
+        CRBNode *n, *next;
+
+        for (n = c_rbtree_first(&peer->nodes); n; n = next) {
+                next = c_rbnode_next(n);
+                node = c_container_of(n, B1Node, rb_nodes);
+
+                if (node->persistent && !disconnect)
+                        continue;
+
+                c_rbnode_unlink(&node->rb_nodes);
+                node->id = BUS1_HANDLE_INVALID;
+        }
+
+        for (n = c_rbtree_first(&peer->handles); n; n = next) {
+                next = c_rbnode_next(n);
+                handle = c_container_of(n, B1Handle, rb);
+
+                if (handle->node && handle->node->id != BUS1_HANDLE_INVALID)
+                        continue;
+
+                b1_handle_reset(handle);
+        }
+}
+
 B1Node *b1_node_lookup(B1Peer *peer, uint64_t node_id) {
         CRBNode *n;
 
@@ -362,18 +625,34 @@ B1Handle *b1_handle_lookup(B1Peer *peer, uint64_t handle_id) {
  * In order for peers to communicate, they must be reachable from one another.
  * This transfers a handle from one peer to another.
  *
+ * Results are cached per source handle and destination peer. Transferring the
+ * same handle to the same peer again returns a new reference to the existing
+ * destination handle without entering the kernel. The cache is flushed when
+ * the node is destroyed or either handle is released.
+ *
  * Return: 0 on success, or a negative error code on failure.
  */
 _c_public_ int b1_handle_transfer(B1Handle *src_handle, B1Peer *dst, B1Handle **dst_handlep) {
         _c_cleanup_(b1_handle_unrefp) B1Handle *dst_handle = NULL;
         uint64_t src_handle_id, dst_handle_id = BUS1_HANDLE_INVALID;
+        B1HandleTransfer *transfer;
+        CRBNode *n;
         int r;
 
-        if (src_handle->id == BUS1_HANDLE_INVALID)
-                src_handle_id = BUS1_NODE_FLAG_MANAGED | BUS1_NODE_FLAG_ALLOCATE;
-        else
-                src_handle_id = src_handle->id;
+        n = c_rbtree_find_node(&src_handle->transfers, transfers_compare, dst);
+        if (n) {
+                transfer = c_container_of(n, B1HandleTransfer, rb_src);
+                if (transfer->dst->live) {
+                        *dst_handlep = b1_handle_ref(transfer->dst);
+                        return 0;
+                }
 
+                b1_handle_transfer_free(transfer);
+        }
+
+        src_handle_id = b1_handle_get_transfer_id(src_handle);
+
+        b1_stats_count_ioctl(src_handle->holder->stats, B1_STATS_IOCTL_HANDLE_TRANSFER, 1);
         r = bus1_peer_handle_transfer(src_handle->holder->peer, dst->peer, &src_handle_id, &dst_handle_id);
         if (r < 0)
                 return r;
@@ -394,7 +673,214 @@ _c_public_ int b1_handle_transfer(B1Handle *src_handle, B1Peer *dst, B1Handle **
         if (r < 0)
                 return r;
 
+        if (dst_handle) {
+                b1_handle_cache_transfer(src_handle, dst_handle);
+                b1_capture_transfer(src_handle, dst_handle);
+        }
+
         *dst_handlep = dst_handle;
         dst_handle = NULL;
         return 0;
 }
+
+/* below this many handles, comparing all pairs is cheaper than sorting */
+#define B1_HANDLES_UNIQUE_PAIRWISE (32)
+
+static int b1_handles_compare(const void *a, const void *b) {
+        uintptr_t x = (uintptr_t)*(B1Handle *const *)a, y = (uintptr_t)*(B1Handle *const *)b;
+
+        return (x > y) - (x < y);
+}
+
+/**
+ * b1_handles_check_unique() - verify that no handle is listed twice
+ * @handles:            the handles to check
+ * @n_handles:          the number of handles
+ *
+ * The handles themselves are only compared, never written to, so handles may
+ * be shared by messages checked concurrently. Short lists compare all pairs,
+ * longer ones are sorted in a copy, which lives on the stack unless the list
+ * is very long.
+ *
+ * Return: 0 if all handles are unique, -ENOTUNIQ if a handle is listed more
+ *         than once, or a negative error code on failure.
+ */
+int b1_handles_check_unique(B1Handle *const *handles, size_t n_handles) {
+        B1Handle *buffer[256], **sorted = buffer;
+        int r = 0;
+
+        if (n_handles <= B1_HANDLES_UNIQUE_PAIRWISE) {
+                for (size_t i = 1; i < n_handles; i++)
+                        for (size_t j = 0; j < i; j++)
+                                if (handles[i] == handles[j])
+                                        return -ENOTUNIQ;
+
+                return 0;
+        }
+
+        if (n_handles > C_ARRAY_SIZE(buffer)) {
+                sorted = malloc(n_handles * sizeof(*sorted));
+                if (!sorted)
+                        return -ENOMEM;
+        }
+
+        memcpy(sorted, handles, n_handles * sizeof(*sorted));
+        qsort(sorted, n_handles, sizeof(*sorted), b1_handles_compare);
+
+        for (size_t i = 1; i < n_handles; i++) {
+                if (sorted[i] == sorted[i - 1]) {
+                        r = -ENOTUNIQ;
+                        break;
+                }
+        }
+
+        if (sorted != buffer)
+                free(sorted);
+
+        return r;
+}
+
+/* below this many handles, the ioctl per handle is cheaper than the detour */
+#define B1_HANDLES_TRANSFER_BATCH (16)
+
+static bool b1_handles_transfer_batchable(B1Handle **src_handles, size_t n_handles, B1Peer *dst) {
+        B1Peer *holder = src_handles[0]->holder;
+
+        if (n_handles < B1_HANDLES_TRANSFER_BATCH || holder == dst)
+                return false;
+
+        /*
+         * A peer without any nodes or handles cannot have anything new queued
+         * for it, but it might still have old messages and notifications
+         * queued. Only if its queue is empty, the message we send is
+         * guaranteed to be at the front of it.
+         */
+        if (c_rbtree_first(&dst->nodes) || c_rbtree_first(&dst->handles))
+                return false;
+
+        for (size_t i = 0; i < n_handles; i++)
+                if (src_handles[i]->holder != holder)
+                        return false;
+
+        if (b1_handles_check_unique(src_handles, n_handles) < 0)
+                return false;
+
+        return b1_peer_queue_is_empty(dst);
+}
+
+/*
+ * The kernel has no batched form of BUS1_CMD_HANDLE_TRANSFER. Instead, create
+ * a private node on the destination, and send it a single message carrying all
+ * the handles. Receiving it installs all destination handles at once. The
+ * release and destruction notifications of the private node are hidden from
+ * the application.
+ */
+static int b1_handles_transfer_message(B1Handle **src_handles,
+                                       size_t n_handles,
+                                       B1Peer *dst,
+                                       B1Handle **dst_handles) {
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        B1Peer *holder = src_handles[0]->holder;
+        B1Handle *handle = NULL;
+        B1Message *message = NULL;
+        int r;
+
+        r = b1_node_new(dst, &node);
+        if (r < 0)
+                return r;
+
+        r = b1_handle_transfer(node->handle, holder, &handle);
+        if (r < 0)
+                return r;
+
+        r = b1_message_new(holder, &message);
+        if (r < 0)
+                goto exit;
+
+        r = b1_message_set_handles(message, src_handles, n_handles);
+        if (r < 0)
+                goto exit;
+
+        r = b1_message_send(message, &handle, 1);
+        if (r < 0)
+                goto exit;
+
+        message = b1_message_unref(message);
+
+        r = b1_peer_recv(dst, &message);
+        if (r < 0)
+                goto exit;
+
+        if (message->type != BUS1_MSG_DATA ||
+            message->destination != node->id ||
+            message->n_handles != n_handles) {
+                r = -EIO;
+                goto exit;
+        }
+
+        for (size_t i = 0; i < n_handles; i++) {
+                dst_handles[i] = message->handles[i];
+                message->handles[i] = NULL;
+
+                b1_handle_cache_transfer(src_handles[i], dst_handles[i]);
+                b1_capture_transfer(src_handles[i], dst_handles[i]);
+        }
+
+        r = 0;
+
+exit:
+        b1_peer_hide_notifications(dst, node->id);
+        b1_message_unref(message);
+        b1_handle_unref(handle);
+        return r;
+}
+
+/**
+ * b1_handles_transfer() - transfer a set of handles from one peer to another
+ * @src_handles:        source handles
+ * @n_handles:          number of source handles
+ * @dst:                destination peer
+ * @dst_handles:        array to store the @n_handles destination handles in
+ *
+ * This is equivalent to calling b1_handle_transfer() on each source handle,
+ * but is meant to bootstrap a new peer with a large number of handles. If all
+ * source handles are held by the same peer, and @dst has neither nodes nor
+ * handles yet, the handles are passed in a single message rather than one
+ * ioctl each. That requires that nothing is queued on @dst, and that @dst is not
+ * used concurrently.
+ *
+ * On failure, no destination handles are returned.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_handles_transfer(B1Handle **src_handles,
+                                   size_t n_handles,
+                                   B1Peer *dst,
+                                   B1Handle **dst_handles) {
+        size_t i;
+        int r;
+
+        assert(!n_handles || (src_handles && dst_handles));
+
+        if (!n_handles)
+                return 0;
+
+        if (b1_handles_transfer_batchable(src_handles, n_handles, dst)) {
+                r = b1_handles_transfer_message(src_handles, n_handles, dst, dst_handles);
+                if (r >= 0)
+                        return 0;
+        }
+
+        for (i = 0; i < n_handles; i++) {
+                r = b1_handle_transfer(src_handles[i], dst, &dst_handles[i]);
+                if (r < 0)
+                        goto error;
+        }
+
+        return 0;
+
+error:
+        while (i-- > 0)
+                dst_handles[i] = b1_handle_unref(dst_handles[i]);
+        return r;
+}
@@ -12,6 +12,8 @@
 #include <c-ref.h>
 #include "org.bus1/b1-peer.h"
 
+typedef struct B1HandleTransfer B1HandleTransfer;
+
 struct B1Handle {
         _Atomic unsigned long ref;
         _Atomic unsigned long ref_kernel;
@@ -21,22 +23,39 @@ struct B1Handle {
         uint64_t id;
 
         bool live; /* holds a reference in the kernel */
-        bool marked; /* used for duplicate detection */
 
         CRBNode rb;
+
+        CRBTree transfers; /* cached transfers from this handle, by destination peer */
+        CRBTree transfers_in; /* cached transfers to this handle, by source handle */
+};
+
+struct B1HandleTransfer {
+        B1Handle *src;
+        B1Handle *dst;
+
+        CRBNode rb_src;
+        CRBNode rb_dst;
 };
 
 struct B1Node {
         B1Peer *owner;
         B1Handle *handle;
         uint64_t id;
+        bool persistent; /* survives b1_peer_reset() */
 
         CRBNode rb_nodes;
 };
 
 int b1_handle_acquire(B1Peer *peer, B1Handle **handlep, uint64_t handle_id);
 int b1_handle_link(B1Handle *handle, uint64_t id);
+uint64_t b1_handle_get_transfer_id(B1Handle *handle);
 B1Handle *b1_handle_lookup(B1Peer *peer, uint64_t id);
+int b1_handles_check_unique(B1Handle *const *handles, size_t n_handles);
+void b1_handle_flush_transfers(B1Handle *handle);
 
 int b1_node_link(B1Node *node, uint64_t id);
+int b1_node_new_reserved(B1Peer *peer, B1Node **nodep);
+void b1_node_free_reserved(B1Node *node);
+void b1_nodes_reset(B1Peer *peer, bool disconnect);
 B1Node *b1_node_lookup(B1Peer *peer, uint64_t id);
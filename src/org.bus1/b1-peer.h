@@ -23,25 +23,185 @@
 extern "C" {
 #endif
 
+typedef struct B1Executor B1Executor;
+typedef struct B1Flow B1Flow;
+typedef struct B1FlowStats B1FlowStats;
 typedef struct B1Handle B1Handle;
+typedef struct B1LatencyStats B1LatencyStats;
 typedef struct B1Message B1Message;
+typedef struct B1MessageHeader B1MessageHeader;
 typedef struct B1Node B1Node;
 typedef struct B1Peer B1Peer;
+typedef struct B1PeerFactory B1PeerFactory;
+typedef struct B1PoolStats B1PoolStats;
+typedef struct B1RecvPump B1RecvPump;
+typedef struct B1RecvPumpStats B1RecvPumpStats;
+typedef struct B1SendQueue B1SendQueue;
+typedef struct B1SendQueueStats B1SendQueueStats;
+typedef struct B1Slice B1Slice;
+typedef struct CVariant CVariant;
 
 /* peers */
 
+enum {
+        B1_PEER_FLAG_SINGLE_THREADED    = 1ULL << 0,
+        B1_PEER_FLAG_POOL_POPULATE      = 1ULL << 1,
+        B1_PEER_FLAG_POOL_HUGEPAGE      = 1ULL << 2,
+        B1_PEER_FLAG_POOL_LOCAL         = 1ULL << 3,
+        B1_PEER_FLAG_DEFER_FDS          = 1ULL << 4,
+        B1_PEER_FLAG_STATS              = 1ULL << 5,
+        B1_PEER_FLAG_TIMESTAMPS         = 1ULL << 6,
+};
+
+enum {
+        B1_PEER_RESET_FLAG_DISCONNECT   = 1ULL << 0,
+};
+
 int b1_peer_new(B1Peer **peerp);
+int b1_peer_new_with_flags(B1Peer **peerp, uint64_t flags);
 int b1_peer_new_from_fd(B1Peer **peerp, int fd);
 B1Peer *b1_peer_ref(B1Peer *peer);
 B1Peer *b1_peer_unref(B1Peer *peer);
 
+int b1_peer_reset(B1Peer *peer, uint64_t flags);
+
 int b1_peer_get_fd(B1Peer *peer);
+int b1_peer_reserve_nodes(B1Peer *peer, size_t n_nodes);
 
 int b1_peer_recv(B1Peer *peer, B1Message **messagep);
+int b1_peer_recv_with_fds(B1Peer *peer, B1Message **messagep);
+struct B1PoolStats {
+        uint64_t n_mapped;
+        uint64_t n_bytes;
+        uint64_t n_slices;
+        uint64_t n_slice_max;
+        uint64_t oldest_age_ns;
+        uint64_t n_dropped;
+};
+
+void b1_peer_get_pool_stats(B1Peer *peer, B1PoolStats *stats);
+void b1_peer_get_fd_stats(B1Peer *peer, uint64_t *n_installedp, uint64_t *n_usedp, uint64_t *n_droppedp);
+
+struct B1LatencyStats {
+        uint64_t n_samples;
+        uint64_t p50_ns;
+        uint64_t p90_ns;
+        uint64_t p99_ns;
+        uint64_t max_ns;
+};
+
+void b1_peer_get_latency_stats(B1Peer *peer, B1LatencyStats *stats);
+
+struct B1MessageHeader {
+        unsigned int type;
+        B1Node *destination_node;
+        uid_t uid;
+        gid_t gid;
+        pid_t pid;
+        pid_t tid;
+        size_t n_bytes;
+        size_t n_handles;
+        size_t n_fds;
+};
+
+int b1_peer_peek(B1Peer *peer, B1MessageHeader *header);
+int b1_peer_recv_peeked(B1Peer *peer, B1Message **messagep);
+int b1_peer_discard(B1Peer *peer);
 
 int b1_peer_set_seed(B1Peer *peer, B1Message *seed);
 int b1_peer_get_seed(B1Peer *peer, B1Message **seedp);
 
+/* peer factories */
+
+int b1_peer_factory_new(B1PeerFactory **factoryp, size_t n_stock, uint64_t flags, bool prefault);
+B1PeerFactory *b1_peer_factory_free(B1PeerFactory *factory);
+
+int b1_peer_factory_fill(B1PeerFactory *factory);
+int b1_peer_factory_take(B1PeerFactory *factory, B1Peer **peerp);
+
+/* receive pumps */
+
+struct B1RecvPumpStats {
+        uint64_t n_published;
+        uint64_t n_consumed;
+        uint64_t n_stalls;
+        uint64_t n_drops;
+        uint64_t n_depth;
+        uint64_t n_depth_max;
+        uint64_t latency_avg_ns;
+        uint64_t latency_max_ns;
+};
+
+int b1_recv_pump_new(B1RecvPump **pumpp, B1Peer *peer, size_t n_messages, int cpu);
+B1RecvPump *b1_recv_pump_free(B1RecvPump *pump);
+
+int b1_recv_pump_get_fd(B1RecvPump *pump);
+int b1_recv_pump_pop(B1RecvPump *pump, B1Message **messagep);
+B1Message *b1_recv_pump_release(B1RecvPump *pump, B1Message *message);
+void b1_recv_pump_get_stats(B1RecvPump *pump, B1RecvPumpStats *stats);
+
+/* executors */
+
+typedef void (*B1ExecutorFn) (B1Peer *peer, B1Message *message, void *userdata);
+
+int b1_executor_new(B1Executor **executorp, size_t n_workers, bool pin, B1ExecutorFn fn, void *userdata);
+B1Executor *b1_executor_free(B1Executor *executor);
+
+int b1_executor_add_peer(B1Executor *executor, B1Peer *peer, unsigned int worker_index);
+int b1_executor_start(B1Executor *executor);
+void b1_executor_get_stats(B1Executor *executor, uint64_t *n_messagesp, uint64_t *n_stealsp);
+
+/* flow control */
+
+struct B1FlowStats {
+        uint64_t n_credits;
+        uint64_t n_sent;
+        uint64_t n_grants;
+        uint64_t n_stalls;
+        uint64_t n_depth;
+        uint64_t n_depth_max;
+};
+
+int b1_flow_new(B1Flow **flowp, B1Handle *destination, size_t n_window, size_t n_queue_max);
+B1Flow *b1_flow_free(B1Flow *flow);
+
+int b1_flow_send(B1Flow *flow, B1Message *message, bool block);
+int b1_flow_dispatch(B1Flow *flow);
+int b1_flow_get_fd(B1Flow *flow);
+void b1_flow_get_stats(B1Flow *flow, B1FlowStats *stats);
+
+int b1_flow_accept(B1Message *message, B1Handle **credit_handlep);
+int b1_flow_grant(B1Handle *credit_handle, size_t n_credits);
+
+/* send queues */
+
+typedef void (*B1SendQueueFn) (B1Message *message, int error, void *userdata);
+
+struct B1SendQueueStats {
+        uint64_t n_sent;
+        uint64_t n_failed;
+        uint64_t n_retries;
+        uint64_t n_depth;
+        uint64_t n_depth_max;
+};
+
+int b1_send_queue_new(B1SendQueue **queuep, B1Peer *peer, B1SendQueueFn fn, void *userdata);
+B1SendQueue *b1_send_queue_free(B1SendQueue *queue);
+
+int b1_send_queue_get_fd(B1SendQueue *queue);
+int b1_send_queue_push(B1SendQueue *queue, B1Message *message, B1Handle **destinations, size_t n_destinations);
+int b1_send_queue_dispatch(B1SendQueue *queue);
+void b1_send_queue_get_stats(B1SendQueue *queue, B1SendQueueStats *stats);
+
+/* traffic capture */
+
+enum {
+        B1_CAPTURE_FLAG_PAYLOAD         = 1ULL << 0,
+};
+
+int b1_capture_start(const char *path, size_t n_bytes, uint64_t flags);
+int b1_capture_stop(uint64_t *n_droppedp);
+
 /* messages */
 
 int b1_message_new(B1Peer *peer, B1Message **messagep);
@@ -51,25 +211,45 @@ B1Message *b1_message_unref(B1Message *message);
 int b1_message_set_payload(B1Message *message, struct iovec *vecs, size_t n_vecs);
 int b1_message_set_handles(B1Message *message, B1Handle **handles, size_t n_handles);
 int b1_message_set_fds(B1Message *message, int *fds, size_t n_fds);
+int b1_message_set_variant(B1Message *message, CVariant *cv);
 
 int b1_message_send(B1Message *message, B1Handle **dests, size_t n_dests);
+int b1_message_forward(B1Message *message, B1Handle **dests, size_t n_dests);
+size_t b1_messages_send(B1Message **messages, B1Handle ***dests, size_t *n_dests, size_t n_messages, int *errors);
 
 uid_t b1_message_get_uid(B1Message *message);
 gid_t b1_message_get_gid(B1Message *message);
 pid_t b1_message_get_pid(B1Message *message);
 pid_t b1_message_get_tid(B1Message *message);
+uint64_t b1_message_get_send_time(B1Message *message);
 
 unsigned int b1_message_get_type(B1Message *message);
 B1Node *b1_message_get_destination_node(B1Message *message);
 B1Handle *b1_message_get_destination_handle(B1Message *message);
 
 int b1_message_get_payload(B1Message *message, struct iovec **vecsp, size_t *n_vecsp);
+int b1_message_get_variant(B1Message *message, CVariant **cvp);
+int b1_message_peek_variant_array(B1Message *message, const char *element, const void **datap, size_t *n_elementsp);
+int b1_message_peek_payload(B1Message *message, size_t offset, size_t n_bytes, size_t alignment, const void **datap);
 int b1_message_get_handle(B1Message *message, unsigned int index, B1Handle **handlep);
 int b1_message_get_fd(B1Message *message, unsigned int index, int *fdp);
+int b1_message_detach_payload(B1Message *message, B1Slice **slicep);
+
+/* slices */
+
+B1Slice *b1_slice_ref(B1Slice *slice);
+B1Slice *b1_slice_unref(B1Slice *slice);
+
+const void *b1_slice_get_data(B1Slice *slice, size_t *n_bytesp);
 
 /* nodes */
 
+enum {
+        B1_NODE_FLAG_PERSISTENT         = 1ULL << 0,
+};
+
 int b1_node_new(B1Peer *peer, B1Node **nodep);
+int b1_node_new_with_flags(B1Peer *peer, B1Node **nodep, uint64_t flags);
 B1Node *b1_node_free(B1Node *node);
 
 B1Peer *b1_node_get_peer(B1Node *node);
@@ -83,6 +263,7 @@ B1Handle *b1_handle_ref(B1Handle *handle);
 B1Handle *b1_handle_unref(B1Handle *handle);
 
 int b1_handle_transfer(B1Handle *src_handle, B1Peer *dst, B1Handle **dst_handlep);
+int b1_handles_transfer(B1Handle **src_handles, size_t n_handles, B1Peer *dst, B1Handle **dst_handles);
 
 B1Peer *b1_handle_get_peer(B1Handle *handle);
 
@@ -93,11 +274,41 @@ static inline void b1_peer_unrefp(B1Peer **peer) {
                 b1_peer_unref(*peer);
 }
 
+static inline void b1_peer_factory_freep(B1PeerFactory **factory) {
+        if (*factory)
+                b1_peer_factory_free(*factory);
+}
+
+static inline void b1_recv_pump_freep(B1RecvPump **pump) {
+        if (*pump)
+                b1_recv_pump_free(*pump);
+}
+
+static inline void b1_executor_freep(B1Executor **executor) {
+        if (*executor)
+                b1_executor_free(*executor);
+}
+
+static inline void b1_flow_freep(B1Flow **flow) {
+        if (*flow)
+                b1_flow_free(*flow);
+}
+
+static inline void b1_send_queue_freep(B1SendQueue **queue) {
+        if (*queue)
+                b1_send_queue_free(*queue);
+}
+
 static inline void b1_message_unrefp(B1Message **message) {
         if (*message)
                 b1_message_unref(*message);
 }
 
+static inline void b1_slice_unrefp(B1Slice **slice) {
+        if (*slice)
+                b1_slice_unref(*slice);
+}
+
 static inline void b1_node_freep(B1Node **node) {
         if (*node)
                 b1_node_free(*node);
@@ -108,6 +319,40 @@ static inline void b1_handle_unrefp(B1Handle **handle) {
                 b1_handle_unref(*handle);
 }
 
+/*
+ * Typed payload access: a payload whose layout is described by a C type can be
+ * sent as a single iovec, and be accessed in-place on the receiving side. Size
+ * and alignment are derived from the type, and the pointer type is verified at
+ * compile time.
+ */
+#define B1_MESSAGE_SET_PAYLOAD(_message, _data)                                 \
+        b1_message_set_payload((_message),                                      \
+                               &(struct iovec){                                 \
+                                        .iov_base = (void *)(_data),            \
+                                        .iov_len = sizeof(*(_data)),            \
+                               },                                               \
+                               1)
+
+#ifdef __cplusplus
+#define B1_MESSAGE_PEEK_PAYLOAD_CHECK(_type, _datap)                            \
+        ((void)static_cast<const _type **>(_datap))
+#else
+#define B1_MESSAGE_PEEK_PAYLOAD_CHECK(_type, _datap)                            \
+        ((void)sizeof(struct {                                                  \
+                _Static_assert(__builtin_types_compatible_p(__typeof__(_datap), const _type **), \
+                               "B1_MESSAGE_PEEK_PAYLOAD: pointer does not match type"); \
+                char _unused;                                                   \
+        }))
+#endif
+
+#define B1_MESSAGE_PEEK_PAYLOAD(_message, _offset, _type, _datap)               \
+        b1_message_peek_payload((_message),                                     \
+                                (_offset),                                      \
+                                sizeof(_type),                                  \
+                                __alignof__(_type),                             \
+                                (B1_MESSAGE_PEEK_PAYLOAD_CHECK(_type, _datap),  \
+                                 (const void **)(_datap)))
+
 #ifdef __cplusplus
 }
 #endif
@@ -9,39 +9,169 @@
 
 #include <assert.h>
 #include <c-macro.h>
+#include "capture.h"
 #include <c-rbtree.h>
 #include <errno.h>
 #include "message.h"
 #include "node.h"
 #include "peer.h"
+#include <alloca.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * All peers of the process are registered by their file descriptor, so that
+ * wrapping an fd which is already wrapped returns the existing peer, rather
+ * than mapping the pool and creating node and handle tables a second time.
+ */
+static pthread_mutex_t b1_peer_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static CRBTree b1_peer_registry;
+
+static int peers_compare(CRBTree *t, void *k, CRBNode *n) {
+        B1Peer *peer = c_container_of(n, B1Peer, rb_registry);
+        int fd = *(int*)k, peer_fd = bus1_peer_get_fd(peer->peer);
+
+        if (fd < peer_fd)
+                return -1;
+        else if (fd > peer_fd)
+                return 1;
+        else
+                return 0;
+}
+
+static bool b1_peer_ref_unless_zero(B1Peer *peer) {
+        unsigned long n;
+
+        n = atomic_load_explicit(&peer->ref, memory_order_relaxed);
+        do {
+                if (!n)
+                        return false;
+        } while (!atomic_compare_exchange_weak_explicit(&peer->ref, &n, n + 1,
+                                                        memory_order_relaxed,
+                                                        memory_order_relaxed));
+
+        return true;
+}
+
+/* must be called with the registry lock held */
+static B1Peer *b1_peer_registry_lookup(int fd) {
+        B1Peer *peer;
+        CRBNode *n;
+
+        n = c_rbtree_find_node(&b1_peer_registry, peers_compare, &fd);
+        if (!n)
+                return NULL;
+
+        /* the peer is about to be freed, but not yet unlinked */
+        peer = c_container_of(n, B1Peer, rb_registry);
+        assert(!(peer->flags & B1_PEER_FLAG_SINGLE_THREADED));
+        if (!b1_peer_ref_unless_zero(peer))
+                return NULL;
+
+        return peer;
+}
+
+/* must be called with the registry lock held */
+static void b1_peer_registry_link(B1Peer *peer) {
+        CRBNode **slot, *p;
+        int fd;
+
+        fd = bus1_peer_get_fd(peer->peer);
+
+        slot = c_rbtree_find_slot(&b1_peer_registry, peers_compare, &fd, &p);
+        if (!slot) {
+                /* replace a dying peer, see b1_peer_registry_lookup() */
+                assert(!atomic_load_explicit(&c_container_of(p, B1Peer, rb_registry)->ref, memory_order_relaxed));
+                c_rbnode_unlink(p);
+                slot = c_rbtree_find_slot(&b1_peer_registry, peers_compare, &fd, &p);
+                assert(slot);
+        }
+
+        c_rbtree_add(&b1_peer_registry, p, slot, &peer->rb_registry);
+        peer->registered = true;
+}
+
+static void b1_peer_init(B1Peer *peer, uint64_t flags) {
+        peer->ref = C_REF_INIT;
+        peer->flags = flags;
+        pthread_mutex_init(&peer->pool_lock, NULL);
+        peer->hidden_node_id = BUS1_HANDLE_INVALID;
+        c_rbnode_init(&peer->rb_registry);
+}
 
 /**
- * b1_peer_new() - creates a new disconnected peer
+ * b1_peer_new_with_flags() - creates a new disconnected peer
  * @peerp:              the new peer object
+ * @flags:              B1_PEER_FLAG_* flags
  *
- * Create a new peer disconnected from all existing peers.
+ * Create a new peer disconnected from all existing peers. The pool of the peer
+ * is mapped lazily on the first receive, so peers which only ever send never
+ * pay for the mapping.
+ *
+ * If B1_PEER_FLAG_SINGLE_THREADED is given, the peer and all nodes, handles
+ * and messages owned by it use non-atomic reference counting. The caller must
+ * then ensure that none of these objects are ever accessed from more than one
+ * thread at a time. Such a peer is not shared through b1_peer_new_from_fd(),
+ * so its fd must not be wrapped a second time.
+ *
+ * If B1_PEER_FLAG_DEFER_FDS is given, b1_peer_recv() does not install the file
+ * descriptors attached to messages, see b1_peer_recv_with_fds().
+ *
+ * If B1_PEER_FLAG_STATS is given, the peer publishes its counters in a shared
+ * memory page, to be read by monitoring tools like b1top. Updating the page
+ * costs no syscalls, every received message updates it once.
+ *
+ * If B1_PEER_FLAG_TIMESTAMPS is given, messages sent by the peer carry their
+ * send time in a trailer after the payload. Peers created with the same flag
+ * strip the trailer on receive, expose the time via b1_message_get_send_time()
+ * and record the delay into their latency histogram, see
+ * b1_peer_get_latency_stats(). Other receivers see the trailer as part of the
+ * payload, so the flag must be set on both ends.
+ *
+ * The remaining flags control how the pool is mapped, see b1_peer_map().
  *
  * Return: 0 on success, a negative error code on failure.
  */
-_c_public_ int b1_peer_new(B1Peer **peerp) {
+_c_public_ int b1_peer_new_with_flags(B1Peer **peerp, uint64_t flags) {
         _c_cleanup_(b1_peer_unrefp) B1Peer *peer = NULL;
         int r;
 
+        if (flags & ~(B1_PEER_FLAG_SINGLE_THREADED |
+                      B1_PEER_FLAG_POOL_POPULATE |
+                      B1_PEER_FLAG_POOL_HUGEPAGE |
+                      B1_PEER_FLAG_POOL_LOCAL |
+                      B1_PEER_FLAG_DEFER_FDS |
+                      B1_PEER_FLAG_STATS |
+                      B1_PEER_FLAG_TIMESTAMPS))
+                return -EINVAL;
+
         peer = calloc(1, sizeof(*peer));
         if (!peer)
                 return -ENOMEM;
 
-        peer->ref = C_REF_INIT;
+        b1_peer_init(peer, flags);
 
         r = bus1_peer_new_from_path(&peer->peer, NULL);
         if (r < 0)
                 return r;
 
-        r = bus1_peer_mmap(peer->peer);
-        if (r < 0)
-                return r;
+        if (flags & B1_PEER_FLAG_STATS) {
+                r = b1_stats_new(&peer->stats, bus1_peer_get_fd(peer->peer));
+                if (r < 0)
+                        return r;
+        }
+
+        if (!(flags & B1_PEER_FLAG_SINGLE_THREADED)) {
+                pthread_mutex_lock(&b1_peer_registry_lock);
+                b1_peer_registry_link(peer);
+                pthread_mutex_unlock(&b1_peer_registry_lock);
+        }
 
         *peerp = peer;
         peer = NULL;
@@ -50,32 +180,40 @@ _c_public_ int b1_peer_new(B1Peer **peerp) {
 }
 
 /**
- * b1_peer_new_from_fd() - create new peer object from existing fd
+ * b1_peer_new() - creates a new disconnected peer
  * @peerp:              the new peer object
- * @fd:                 a file descriptor representing an existing peer
  *
- * This takes a pre-initialized bus1 filedescriptor and creates a b1_peer object
- * around it.
+ * Create a new peer disconnected from all existing peers.
  *
  * Return: 0 on success, a negative error code on failure.
  */
-_c_public_ int b1_peer_new_from_fd(B1Peer **peerp, int fd) {
+_c_public_ int b1_peer_new(B1Peer **peerp) {
+        return b1_peer_new_with_flags(peerp, 0);
+}
+
+/* must be called with the registry lock held */
+static int b1_peer_new_from_fd_locked(B1Peer **peerp, int fd) {
         _c_cleanup_(b1_peer_unrefp) B1Peer *peer = NULL;
         int r;
 
+        peer = b1_peer_registry_lookup(fd);
+        if (peer) {
+                *peerp = peer;
+                peer = NULL;
+                return 0;
+        }
+
         peer = calloc(1, sizeof(*peer));
         if (!peer)
                 return -ENOMEM;
 
-        peer->ref = C_REF_INIT;
+        b1_peer_init(peer, 0);
 
         r = bus1_peer_new_from_fd(&peer->peer, fd);
         if (r < 0)
                 return r;
 
-        r = bus1_peer_mmap(peer->peer);
-        if (r < 0)
-                return r;
+        b1_peer_registry_link(peer);
 
         *peerp = peer;
         peer = NULL;
@@ -83,6 +221,31 @@ _c_public_ int b1_peer_new_from_fd(B1Peer **peerp, int fd) {
         return 0;
 }
 
+/**
+ * b1_peer_new_from_fd() - create new peer object from existing fd
+ * @peerp:              the new peer object
+ * @fd:                 a file descriptor representing an existing peer
+ *
+ * This takes a pre-initialized bus1 filedescriptor and creates a b1_peer object
+ * around it.
+ *
+ * If @fd is already wrapped by a peer object in this process, a new reference
+ * to that object is returned instead. All users of the same fd thus share the
+ * pool mapping, as well as the node and handle tables.
+ *
+ * Return: 0 on success, a negative error code on failure.
+ */
+_c_public_ int b1_peer_new_from_fd(B1Peer **peerp, int fd) {
+        int r;
+
+        /* look up and link in one go, so concurrent callers share one peer */
+        pthread_mutex_lock(&b1_peer_registry_lock);
+        r = b1_peer_new_from_fd_locked(peerp, fd);
+        pthread_mutex_unlock(&b1_peer_registry_lock);
+
+        return r;
+}
+
 /**
  * b1_peer_ref() - acquire reference
  * @peer:               peer to acquire reference to, or NULL
@@ -91,7 +254,7 @@ _c_public_ int b1_peer_new_from_fd(B1Peer **peerp, int fd) {
  */
 _c_public_ B1Peer *b1_peer_ref(B1Peer *peer) {
         if (peer)
-                c_ref_inc(&peer->ref);
+                b1_ref_inc(peer, &peer->ref);
 
         return peer;
 }
@@ -99,8 +262,21 @@ _c_public_ B1Peer *b1_peer_ref(B1Peer *peer) {
 static void b1_peer_free(_Atomic unsigned long *ref, void *userdata) {
         B1Peer *peer = userdata;
 
+        for (size_t i = 0; i < peer->n_reserved_nodes; i++)
+                b1_node_free_reserved(peer->reserved_nodes[i]);
+        free(peer->reserved_nodes);
+
         assert(!c_rbtree_first(&peer->handles));
         assert(!c_rbtree_first(&peer->nodes));
+
+        if (peer->registered) {
+                pthread_mutex_lock(&b1_peer_registry_lock);
+                c_rbnode_unlink(&peer->rb_registry);
+                pthread_mutex_unlock(&b1_peer_registry_lock);
+        }
+
+        b1_stats_free(peer->stats);
+        pthread_mutex_destroy(&peer->pool_lock);
         bus1_peer_free(peer->peer);
         free(peer);
 }
@@ -113,11 +289,401 @@ static void b1_peer_free(_Atomic unsigned long *ref, void *userdata) {
  */
 _c_public_ B1Peer *b1_peer_unref(B1Peer *peer) {
         if (peer)
-                c_ref_dec(&peer->ref, b1_peer_free, peer);
+                b1_ref_dec(peer, &peer->ref, b1_peer_free, peer);
 
         return NULL;
 }
 
+static void b1_peer_pool_lock(B1Peer *peer) {
+        if (!(peer->flags & B1_PEER_FLAG_SINGLE_THREADED))
+                pthread_mutex_lock(&peer->pool_lock);
+}
+
+static void b1_peer_pool_unlock(B1Peer *peer) {
+        if (!(peer->flags & B1_PEER_FLAG_SINGLE_THREADED))
+                pthread_mutex_unlock(&peer->pool_lock);
+}
+
+static uint64_t b1_peer_now_coarse(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+        return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+/*
+ * Outstanding slices are only counted, which is a pair of relaxed atomic
+ * operations on the receive and release paths. To report their ages and sizes,
+ * a subset of them is sampled: each slice claims one of a few slots its
+ * address hashes to, if one of them is free, and releases it again when it is
+ * untracked. The clock is only read when a slot is claimed.
+ */
+static B1PoolSample *b1_peer_sample_slice(B1Peer *peer, B1PoolEntry *entry, size_t n_bytes) {
+        uint64_t hash = ((uint64_t)(uintptr_t)entry * UINT64_C(0x9e3779b97f4a7c15)) >> 32;
+        B1PoolSample *sample;
+        uintptr_t expected;
+
+        for (size_t i = 0; i < B1_POOL_SAMPLE_PROBES; i++) {
+                sample = &peer->pool_samples[(hash + i) % B1_POOL_SAMPLES];
+                if (atomic_load_explicit(&sample->entry, memory_order_relaxed))
+                        continue;
+
+                expected = 0;
+                if (!atomic_compare_exchange_strong_explicit(&sample->entry, &expected, (uintptr_t)entry,
+                                                             memory_order_acquire, memory_order_relaxed))
+                        continue;
+
+                atomic_store_explicit(&sample->n_bytes, n_bytes, memory_order_relaxed);
+                atomic_store_explicit(&sample->timestamp, b1_peer_now_coarse(), memory_order_release);
+                return sample;
+        }
+
+        return NULL;
+}
+
+/* the stats page is updated along with the message, see b1_peer_recv_internal() */
+void b1_peer_track_slice(B1Peer *peer, B1PoolEntry *entry, size_t n_bytes) {
+        entry->n_bytes = n_bytes;
+        entry->sample = b1_peer_sample_slice(peer, entry, n_bytes);
+
+        atomic_fetch_add_explicit(&peer->n_pool_slices, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&peer->n_pool_bytes, n_bytes, memory_order_relaxed);
+}
+
+/*
+ * Release a received slice back to the kernel. Both, the ioctl and the new
+ * pool usage, are accounted in a single update of the stats page.
+ */
+void b1_peer_release_slice(B1Peer *peer, B1PoolEntry *entry, const void *slice) {
+        uintptr_t expected = (uintptr_t)entry;
+        size_t n_slices, n_pool;
+        int r;
+
+        /* readers ignore samples without timestamp, clear it before releasing */
+        if (entry->sample && atomic_load_explicit(&entry->sample->entry, memory_order_relaxed) == expected) {
+                atomic_store_explicit(&entry->sample->timestamp, 0, memory_order_relaxed);
+                atomic_compare_exchange_strong_explicit(&entry->sample->entry, &expected, 0,
+                                                        memory_order_release, memory_order_relaxed);
+        }
+
+        n_slices = atomic_fetch_sub_explicit(&peer->n_pool_slices, 1, memory_order_relaxed) - 1;
+        n_pool = atomic_fetch_sub_explicit(&peer->n_pool_bytes, entry->n_bytes, memory_order_relaxed) - entry->n_bytes;
+        b1_stats_count_release(peer->stats, n_slices, n_pool);
+
+        r = bus1_peer_slice_release(peer->peer, bus1_peer_slice_to_offset(peer->peer, slice));
+        assert(r >= 0);
+}
+
+void b1_peer_move_slice(B1Peer *peer, B1PoolEntry *from, B1PoolEntry *to) {
+        uintptr_t expected = (uintptr_t)from;
+
+        *to = *from;
+        if (to->sample &&
+            !atomic_compare_exchange_strong_explicit(&to->sample->entry, &expected, (uintptr_t)to,
+                                                     memory_order_relaxed, memory_order_relaxed))
+                to->sample = NULL;
+
+        from->sample = NULL;
+}
+
+static void b1_peer_untrack_all(B1Peer *peer) {
+        for (size_t i = 0; i < B1_POOL_SAMPLES; i++) {
+                atomic_store_explicit(&peer->pool_samples[i].timestamp, 0, memory_order_relaxed);
+                atomic_store_explicit(&peer->pool_samples[i].entry, 0, memory_order_release);
+        }
+
+        atomic_store_explicit(&peer->n_pool_slices, 0, memory_order_relaxed);
+        atomic_store_explicit(&peer->n_pool_bytes, 0, memory_order_relaxed);
+        b1_stats_set_pool(peer->stats, 0, 0);
+}
+
+/**
+ * b1_peer_get_pool_stats() - query pool statistics
+ * @peer:               the peer
+ * @stats:              the returned statistics
+ *
+ * This reports the size of the mapped pool, the number and total size of all
+ * slices held by received messages and detached payloads, the largest such
+ * slice, the age of the oldest one, and the total number of messages the
+ * kernel dropped for this peer.
+ *
+ * Keeping track of slices is cheap on the receive and release paths. The
+ * largest and the oldest slice are taken from a sample of up to
+ * B1_POOL_SAMPLES outstanding slices. It covers all of them as long as only a
+ * few are outstanding, and favors the older ones otherwise.
+ */
+_c_public_ void b1_peer_get_pool_stats(B1Peer *peer, B1PoolStats *stats) {
+        uint64_t now = b1_peer_now_coarse(), n_bytes, timestamp;
+        B1PoolSample *sample;
+        uintptr_t entry;
+
+        *stats = (B1PoolStats){
+                .n_slices = atomic_load_explicit(&peer->n_pool_slices, memory_order_relaxed),
+                .n_bytes = atomic_load_explicit(&peer->n_pool_bytes, memory_order_relaxed),
+                .n_dropped = atomic_load_explicit(&peer->n_dropped, memory_order_relaxed),
+        };
+
+        if (bus1_peer_get_pool(peer->peer))
+                stats->n_mapped = bus1_peer_get_pool_size(peer->peer);
+
+        for (size_t i = 0; i < B1_POOL_SAMPLES; i++) {
+                sample = &peer->pool_samples[i];
+
+                /* skip free samples, and those claimed or released meanwhile */
+                entry = atomic_load_explicit(&sample->entry, memory_order_relaxed);
+                timestamp = atomic_load_explicit(&sample->timestamp, memory_order_acquire);
+                n_bytes = atomic_load_explicit(&sample->n_bytes, memory_order_relaxed);
+                atomic_thread_fence(memory_order_acquire);
+                if (!entry || !timestamp || entry != atomic_load_explicit(&sample->entry, memory_order_relaxed))
+                        continue;
+
+                if (n_bytes > stats->n_slice_max)
+                        stats->n_slice_max = n_bytes;
+                if (now > timestamp && now - timestamp > stats->oldest_age_ns)
+                        stats->oldest_age_ns = now - timestamp;
+        }
+}
+
+static void b1_peer_record_latency(B1Peer *peer, uint64_t latency) {
+        uint64_t max;
+
+        atomic_fetch_add_explicit(&peer->latency[b1_stats_bucket(latency)], 1, memory_order_relaxed);
+
+        max = atomic_load_explicit(&peer->latency_max, memory_order_relaxed);
+        while (latency > max &&
+               !atomic_compare_exchange_weak_explicit(&peer->latency_max, &max, latency,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                ;
+}
+
+static uint64_t b1_peer_get_percentile(const uint64_t *latency, uint64_t n_samples, unsigned int percent) {
+        uint64_t target, sum = 0;
+
+        target = (n_samples * percent + 99) / 100;
+        for (unsigned int i = 0; i < B1_STATS_LATENCY_BUCKETS; i++) {
+                sum += latency[i];
+                if (sum >= target)
+                        return UINT64_C(2) << i;
+        }
+
+        return UINT64_C(2) << (B1_STATS_LATENCY_BUCKETS - 1);
+}
+
+/**
+ * b1_peer_get_latency_stats() - query message latency statistics
+ * @peer:               the peer
+ * @stats:              the returned statistics
+ *
+ * This reports the delay between sending and receiving all stamped messages
+ * received by a peer created with B1_PEER_FLAG_TIMESTAMPS, see
+ * b1_message_get_send_time(). The delay covers the time the message was
+ * queued, as well as its delivery.
+ *
+ * Delays are recorded in power-of-two buckets. The percentiles report the
+ * upper bound of the bucket they fall into, the maximum is exact.
+ */
+_c_public_ void b1_peer_get_latency_stats(B1Peer *peer, B1LatencyStats *stats) {
+        uint64_t latency[B1_STATS_LATENCY_BUCKETS];
+
+        *stats = (B1LatencyStats){
+                .max_ns = atomic_load_explicit(&peer->latency_max, memory_order_relaxed),
+        };
+
+        for (unsigned int i = 0; i < B1_STATS_LATENCY_BUCKETS; i++) {
+                latency[i] = atomic_load_explicit(&peer->latency[i], memory_order_relaxed);
+                stats->n_samples += latency[i];
+        }
+
+        if (!stats->n_samples)
+                return;
+
+        stats->p50_ns = b1_peer_get_percentile(latency, stats->n_samples, 50);
+        stats->p90_ns = b1_peer_get_percentile(latency, stats->n_samples, 90);
+        stats->p99_ns = b1_peer_get_percentile(latency, stats->n_samples, 99);
+}
+
+/**
+ * b1_peer_reset() - reset a peer
+ * @peer:               the peer to reset
+ * @flags:              B1_PEER_RESET_FLAG_* flags
+ *
+ * This resets the peer in the kernel with a single command: all its nodes are
+ * destroyed, all its handles are released and its queue is flushed. All node
+ * and handle objects of the peer are then invalidated in a single sweep over
+ * the node and handle tables, so dropping them afterwards does not issue any
+ * further commands. This makes tearing down a peer with a large number of
+ * objects cheap.
+ *
+ * Nodes created with B1_NODE_FLAG_PERSISTENT, and the handles other peers hold
+ * to them, survive the reset. If B1_PEER_RESET_FLAG_DISCONNECT is given, the
+ * peer is disconnected instead, and everything is invalidated.
+ *
+ * Handles to nodes of other peers are invalid after the reset, and must only
+ * be dropped. The same applies to messages received before the reset, as the
+ * kernel releases their slices. Neither they nor detached slices of the peer
+ * may be dropped concurrently with the reset.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_peer_reset(B1Peer *peer, uint64_t flags) {
+        bool disconnect = flags & B1_PEER_RESET_FLAG_DISCONNECT;
+        int r;
+
+        if (flags & ~B1_PEER_RESET_FLAG_DISCONNECT)
+                return -EINVAL;
+
+        b1_stats_count_ioctl(peer->stats, B1_STATS_IOCTL_PEER_RESET, 1);
+        r = bus1_peer_reset(peer->peer, disconnect ? BUS1_RESET_FLAG_DISCONNECT : 0);
+        if (r < 0)
+                return r;
+
+        ++peer->generation;
+        b1_peer_untrack_all(peer);
+
+        for (size_t i = 0; i < peer->n_reserved_nodes; i++)
+                b1_node_free_reserved(peer->reserved_nodes[i]);
+        peer->n_reserved_nodes = 0;
+
+        b1_nodes_reset(peer, disconnect);
+
+        return 0;
+}
+
+/**
+ * b1_peer_reserve_nodes() - fill the node reservoir of a peer
+ * @peer:               the peer
+ * @n_nodes:            number of nodes to keep in reserve
+ *
+ * This allocates nodes in the kernel until @n_nodes are held in reserve, so
+ * that the next @n_nodes calls to b1_node_new() return nodes which are already
+ * allocated and linked. The first send or transfer of their handles then does
+ * not need to allocate them on the critical path.
+ *
+ * The peer is not thread-safe, so the reservoir is not refilled implicitly.
+ * Call this from idle paths, for instance after a batch of messages has been
+ * dispatched. Passing 0 releases all reserved nodes.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_peer_reserve_nodes(B1Peer *peer, size_t n_nodes) {
+        B1Node **nodes;
+        int r;
+
+        if (n_nodes <= peer->n_reserved_nodes) {
+                while (peer->n_reserved_nodes > n_nodes) {
+                        B1Node *node = peer->reserved_nodes[--peer->n_reserved_nodes];
+
+                        b1_peer_ref(node->owner);
+                        b1_peer_ref(node->handle->holder);
+                        b1_node_free(node);
+                }
+
+                return 0;
+        }
+
+        nodes = realloc(peer->reserved_nodes, sizeof(*nodes) * n_nodes);
+        if (!nodes)
+                return -ENOMEM;
+        peer->reserved_nodes = nodes;
+
+        while (peer->n_reserved_nodes < n_nodes) {
+                r = b1_node_new_reserved(peer, &peer->reserved_nodes[peer->n_reserved_nodes]);
+                if (r < 0)
+                        return r;
+
+                ++peer->n_reserved_nodes;
+        }
+
+        return 0;
+}
+
+static void b1_peer_map_local(void *pool, size_t n_pool) {
+        unsigned int cpu, node;
+        unsigned long *mask;
+        size_t n_mask;
+
+        if (syscall(SYS_getcpu, &cpu, &node, NULL) < 0)
+                return;
+
+        n_mask = node / (sizeof(*mask) * 8) + 1;
+        mask = alloca(n_mask * sizeof(*mask));
+        memset(mask, 0, n_mask * sizeof(*mask));
+        mask[node / (sizeof(*mask) * 8)] = 1UL << (node % (sizeof(*mask) * 8));
+
+        (void)syscall(SYS_mbind, pool, n_pool, MPOL_PREFERRED, mask,
+                      n_mask * sizeof(*mask) * 8, 0);
+}
+
+static int b1_peer_map_locked(B1Peer *peer) {
+        void *pool;
+        size_t n_pool;
+        int r;
+
+        if (atomic_load_explicit(&peer->pool_ready, memory_order_relaxed))
+                return 0;
+
+        r = bus1_peer_mmap(peer->peer);
+        if (r < 0)
+                return r;
+
+        pool = (void *)bus1_peer_get_pool(peer->peer);
+        n_pool = bus1_peer_get_pool_size(peer->peer);
+
+        if (peer->flags & B1_PEER_FLAG_POOL_HUGEPAGE)
+                (void)madvise(pool, n_pool, MADV_HUGEPAGE);
+
+        if (peer->flags & B1_PEER_FLAG_POOL_LOCAL)
+                b1_peer_map_local(pool, n_pool);
+
+        /* populate last, so the pages are placed according to the hints */
+        if (peer->flags & B1_PEER_FLAG_POOL_POPULATE) {
+#ifdef MADV_POPULATE_READ
+                if (madvise(pool, n_pool, MADV_POPULATE_READ) < 0)
+#endif
+                        (void)madvise(pool, n_pool, MADV_WILLNEED);
+        }
+
+        atomic_store_explicit(&peer->pool_ready, true, memory_order_release);
+        return 0;
+}
+
+/**
+ * b1_peer_map() - map the pool of a peer
+ * @peer:               the peer
+ *
+ * This maps the pool, if it is not mapped already. This is called implicitly
+ * before anything is received from the pool.
+ *
+ * The mapping is tuned according to the flags of the peer. All of them are
+ * hints, failure to apply them is ignored:
+ *
+ *   B1_PEER_FLAG_POOL_HUGEPAGE: back the pool by transparent huge pages
+ *   B1_PEER_FLAG_POOL_LOCAL:    prefer the NUMA node of the calling thread
+ *   B1_PEER_FLAG_POOL_POPULATE: fault in the whole pool upfront, so receiving
+ *                               never takes a page fault on a fresh slice
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+int b1_peer_map(B1Peer *peer) {
+        int r;
+
+        /* fastpath: all hints have been applied by the first caller */
+        if (atomic_load_explicit(&peer->pool_ready, memory_order_acquire))
+                return 0;
+
+        /*
+         * The pool must not be used before the hints are applied, so racing
+         * callers wait for the first one, rather than using the mapping
+         * published by bus1_peer_mmap() right away.
+         */
+        b1_peer_pool_lock(peer);
+        r = b1_peer_map_locked(peer);
+        b1_peer_pool_unlock(peer);
+
+        return r;
+}
+
 /**
  * b1_peer_get_fd() - get file descriptor representing peer in the kernel
  * @peer:               the peer
@@ -129,46 +695,362 @@ _c_public_ int b1_peer_get_fd(B1Peer *peer) {
 }
 
 /*
+ * Hide node notifications for @node_id from the application. This is used for
+ * nodes the library creates for internal purposes. Notifications are dropped
+ * on dequeue, wherever they are in the queue. Only the most recent node is
+ * hidden.
+ */
+void b1_peer_hide_notifications(B1Peer *peer, uint64_t node_id) {
+        atomic_store_explicit(&peer->hidden_node_id, node_id, memory_order_relaxed);
+}
+
+/*
+ * Dequeue the next message. The ioctl returning it, or the error, is accounted
+ * by the caller, so it can be folded into its own update of the stats page.
+ */
+static int b1_peer_dequeue(B1Peer *peer, uint64_t flags, struct bus1_cmd_recv *recv) {
+        int r;
+
+        for (;;) {
+                *recv = (struct bus1_cmd_recv){
+                        .flags = flags,
+                };
+
+                r = bus1_peer_recv(peer->peer, recv);
+                if (r < 0)
+                        return r;
+
+                /*
+                 * Drops are accounted in the pool statistics. A message
+                 * dequeued along with the drop report is still delivered.
+                 */
+                if (recv->n_dropped) {
+                        atomic_fetch_add_explicit(&peer->n_dropped, recv->n_dropped, memory_order_relaxed);
+                        if (recv->msg.type == BUS1_MSG_NONE)
+                                return -ENOBUFS;
+                }
+
+                if (recv->msg.type != BUS1_MSG_DATA &&
+                    recv->msg.type != BUS1_MSG_NODE_DESTROY &&
+                    recv->msg.type != BUS1_MSG_NODE_RELEASE)
+                        return -EIO;
+
+                if (recv->msg.type == BUS1_MSG_DATA ||
+                    recv->msg.destination != atomic_load_explicit(&peer->hidden_node_id, memory_order_relaxed))
+                        return 0;
+
+                b1_stats_count_ioctl(peer->stats, B1_STATS_IOCTL_RECV, 1);
+
+                /* a peeked notification has to be dequeued before it is dropped */
+                if (flags & BUS1_RECV_FLAG_PEEK) {
+                        *recv = (struct bus1_cmd_recv){};
+
+                        b1_stats_count_ioctl(peer->stats, B1_STATS_IOCTL_RECV, 1);
+                        r = bus1_peer_recv(peer->peer, recv);
+                        if (r < 0)
+                                return r;
+                }
+
+                b1_stats_count_ioctl(peer->stats, B1_STATS_IOCTL_SLICE_RELEASE, 1);
+                (void)bus1_peer_slice_release(peer->peer, recv->msg.offset);
+        }
+}
+
+/*
+ * Check whether nothing is queued on @peer. Hidden notifications are dropped
+ * on the way, everything else stays queued.
+ */
+bool b1_peer_queue_is_empty(B1Peer *peer) {
+        struct bus1_cmd_recv recv;
+        int r;
+
+        r = b1_peer_dequeue(peer, BUS1_RECV_FLAG_PEEK, &recv);
+        b1_stats_count_ioctl(peer->stats, B1_STATS_IOCTL_RECV, 1);
+
+        return r == -EAGAIN;
+}
+
+static int b1_peer_recv_internal(B1Peer *peer, B1Message **messagep, bool install_fds) {
+        struct bus1_cmd_recv recv;
+        uint64_t latency = 0;
+        int r;
+
+        assert(peer);
+
+        r = b1_peer_map(peer);
+        if (r < 0)
+                return r;
+
+        r = b1_peer_dequeue(peer, install_fds ? BUS1_RECV_FLAG_INSTALL_FDS : 0, &recv);
+        if (r < 0) {
+                b1_stats_count_ioctl(peer->stats, B1_STATS_IOCTL_RECV, 1);
+                return r;
+        }
+
+        r = b1_message_new_from_slice(peer,
+                                      messagep,
+                                      bus1_peer_slice_from_offset(peer->peer, recv.msg.offset),
+                                      recv.msg.type,
+                                      recv.msg.destination,
+                                      recv.msg.uid,
+                                      recv.msg.gid,
+                                      recv.msg.pid,
+                                      recv.msg.tid,
+                                      recv.msg.n_bytes,
+                                      recv.msg.n_handles,
+                                      recv.msg.n_fds,
+                                      install_fds);
+        if (r < 0) {
+                b1_stats_count_ioctl(peer->stats, B1_STATS_IOCTL_RECV, 1);
+                return r;
+        }
+
+        /* stamped messages report their delay since sending */
+        if ((*messagep)->send_time) {
+                latency = b1_stats_now() - (*messagep)->send_time;
+
+                /* clocks of different cpus may be slightly off */
+                if ((int64_t)latency < 0)
+                        latency = 0;
+
+                b1_peer_record_latency(peer, latency);
+        }
+
+        if (peer->stats)
+                b1_stats_count_recv(peer->stats,
+                                    (*messagep)->vecs[0].iov_len,
+                                    (*messagep)->send_time,
+                                    latency,
+                                    atomic_load_explicit(&peer->n_pool_slices, memory_order_relaxed),
+                                    atomic_load_explicit(&peer->n_pool_bytes, memory_order_relaxed));
+
+        b1_capture_recv(*messagep);
+        return 0;
+}
+
+/**
  * b1_peer_recv() - receive one message
  * @peer:               the receiving peer
  * @messagep:           the received message
  *
  * Dequeues one message from the queue if available and returns it.
  *
+ * Attached file descriptors are installed into the process, unless the peer
+ * was created with B1_PEER_FLAG_DEFER_FDS. In that case, they are dropped by
+ * the kernel and never occupy the fd table.
+ *
  * Return: 0 on success, or a negative error code on failure.
  */
 _c_public_ int b1_peer_recv(B1Peer *peer, B1Message **messagep) {
-        struct bus1_cmd_recv recv = {};
+        return b1_peer_recv_internal(peer, messagep, !(peer->flags & B1_PEER_FLAG_DEFER_FDS));
+}
+
+/**
+ * b1_peer_recv_with_fds() - receive one message including its fds
+ * @peer:               the receiving peer
+ * @messagep:           the received message
+ *
+ * This is equivalent to b1_peer_recv(), but always installs the attached file
+ * descriptors, regardless of B1_PEER_FLAG_DEFER_FDS. Consumers on deferring
+ * peers use b1_peer_peek() to look at the number of attached fds, and pick
+ * this function for the messages whose fds they actually use.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_peer_recv_with_fds(B1Peer *peer, B1Message **messagep) {
+        return b1_peer_recv_internal(peer, messagep, true);
+}
+
+/**
+ * b1_peer_get_fd_stats() - query file descriptor statistics
+ * @peer:               the peer
+ * @n_installedp:       number of received fds installed into the process, or NULL
+ * @n_usedp:            number of installed fds queried by b1_message_get_fd(), or NULL
+ * @n_droppedp:         number of received fds never installed, or NULL
+ */
+_c_public_ void b1_peer_get_fd_stats(B1Peer *peer,
+                                     uint64_t *n_installedp,
+                                     uint64_t *n_usedp,
+                                     uint64_t *n_droppedp) {
+        if (n_installedp)
+                *n_installedp = atomic_load_explicit(&peer->n_fds_installed, memory_order_relaxed);
+        if (n_usedp)
+                *n_usedp = atomic_load_explicit(&peer->n_fds_used, memory_order_relaxed);
+        if (n_droppedp)
+                *n_droppedp = atomic_load_explicit(&peer->n_fds_dropped, memory_order_relaxed);
+}
+
+/**
+ * b1_peer_peek() - look at the next message without receiving it
+ * @peer:               the receiving peer
+ * @header:             header of the next message
+ *
+ * This fills @header with the metadata of the message at the front of the
+ * queue, but leaves the message queued. No handles are acquired, no file
+ * descriptors are installed and the payload is not touched. The caller then
+ * either receives the message with b1_peer_recv_peeked(), or drops it with
+ * b1_peer_discard().
+ *
+ * The destination node is only resolved for messages destined for a node of
+ * @peer, it is NULL for node destruction notifications destined for handles.
+ *
+ * Return: 0 on success, -EAGAIN if the queue is empty, or a negative error
+ *         code on failure.
+ */
+_c_public_ int b1_peer_peek(B1Peer *peer, B1MessageHeader *header) {
+        struct bus1_cmd_recv recv;
         int r;
 
         assert(peer);
+        assert(header);
 
-        r = bus1_peer_recv(peer->peer, &recv);
+        if (peer->flags & B1_PEER_FLAG_TIMESTAMPS) {
+                r = b1_peer_map(peer);
+                if (r < 0)
+                        return r;
+        }
+
+        r = b1_peer_dequeue(peer, BUS1_RECV_FLAG_PEEK, &recv);
+        b1_stats_count_ioctl(peer->stats, B1_STATS_IOCTL_RECV, 1);
         if (r < 0)
                 return r;
 
-        if (recv.n_dropped)
-                return -ENOBUFS;
+        /* report the payload size without the timestamp trailer */
+        if (recv.msg.type == BUS1_MSG_DATA && (peer->flags & B1_PEER_FLAG_TIMESTAMPS))
+                recv.msg.n_bytes -= b1_message_parse_trailer(bus1_peer_slice_from_offset(peer->peer, recv.msg.offset),
+                                                             recv.msg.n_bytes,
+                                                             &(uint64_t){ 0 });
 
-        if (recv.msg.type != BUS1_MSG_DATA &&
-            recv.msg.type != BUS1_MSG_NODE_DESTROY &&
-            recv.msg.type != BUS1_MSG_NODE_RELEASE)
-                return -EIO;
+        *header = (B1MessageHeader){
+                .type = recv.msg.type,
+                .destination_node = b1_node_lookup(peer, recv.msg.destination),
+                .uid = recv.msg.uid,
+                .gid = recv.msg.gid,
+                .pid = recv.msg.pid,
+                .tid = recv.msg.tid,
+                .n_bytes = recv.msg.n_bytes,
+                .n_handles = recv.msg.n_handles,
+                .n_fds = recv.msg.n_fds,
+        };
 
-        return b1_message_new_from_slice(peer,
-                                         messagep,
-                                         bus1_peer_slice_from_offset(peer->peer, recv.msg.offset),
-                                         recv.msg.type,
-                                         recv.msg.destination,
-                                         recv.msg.uid,
-                                         recv.msg.gid,
-                                         recv.msg.pid,
-                                         recv.msg.tid,
-                                         recv.msg.n_bytes,
-                                         recv.msg.n_handles,
-                                         recv.msg.n_fds);
+        return 0;
+}
 
-        return -EIO;
+/**
+ * b1_peer_recv_peeked() - receive the previously peeked message
+ * @peer:               the receiving peer
+ * @messagep:           the received message
+ *
+ * This dequeues and materializes the message last returned by
+ * b1_peer_peek(). As long as nobody else receives on @peer in between, it is
+ * guaranteed to be the same message.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_peer_recv_peeked(B1Peer *peer, B1Message **messagep) {
+        return b1_peer_recv(peer, messagep);
+}
+
+/*
+ * The message is dequeued already, so its slice and handle references must be
+ * released even if no command batch can be allocated. Do it one by one.
+ */
+static int b1_peer_discard_slow(B1Peer *peer, const uint64_t *handle_ids, size_t n_handles, uint64_t offset) {
+        int r, error = 0;
+
+        for (size_t i = 0; i < n_handles; i++) {
+                if (handle_ids[i] == BUS1_HANDLE_INVALID)
+                        continue;
+
+                b1_stats_count_ioctl(peer->stats, B1_STATS_IOCTL_HANDLE_RELEASE, 1);
+                r = bus1_peer_handle_release(peer->peer, handle_ids[i]);
+                if (r < 0)
+                        error = r;
+        }
+
+        b1_stats_count_ioctl(peer->stats, B1_STATS_IOCTL_SLICE_RELEASE, 1);
+        r = bus1_peer_slice_release(peer->peer, offset);
+        if (r < 0)
+                return r;
+
+        return error;
+}
+
+/**
+ * b1_peer_discard() - drop the next message
+ * @peer:               the receiving peer
+ *
+ * This dequeues the message at the front of the queue and drops it, without
+ * creating a message object for it. The handles it carries are released in
+ * the kernel directly, without being looked up or linked into the handle
+ * table, no file descriptors are installed, and its slice is released right
+ * away. All releases are submitted as one batch, or one by one if the batch
+ * cannot be allocated.
+ *
+ * Return: 0 on success, -EAGAIN if the queue is empty, or a negative error
+ *         code on failure.
+ */
+_c_public_ int b1_peer_discard(B1Peer *peer) {
+        struct bus1_cmd_recv recv;
+        struct bus1_peer_cmd buffer[16], *cmds = buffer;
+        const uint64_t *handle_ids;
+        uint64_t offset;
+        const void *slice;
+        B1Handle *handle;
+        size_t n_cmds = 0;
+        int r;
+
+        assert(peer);
+
+        r = b1_peer_map(peer);
+        if (r < 0)
+                return r;
+
+        r = b1_peer_dequeue(peer, 0, &recv);
+        b1_stats_count_ioctl(peer->stats, B1_STATS_IOCTL_RECV, 1);
+        if (r < 0)
+                return r;
+
+        if (recv.msg.type == BUS1_MSG_NODE_DESTROY) {
+                handle = b1_handle_lookup(peer, recv.msg.destination);
+                if (handle)
+                        b1_handle_flush_transfers(handle);
+        }
+
+        slice = bus1_peer_slice_from_offset(peer->peer, recv.msg.offset);
+        handle_ids = (const uint64_t *)((const uint8_t *)slice + c_align_to(recv.msg.n_bytes, 8));
+        offset = recv.msg.offset;
+
+        if (recv.msg.n_handles + 1 > C_ARRAY_SIZE(buffer)) {
+                cmds = malloc((recv.msg.n_handles + 1) * sizeof(*cmds));
+                if (!cmds)
+                        return b1_peer_discard_slow(peer, handle_ids, recv.msg.n_handles, offset);
+        }
+
+        /* each received handle id carries one kernel reference */
+        for (size_t i = 0; i < recv.msg.n_handles; i++) {
+                if (handle_ids[i] == BUS1_HANDLE_INVALID)
+                        continue;
+
+                cmds[n_cmds++] = (struct bus1_peer_cmd){
+                        .cmd = BUS1_CMD_HANDLE_RELEASE,
+                        .arg = (void *)&handle_ids[i],
+                };
+        }
+
+        /* the slice goes last, the handle ids above point into it */
+        cmds[n_cmds++] = (struct bus1_peer_cmd){
+                .cmd = BUS1_CMD_SLICE_RELEASE,
+                .arg = &offset,
+        };
+
+        b1_stats_count_ioctl(peer->stats, B1_STATS_IOCTL_HANDLE_RELEASE, n_cmds - 1);
+        b1_stats_count_ioctl(peer->stats, B1_STATS_IOCTL_SLICE_RELEASE, 1);
+        r = bus1_peer_submit(peer->peer, cmds, n_cmds);
+        if (cmds != buffer)
+                free(cmds);
+
+        return r;
 }
 
 /**
@@ -182,10 +1064,15 @@ _c_public_ int b1_peer_recv(B1Peer *peer, B1Message **messagep) {
  */
 _c_public_ int b1_peer_get_seed(B1Peer *peer, B1Message **seedp) {
         struct bus1_cmd_recv recv = {
-                .flags = BUS1_RECV_FLAG_SEED,
+                .flags = BUS1_RECV_FLAG_SEED | BUS1_RECV_FLAG_INSTALL_FDS,
         };
         int r;
 
+        r = b1_peer_map(peer);
+        if (r < 0)
+                return r;
+
+        b1_stats_count_ioctl(peer->stats, B1_STATS_IOCTL_RECV, 1);
         r = bus1_peer_recv(peer->peer, &recv);
         if (r < 0)
                 return r;
@@ -207,5 +1094,6 @@ _c_public_ int b1_peer_get_seed(B1Peer *peer, B1Message **seedp) {
                                          recv.msg.tid,
                                          recv.msg.n_bytes,
                                          recv.msg.n_handles,
-                                         recv.msg.n_fds);
+                                         recv.msg.n_fds,
+                                         true);
 }
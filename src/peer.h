@@ -7,17 +7,87 @@
  * any later version.
  */
 
+#include <assert.h>
+#include <pthread.h>
 #include <stdatomic.h>
 #include <c-rbtree.h>
 #include <c-ref.h>
 #include "bus1-peer.h"
 #include "org.bus1/b1-peer.h"
+#include "pool.h"
+#include "stats.h"
 
 struct B1Peer {
         _Atomic unsigned long ref;
+        uint64_t flags; /* B1_PEER_FLAG_* */
 
         struct bus1_peer *peer;
+        bool registered; /* linked into the global peer registry */
 
         CRBTree nodes;
         CRBTree handles;
+
+        _Atomic uint64_t n_fds_installed;
+        _Atomic uint64_t n_fds_used;
+        _Atomic uint64_t n_fds_dropped;
+
+        uint64_t generation; /* bumped by b1_peer_reset(), invalidates all slices */
+
+        pthread_mutex_t pool_lock; /* serializes mapping, not taken for single-threaded peers */
+        _Atomic bool pool_ready; /* pool mapped and tuned, see b1_peer_map() */
+        _Atomic size_t n_pool_slices;
+        _Atomic size_t n_pool_bytes;
+        B1PoolSample pool_samples[B1_POOL_SAMPLES]; /* subset of the outstanding slices */
+        _Atomic uint64_t n_dropped;
+        _Atomic uint64_t hidden_node_id; /* notifications are dropped, see b1_peer_hide_notifications() */
+
+        B1StatsPage *stats; /* NULL unless B1_PEER_FLAG_STATS is set */
+        _Atomic uint64_t latency[B1_STATS_LATENCY_BUCKETS]; /* send to receive delay of stamped messages */
+        _Atomic uint64_t latency_max;
+
+        B1Node **reserved_nodes; /* allocated in the kernel, not yet handed out */
+        size_t n_reserved_nodes;
+
+        CRBNode rb_registry;
 };
+
+int b1_peer_map(B1Peer *peer);
+void b1_peer_track_slice(B1Peer *peer, B1PoolEntry *entry, size_t n_bytes);
+void b1_peer_release_slice(B1Peer *peer, B1PoolEntry *entry, const void *slice);
+void b1_peer_move_slice(B1Peer *peer, B1PoolEntry *from, B1PoolEntry *to);
+void b1_peer_hide_notifications(B1Peer *peer, uint64_t node_id);
+bool b1_peer_queue_is_empty(B1Peer *peer);
+
+/*
+ * Objects owned by a peer follow its threading model: peers created with
+ * B1_PEER_FLAG_SINGLE_THREADED use plain loads and stores on all reference
+ * counts, instead of locked atomic operations.
+ */
+static inline void b1_ref_inc(B1Peer *peer, _Atomic unsigned long *ref) {
+        unsigned long n;
+
+        if (peer->flags & B1_PEER_FLAG_SINGLE_THREADED) {
+                n = atomic_load_explicit(ref, memory_order_relaxed);
+                assert(n > 0);
+                atomic_store_explicit(ref, n + 1, memory_order_relaxed);
+        } else {
+                c_ref_inc(ref);
+        }
+}
+
+static inline void b1_ref_dec(B1Peer *peer,
+                              _Atomic unsigned long *ref,
+                              void (*func)(_Atomic unsigned long *, void *),
+                              void *userdata) {
+        unsigned long n;
+
+        if (peer->flags & B1_PEER_FLAG_SINGLE_THREADED) {
+                n = atomic_load_explicit(ref, memory_order_relaxed);
+                assert(n > 0);
+                atomic_store_explicit(ref, n - 1, memory_order_relaxed);
+                if (n == 1)
+                        func(ref, userdata);
+        } else {
+                c_ref_dec(ref, func, userdata);
+        }
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#define B1_POOL_SAMPLES (64)
+#define B1_POOL_SAMPLE_PROBES (4)
+
+typedef struct B1PoolEntry B1PoolEntry;
+typedef struct B1PoolSample B1PoolSample;
+
+/*
+ * A sampled outstanding slice. Samples are claimed by slices on reception, if
+ * one of the slots they hash to is free, and copied when queried.
+ */
+struct B1PoolSample {
+        _Atomic uintptr_t entry; /* owning entry, 0 if free */
+        _Atomic uint64_t n_bytes;
+        _Atomic uint64_t timestamp;
+};
+
+/* an outstanding slice in the pool of a peer */
+struct B1PoolEntry {
+        size_t n_bytes;
+        B1PoolSample *sample; /* claimed sample, or NULL */
+};
@@ -0,0 +1,396 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <assert.h>
+#include <c-macro.h>
+#include <errno.h>
+#include <poll.h>
+#include "pump.h"
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define B1_RECV_PUMP_BATCH (64)
+
+static uint64_t b1_recv_pump_now(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static void b1_recv_pump_signal(int fd) {
+        uint64_t one = 1;
+
+        (void)write(fd, &one, sizeof(one));
+}
+
+static void b1_recv_pump_clear(int fd) {
+        uint64_t n;
+
+        (void)read(fd, &n, sizeof(n));
+}
+
+static void b1_recv_pump_update_max(_Atomic uint64_t *max, uint64_t value) {
+        uint64_t old;
+
+        old = atomic_load_explicit(max, memory_order_relaxed);
+        while (value > old &&
+               !atomic_compare_exchange_weak_explicit(max, &old, value,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                ;
+}
+
+static size_t b1_recv_pump_drain_releases(B1RecvPump *pump) {
+        void *message;
+        size_t n = 0;
+
+        while (b1_ring_pop(&pump->releases, &message, NULL)) {
+                b1_message_unref(message);
+                ++n;
+        }
+
+        return n;
+}
+
+static void b1_recv_pump_unstall(B1RecvPump *pump) {
+        /* pairs with the stall marker written by the pump thread */
+        atomic_thread_fence(memory_order_seq_cst);
+
+        if (atomic_load_explicit(&pump->stalled, memory_order_acquire) &&
+            atomic_exchange_explicit(&pump->stalled, false, memory_order_relaxed))
+                b1_recv_pump_signal(pump->fd_wake);
+}
+
+static bool b1_recv_pump_publish(B1RecvPump *pump, B1Message *message, size_t *n_outstandingp) {
+        /*
+         * Every message handed out eventually ends up in the release ring, so
+         * never have more messages outstanding than fit in there.
+         */
+        if (*n_outstandingp > pump->releases.mask)
+                return false;
+
+        if (!b1_ring_push(&pump->messages, message, b1_recv_pump_now()))
+                return false;
+
+        ++*n_outstandingp;
+        return true;
+}
+
+static void *b1_recv_pump_thread(void *userdata) {
+        B1RecvPump *pump = userdata;
+        B1Message *pending = NULL;
+        struct pollfd fds[] = {
+                { .fd = pump->fd_stop, .events = POLLIN },
+                { .fd = pump->fd_wake, .events = POLLIN },
+                { .fd = b1_peer_get_fd(pump->peer), .events = POLLIN },
+        };
+        size_t n_published, n_outstanding = 0;
+        cpu_set_t cpus;
+        int r;
+
+        if (pump->cpu >= 0) {
+                CPU_ZERO(&cpus);
+                CPU_SET(pump->cpu, &cpus);
+                (void)pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        }
+
+        for (;;) {
+                /*
+                 * While a message is pending, the ring is full. Do not poll
+                 * the peer, so the kernel queue builds up and pushes back on
+                 * the senders, and wait for workers to free up slots.
+                 */
+                fds[2].events = pending ? 0 : POLLIN;
+
+                r = poll(fds, C_ARRAY_SIZE(fds), -1);
+                if (r < 0 && errno != EINTR) {
+                        atomic_store_explicit(&pump->error, -errno, memory_order_release);
+                        break;
+                }
+
+                if (fds[0].revents & POLLIN)
+                        break;
+
+                if (fds[1].revents & POLLIN)
+                        b1_recv_pump_clear(pump->fd_wake);
+
+                n_outstanding -= b1_recv_pump_drain_releases(pump);
+
+                n_published = 0;
+
+                for (unsigned int i = 0; i < B1_RECV_PUMP_BATCH; i++) {
+                        if (!pending) {
+                                r = b1_peer_recv(pump->peer, &pending);
+                                if (r == -EAGAIN) {
+                                        break;
+                                } else if (r == -ENOBUFS) {
+                                        /* the kernel dropped messages, the queue is still fine */
+                                        atomic_fetch_add_explicit(&pump->n_drops, 1, memory_order_relaxed);
+                                        continue;
+                                } else if (r < 0) {
+                                        /* the peer is unusable, retrying would only spin */
+                                        atomic_store_explicit(&pump->error, r, memory_order_release);
+                                        break;
+                                }
+                        }
+
+                        if (!b1_recv_pump_publish(pump, pending, &n_outstanding)) {
+                                atomic_fetch_add_explicit(&pump->n_stalls, 1, memory_order_relaxed);
+                                atomic_store_explicit(&pump->stalled, true, memory_order_relaxed);
+                                atomic_thread_fence(memory_order_seq_cst);
+
+                                /* workers might have made progress before we marked the stall */
+                                n_outstanding -= b1_recv_pump_drain_releases(pump);
+                                if (!b1_recv_pump_publish(pump, pending, &n_outstanding))
+                                        break;
+
+                                atomic_store_explicit(&pump->stalled, false, memory_order_relaxed);
+                        }
+
+                        pending = NULL;
+                        ++n_published;
+                }
+
+                if (n_published) {
+                        atomic_fetch_add_explicit(&pump->n_published, n_published, memory_order_relaxed);
+                        b1_recv_pump_update_max(&pump->n_depth_max, b1_ring_get_depth(&pump->messages));
+                        b1_recv_pump_signal(pump->fd_ready);
+                }
+
+                if (atomic_load_explicit(&pump->error, memory_order_relaxed))
+                        break;
+        }
+
+        /* let workers see the error once they drained the ring */
+        if (atomic_load_explicit(&pump->error, memory_order_relaxed))
+                b1_recv_pump_signal(pump->fd_ready);
+
+        b1_message_unref(pending);
+
+        return NULL;
+}
+
+/**
+ * b1_recv_pump_new() - create a receive pump for a peer
+ * @pumpp:              the new pump object
+ * @peer:               the peer to receive on
+ * @n_messages:         capacity of the message ring
+ * @cpu:                CPU to pin the pump thread to, or -1
+ *
+ * A receive pump owns the receive side of a peer. A dedicated thread receives
+ * messages in batches and publishes them in a bounded lock-free ring, from
+ * which any number of worker threads consume them with b1_recv_pump_pop().
+ * If the ring is full, the pump stops receiving until workers catch up, so the
+ * backpressure propagates to the senders through the kernel queue.
+ *
+ * If the kernel drops messages, the pump counts this and carries on. Any other
+ * receive error stops the pump thread, and is reported to the workers by
+ * b1_recv_pump_pop() once all messages published before were consumed.
+ *
+ * The pump thread is the only thread which may operate on the peer for the
+ * lifetime of the pump. Workers may read the contents of popped messages, but
+ * must hand them back with b1_recv_pump_release() rather than dropping their
+ * reference themselves, and must not look up nodes or handles on the peer.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_recv_pump_new(B1RecvPump **pumpp, B1Peer *peer, size_t n_messages, int cpu) {
+        _c_cleanup_(b1_recv_pump_freep) B1RecvPump *pump = NULL;
+        int r;
+
+        assert(pumpp);
+        assert(peer);
+
+        if (!n_messages)
+                return -EINVAL;
+
+        pump = calloc(1, sizeof(*pump));
+        if (!pump)
+                return -ENOMEM;
+
+        pump->peer = b1_peer_ref(peer);
+        pump->cpu = cpu;
+        pump->fd_stop = -1;
+        pump->fd_wake = -1;
+        pump->fd_ready = -1;
+
+        r = b1_ring_init(&pump->messages, n_messages);
+        if (r < 0)
+                return r;
+
+        /* bounds the messages held by workers, see b1_recv_pump_publish() */
+        r = b1_ring_init(&pump->releases, n_messages * 2);
+        if (r < 0)
+                return r;
+
+        pump->fd_stop = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (pump->fd_stop < 0)
+                return -errno;
+
+        pump->fd_wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (pump->fd_wake < 0)
+                return -errno;
+
+        pump->fd_ready = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (pump->fd_ready < 0)
+                return -errno;
+
+        r = pthread_create(&pump->thread, NULL, b1_recv_pump_thread, pump);
+        if (r > 0)
+                return -r;
+
+        pump->running = true;
+
+        *pumpp = pump;
+        pump = NULL;
+        return 0;
+}
+
+/**
+ * b1_recv_pump_free() - stop and destroy a receive pump
+ * @pump:               pump to destroy, or NULL
+ *
+ * This stops the pump thread and drops all messages that were not consumed
+ * yet. All messages handed out to workers must have been released before.
+ *
+ * Return: NULL is returned.
+ */
+_c_public_ B1RecvPump *b1_recv_pump_free(B1RecvPump *pump) {
+        void *message;
+
+        if (!pump)
+                return NULL;
+
+        if (pump->running) {
+                b1_recv_pump_signal(pump->fd_stop);
+                pthread_join(pump->thread, NULL);
+        }
+
+        if (pump->messages.slots)
+                while (b1_ring_pop(&pump->messages, &message, NULL))
+                        b1_message_unref(message);
+
+        if (pump->releases.slots)
+                b1_recv_pump_drain_releases(pump);
+
+        b1_ring_deinit(&pump->releases);
+        b1_ring_deinit(&pump->messages);
+
+        if (pump->fd_ready >= 0)
+                close(pump->fd_ready);
+        if (pump->fd_wake >= 0)
+                close(pump->fd_wake);
+        if (pump->fd_stop >= 0)
+                close(pump->fd_stop);
+
+        b1_peer_unref(pump->peer);
+        free(pump);
+
+        return NULL;
+}
+
+/**
+ * b1_recv_pump_get_fd() - get file descriptor signalling new messages
+ * @pump:               the pump
+ *
+ * The returned eventfd becomes readable whenever the pump published new
+ * messages. Workers should read it to clear it, and then pop messages until
+ * b1_recv_pump_pop() returns -EAGAIN.
+ *
+ * Return: the file descriptor.
+ */
+_c_public_ int b1_recv_pump_get_fd(B1RecvPump *pump) {
+        return pump->fd_ready;
+}
+
+/**
+ * b1_recv_pump_pop() - consume one message
+ * @pump:               the pump
+ * @messagep:           the consumed message
+ *
+ * This can be called from any thread. The message must be handed back with
+ * b1_recv_pump_release() once it has been processed.
+ *
+ * Return: 0 on success, -EAGAIN if no message is available, or the negative
+ *         error code that stopped the pump thread.
+ */
+_c_public_ int b1_recv_pump_pop(B1RecvPump *pump, B1Message **messagep) {
+        uint64_t timestamp, latency;
+        void *message;
+        int r;
+
+        assert(messagep);
+
+        if (!b1_ring_pop(&pump->messages, &message, &timestamp)) {
+                r = atomic_load_explicit(&pump->error, memory_order_acquire);
+                return r < 0 ? r : -EAGAIN;
+        }
+
+        latency = b1_recv_pump_now() - timestamp;
+        atomic_fetch_add_explicit(&pump->n_consumed, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&pump->latency_sum, latency, memory_order_relaxed);
+        b1_recv_pump_update_max(&pump->latency_max, latency);
+        b1_recv_pump_unstall(pump);
+
+        *messagep = message;
+        return 0;
+}
+
+/**
+ * b1_recv_pump_release() - hand a consumed message back to the pump
+ * @pump:               the pump
+ * @message:            the message, or NULL
+ *
+ * This can be called from any thread. The reference to the message is dropped
+ * on the pump thread, which owns the peer.
+ *
+ * Return: NULL is returned.
+ */
+_c_public_ B1Message *b1_recv_pump_release(B1RecvPump *pump, B1Message *message) {
+        _c_unused_ bool pushed;
+
+        if (!message)
+                return NULL;
+
+        /* cannot fail, there are never more messages out than slots */
+        pushed = b1_ring_push(&pump->releases, message, 0);
+        assert(pushed);
+        b1_recv_pump_unstall(pump);
+
+        return NULL;
+}
+
+/**
+ * b1_recv_pump_get_stats() - query pump metrics
+ * @pump:               the pump
+ * @stats:              the returned metrics
+ *
+ * Latencies are measured from the moment a message is published in the ring,
+ * until it is popped by a worker. Drops count the receives on which the kernel
+ * reported dropped messages.
+ */
+_c_public_ void b1_recv_pump_get_stats(B1RecvPump *pump, B1RecvPumpStats *stats) {
+        uint64_t n_consumed;
+
+        n_consumed = atomic_load_explicit(&pump->n_consumed, memory_order_relaxed);
+
+        stats->n_published = atomic_load_explicit(&pump->n_published, memory_order_relaxed);
+        stats->n_consumed = n_consumed;
+        stats->n_stalls = atomic_load_explicit(&pump->n_stalls, memory_order_relaxed);
+        stats->n_drops = atomic_load_explicit(&pump->n_drops, memory_order_relaxed);
+        stats->n_depth = b1_ring_get_depth(&pump->messages);
+        stats->n_depth_max = atomic_load_explicit(&pump->n_depth_max, memory_order_relaxed);
+        stats->latency_avg_ns = n_consumed ? atomic_load_explicit(&pump->latency_sum, memory_order_relaxed) / n_consumed : 0;
+        stats->latency_max_ns = atomic_load_explicit(&pump->latency_max, memory_order_relaxed);
+}
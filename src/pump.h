@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include "org.bus1/b1-peer.h"
+#include "ring.h"
+
+struct B1RecvPump {
+        B1Peer *peer;
+        int cpu; /* CPU to pin the pump thread to, or -1 */
+
+        pthread_t thread;
+        bool running;
+        int fd_stop; /* eventfd to stop the pump thread */
+        int fd_wake; /* eventfd to wake the pump thread on released slots */
+        int fd_ready; /* eventfd signalled when messages are published */
+
+        B1Ring messages; /* received messages, pump to workers */
+        B1Ring releases; /* consumed messages, workers to pump */
+
+        _Atomic bool stalled;
+        _Atomic int error; /* receive error that stopped the pump thread */
+        _Atomic uint64_t n_published;
+        _Atomic uint64_t n_consumed;
+        _Atomic uint64_t n_stalls;
+        _Atomic uint64_t n_drops;
+        _Atomic uint64_t n_depth_max;
+        _Atomic uint64_t latency_sum;
+        _Atomic uint64_t latency_max;
+};
@@ -0,0 +1,443 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <assert.h>
+#include <c-macro.h>
+#include <errno.h>
+#include "queue.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define B1_SEND_QUEUE_BACKOFF_MIN_NS (UINT64_C(10000))
+#define B1_SEND_QUEUE_BACKOFF_MAX_NS (UINT64_C(10000000))
+#define B1_SEND_QUEUE_BACKOFF_STEPS (10) /* doublings from the minimum past the maximum */
+#define B1_SEND_QUEUE_BLOCKED_MIN (16)
+
+static uint64_t b1_send_queue_now(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static void b1_send_queue_update_max(_Atomic uint64_t *max, uint64_t value) {
+        uint64_t old;
+
+        old = atomic_load_explicit(max, memory_order_relaxed);
+        while (value > old &&
+               !atomic_compare_exchange_weak_explicit(max, &old, value,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                ;
+}
+
+static B1SendQueueEntry *b1_send_queue_entry_free(B1SendQueueEntry *entry) {
+        if (!entry)
+                return NULL;
+
+        for (size_t i = 0; i < entry->n_destinations; i++)
+                b1_handle_unref(entry->destinations[i]);
+
+        b1_message_unref(entry->message);
+        free(entry);
+
+        return NULL;
+}
+
+/*
+ * The destination is over its quota, or the pool of the receiver is full.
+ * Both clear up once the receiver consumes messages.
+ */
+static bool b1_send_queue_is_transient(int error) {
+        return error == -EAGAIN ||
+               error == -EDQUOT ||
+               error == -EXFULL ||
+               error == -ENOBUFS ||
+               error == -ENOMEM;
+}
+
+/**
+ * b1_send_queue_new() - create a send queue for a peer
+ * @queuep:             the new queue object
+ * @peer:               the peer to send from
+ * @fn:                 completion callback, or NULL
+ * @userdata:           userdata passed to @fn
+ *
+ * A send queue decouples producers from the kernel. Messages are pushed
+ * without blocking from any thread, and are submitted in batches by the event
+ * loop calling b1_send_queue_dispatch(). Sends failing because a destination
+ * is over quota are retried with exponential backoff, capped at 10ms, until
+ * they either succeed or fail for another reason, while sends to other
+ * destinations proceed. Messages to the same destination are always sent in
+ * the order they were pushed.
+ *
+ * Once a message was sent, or failed for good, @fn is called from
+ * b1_send_queue_dispatch() with the result of the send.
+ *
+ * If producers run on other threads than the event loop, @peer must not be
+ * single-threaded.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_send_queue_new(B1SendQueue **queuep, B1Peer *peer, B1SendQueueFn fn, void *userdata) {
+        _c_cleanup_(b1_send_queue_freep) B1SendQueue *queue = NULL;
+        int r;
+
+        assert(queuep);
+        assert(peer);
+
+        queue = calloc(1, sizeof(*queue));
+        if (!queue)
+                return -ENOMEM;
+
+        queue->peer = b1_peer_ref(peer);
+        queue->fn = fn;
+        queue->userdata = userdata;
+        queue->fd_epoll = -1;
+        queue->fd_wake = -1;
+        queue->fd_timer = -1;
+        queue->pending_tail = &queue->pending;
+
+        r = pthread_mutex_init(&queue->lock, NULL);
+        if (r > 0)
+                return -r;
+
+        /* only set once the lock is initialized */
+        queue->incoming_tail = &queue->incoming;
+
+        queue->fd_epoll = epoll_create1(EPOLL_CLOEXEC);
+        if (queue->fd_epoll < 0)
+                return -errno;
+
+        queue->fd_wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (queue->fd_wake < 0)
+                return -errno;
+
+        queue->fd_timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+        if (queue->fd_timer < 0)
+                return -errno;
+
+        r = epoll_ctl(queue->fd_epoll, EPOLL_CTL_ADD, queue->fd_wake,
+                      &(struct epoll_event){ .events = EPOLLIN });
+        if (r < 0)
+                return -errno;
+
+        r = epoll_ctl(queue->fd_epoll, EPOLL_CTL_ADD, queue->fd_timer,
+                      &(struct epoll_event){ .events = EPOLLIN });
+        if (r < 0)
+                return -errno;
+
+        *queuep = queue;
+        queue = NULL;
+        return 0;
+}
+
+/**
+ * b1_send_queue_free() - destroy a send queue
+ * @queue:              queue to destroy, or NULL
+ *
+ * Messages that were not sent yet are dropped, without calling the completion
+ * callback. No producer may push concurrently.
+ *
+ * Return: NULL is returned.
+ */
+_c_public_ B1SendQueue *b1_send_queue_free(B1SendQueue *queue) {
+        B1SendQueueEntry *entry;
+
+        if (!queue)
+                return NULL;
+
+        while ((entry = queue->pending)) {
+                queue->pending = entry->next;
+                b1_send_queue_entry_free(entry);
+        }
+
+        while ((entry = queue->incoming)) {
+                queue->incoming = entry->next;
+                b1_send_queue_entry_free(entry);
+        }
+
+        free(queue->blocked);
+
+        if (queue->fd_timer >= 0)
+                close(queue->fd_timer);
+        if (queue->fd_wake >= 0)
+                close(queue->fd_wake);
+        if (queue->fd_epoll >= 0)
+                close(queue->fd_epoll);
+
+        if (queue->incoming_tail)
+                pthread_mutex_destroy(&queue->lock);
+
+        b1_peer_unref(queue->peer);
+        free(queue);
+
+        return NULL;
+}
+
+/**
+ * b1_send_queue_get_fd() - get file descriptor signalling pending work
+ * @queue:              the queue
+ *
+ * The returned file descriptor becomes readable whenever messages were pushed,
+ * or a retry is due. The event loop should then call b1_send_queue_dispatch().
+ *
+ * Return: the file descriptor.
+ */
+_c_public_ int b1_send_queue_get_fd(B1SendQueue *queue) {
+        return queue->fd_epoll;
+}
+
+/**
+ * b1_send_queue_push() - queue a message for sending
+ * @queue:              the queue
+ * @message:            the message to send
+ * @destinations:       the destination handles
+ * @n_destinations:     the number of destinations
+ *
+ * This can be called from any thread, and never waits for the kernel or for
+ * the event loop. The queue takes a reference to @message, which must not be
+ * modified until its completion was reported.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_send_queue_push(B1SendQueue *queue,
+                                  B1Message *message,
+                                  B1Handle **destinations,
+                                  size_t n_destinations) {
+        B1SendQueueEntry *entry;
+        uint64_t one = 1;
+        bool wake;
+
+        assert(!n_destinations || destinations);
+
+        if (!message)
+                return -EINVAL;
+
+        entry = calloc(1, sizeof(*entry) + n_destinations * sizeof(*entry->destinations));
+        if (!entry)
+                return -ENOMEM;
+
+        entry->message = b1_message_ref(message);
+        entry->n_destinations = n_destinations;
+        for (size_t i = 0; i < n_destinations; i++)
+                entry->destinations[i] = b1_handle_ref(destinations[i]);
+
+        pthread_mutex_lock(&queue->lock);
+        wake = !queue->incoming;
+        *queue->incoming_tail = entry;
+        queue->incoming_tail = &entry->next;
+        pthread_mutex_unlock(&queue->lock);
+
+        b1_send_queue_update_max(&queue->n_depth_max,
+                                 atomic_fetch_add_explicit(&queue->n_depth, 1, memory_order_relaxed) + 1);
+
+        /* the loop was already woken up for an earlier entry it did not take yet */
+        if (wake)
+                (void)write(queue->fd_wake, &one, sizeof(one));
+
+        return 0;
+}
+
+static size_t b1_send_queue_bucket(B1Handle *handle, size_t n_buckets) {
+        return (((uint64_t)(uintptr_t)handle * UINT64_C(0x9e3779b97f4a7c15)) >> 32) & (n_buckets - 1);
+}
+
+static bool b1_send_queue_is_blocked(B1SendQueue *queue, B1SendQueueEntry *entry) {
+        size_t i;
+
+        if (!queue->n_blocked)
+                return false;
+
+        for (size_t j = 0; j < entry->n_destinations; j++)
+                for (i = b1_send_queue_bucket(entry->destinations[j], queue->n_blocked_max);
+                     queue->blocked[i];
+                     i = (i + 1) & (queue->n_blocked_max - 1))
+                        if (queue->blocked[i] == entry->destinations[j])
+                                return true;
+
+        return false;
+}
+
+static bool b1_send_queue_insert(B1Handle **blocked, size_t n_buckets, B1Handle *handle) {
+        size_t i;
+
+        for (i = b1_send_queue_bucket(handle, n_buckets); blocked[i]; i = (i + 1) & (n_buckets - 1))
+                if (blocked[i] == handle)
+                        return false;
+
+        blocked[i] = handle;
+        return true;
+}
+
+/* later entries to any of these destinations must wait for this one */
+static int b1_send_queue_block(B1SendQueue *queue, B1SendQueueEntry *entry) {
+        B1Handle **blocked;
+        size_t n;
+
+        /* keep the set at most half full */
+        if ((queue->n_blocked + entry->n_destinations) * 2 > queue->n_blocked_max) {
+                n = c_max(queue->n_blocked_max, (size_t)B1_SEND_QUEUE_BLOCKED_MIN);
+                while (n < (queue->n_blocked + entry->n_destinations) * 2)
+                        n *= 2;
+
+                blocked = calloc(n, sizeof(*blocked));
+                if (!blocked)
+                        return -ENOMEM;
+
+                for (size_t i = 0; i < queue->n_blocked_max; i++)
+                        if (queue->blocked[i])
+                                b1_send_queue_insert(blocked, n, queue->blocked[i]);
+
+                free(queue->blocked);
+                queue->blocked = blocked;
+                queue->n_blocked_max = n;
+        }
+
+        for (size_t i = 0; i < entry->n_destinations; i++)
+                if (b1_send_queue_insert(queue->blocked, queue->n_blocked_max, entry->destinations[i]))
+                        ++queue->n_blocked;
+
+        return 0;
+}
+
+static void b1_send_queue_unblock_all(B1SendQueue *queue) {
+        if (queue->n_blocked)
+                memset(queue->blocked, 0, queue->n_blocked_max * sizeof(*queue->blocked));
+
+        queue->n_blocked = 0;
+}
+
+static void b1_send_queue_complete(B1SendQueue *queue, B1SendQueueEntry *entry, int error) {
+        if (error < 0)
+                atomic_fetch_add_explicit(&queue->n_failed, 1, memory_order_relaxed);
+        else
+                atomic_fetch_add_explicit(&queue->n_sent, 1, memory_order_relaxed);
+
+        atomic_fetch_sub_explicit(&queue->n_depth, 1, memory_order_relaxed);
+
+        if (queue->fn)
+                queue->fn(entry->message, error, queue->userdata);
+
+        b1_send_queue_entry_free(entry);
+}
+
+static void b1_send_queue_arm(B1SendQueue *queue, uint64_t deadline) {
+        struct itimerspec its = {
+                .it_value = {
+                        .tv_sec = deadline / UINT64_C(1000000000),
+                        .tv_nsec = deadline % UINT64_C(1000000000),
+                },
+        };
+
+        /* a zero deadline disarms the timer */
+        (void)timerfd_settime(queue->fd_timer, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/**
+ * b1_send_queue_dispatch() - submit queued messages
+ * @queue:              the queue
+ *
+ * This takes all messages pushed so far in one batch, and submits those not
+ * held back by a pending retry. It must only be called from one thread at a
+ * time, usually the event loop owning the peer.
+ *
+ * Return: the number of messages still queued, or a negative error code on
+ *         failure.
+ */
+_c_public_ int b1_send_queue_dispatch(B1SendQueue *queue) {
+        B1SendQueueEntry *entry, **slot;
+        uint64_t n, now, backoff, deadline = 0;
+        size_t n_pending = 0;
+        int r;
+
+        (void)read(queue->fd_wake, &n, sizeof(n));
+        (void)read(queue->fd_timer, &n, sizeof(n));
+
+        pthread_mutex_lock(&queue->lock);
+        if (queue->incoming) {
+                *queue->pending_tail = queue->incoming;
+                queue->pending_tail = queue->incoming_tail;
+                queue->incoming = NULL;
+                queue->incoming_tail = &queue->incoming;
+        }
+        pthread_mutex_unlock(&queue->lock);
+
+        now = b1_send_queue_now();
+        b1_send_queue_unblock_all(queue);
+        slot = &queue->pending;
+
+        while ((entry = *slot)) {
+                if (b1_send_queue_is_blocked(queue, entry))
+                        goto keep;
+
+                if (entry->deadline > now)
+                        goto wait;
+
+                r = b1_message_send(entry->message, entry->destinations, entry->n_destinations);
+                if (r < 0 && b1_send_queue_is_transient(r)) {
+                        backoff = B1_SEND_QUEUE_BACKOFF_MIN_NS << entry->n_retries;
+                        entry->deadline = now + c_min(backoff, B1_SEND_QUEUE_BACKOFF_MAX_NS);
+                        if (entry->n_retries < B1_SEND_QUEUE_BACKOFF_STEPS)
+                                ++entry->n_retries;
+                        atomic_fetch_add_explicit(&queue->n_retries, 1, memory_order_relaxed);
+                        goto wait;
+                }
+
+                *slot = entry->next;
+                if (!*slot)
+                        queue->pending_tail = slot;
+
+                b1_send_queue_complete(queue, entry, r);
+                continue;
+
+wait:
+                if (!deadline || entry->deadline < deadline)
+                        deadline = entry->deadline;
+keep:
+                /*
+                 * Without the destinations blocked, later entries could
+                 * overtake this one. Leave them all queued, and try again
+                 * shortly.
+                 */
+                r = b1_send_queue_block(queue, entry);
+                if (r < 0) {
+                        b1_send_queue_arm(queue, now + B1_SEND_QUEUE_BACKOFF_MIN_NS);
+                        return r;
+                }
+
+                ++n_pending;
+                slot = &entry->next;
+        }
+
+        b1_send_queue_arm(queue, deadline);
+
+        return n_pending;
+}
+
+/**
+ * b1_send_queue_get_stats() - query queue metrics
+ * @queue:              the queue
+ * @stats:              the returned metrics
+ *
+ * This can be called from any thread.
+ */
+_c_public_ void b1_send_queue_get_stats(B1SendQueue *queue, B1SendQueueStats *stats) {
+        stats->n_sent = atomic_load_explicit(&queue->n_sent, memory_order_relaxed);
+        stats->n_failed = atomic_load_explicit(&queue->n_failed, memory_order_relaxed);
+        stats->n_retries = atomic_load_explicit(&queue->n_retries, memory_order_relaxed);
+        stats->n_depth = atomic_load_explicit(&queue->n_depth, memory_order_relaxed);
+        stats->n_depth_max = atomic_load_explicit(&queue->n_depth_max, memory_order_relaxed);
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include "org.bus1/b1-peer.h"
+
+typedef struct B1SendQueueEntry B1SendQueueEntry;
+
+struct B1SendQueueEntry {
+        B1SendQueueEntry *next;
+
+        B1Message *message;
+        unsigned int n_retries;
+        uint64_t deadline; /* CLOCK_MONOTONIC time of the next attempt */
+
+        size_t n_destinations;
+        B1Handle *destinations[]; /* entry owns a ref to each handle */
+};
+
+struct B1SendQueue {
+        B1Peer *peer;
+        B1SendQueueFn fn;
+        void *userdata;
+
+        int fd_epoll;
+        int fd_wake; /* eventfd signalled when entries are pushed */
+        int fd_timer; /* timerfd armed for the earliest retry */
+
+        pthread_mutex_t lock; /* protects the incoming list */
+        B1SendQueueEntry *incoming;
+        B1SendQueueEntry **incoming_tail;
+
+        /* owned by the dispatching thread */
+        B1SendQueueEntry *pending;
+        B1SendQueueEntry **pending_tail;
+        B1Handle **blocked; /* hash set of destinations with an entry held back */
+        size_t n_blocked;
+        size_t n_blocked_max; /* number of buckets, a power of two */
+
+        _Atomic uint64_t n_depth;
+        _Atomic uint64_t n_depth_max;
+        _Atomic uint64_t n_sent;
+        _Atomic uint64_t n_failed;
+        _Atomic uint64_t n_retries;
+};
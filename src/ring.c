@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <assert.h>
+#include <c-macro.h>
+#include <errno.h>
+#include <stdint.h>
+#include "ring.h"
+#include <stdlib.h>
+
+int b1_ring_init(B1Ring *ring, size_t n_slots) {
+        size_t n = 1;
+
+        assert(n_slots > 0);
+
+        while (n < n_slots)
+                n <<= 1;
+
+        ring->slots = calloc(n, sizeof(*ring->slots));
+        if (!ring->slots)
+                return -ENOMEM;
+
+        for (size_t i = 0; i < n; i++)
+                atomic_init(&ring->slots[i].sequence, i);
+
+        ring->mask = n - 1;
+        atomic_init(&ring->head, 0);
+        atomic_init(&ring->tail, 0);
+
+        return 0;
+}
+
+void b1_ring_deinit(B1Ring *ring) {
+        free(ring->slots);
+        ring->slots = NULL;
+}
+
+bool b1_ring_push(B1Ring *ring, void *data, uint64_t timestamp) {
+        B1RingSlot *slot;
+        size_t pos, sequence;
+        intptr_t diff;
+
+        pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+        for (;;) {
+                slot = &ring->slots[pos & ring->mask];
+                sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+                diff = (intptr_t)sequence - (intptr_t)pos;
+
+                if (diff == 0) {
+                        /* the slot is free, try to claim it */
+                        if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1,
+                                                                  memory_order_relaxed,
+                                                                  memory_order_relaxed))
+                                break;
+                } else if (diff < 0) {
+                        /* the slot still holds an entry from the last lap */
+                        return false;
+                } else {
+                        pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+                }
+        }
+
+        slot->data = data;
+        slot->timestamp = timestamp;
+        atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+
+        return true;
+}
+
+bool b1_ring_pop(B1Ring *ring, void **datap, uint64_t *timestampp) {
+        B1RingSlot *slot;
+        size_t pos, sequence;
+        intptr_t diff;
+
+        pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+        for (;;) {
+                slot = &ring->slots[pos & ring->mask];
+                sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+                diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+
+                if (diff == 0) {
+                        /* the slot is filled, try to claim it */
+                        if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1,
+                                                                  memory_order_relaxed,
+                                                                  memory_order_relaxed))
+                                break;
+                } else if (diff < 0) {
+                        /* the slot has not been filled yet */
+                        return false;
+                } else {
+                        pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+                }
+        }
+
+        *datap = slot->data;
+        if (timestampp)
+                *timestampp = slot->timestamp;
+        atomic_store_explicit(&slot->sequence, pos + ring->mask + 1, memory_order_release);
+
+        return true;
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+/*
+ * Bounded MPMC Ring
+ *
+ * A fixed-size, lock-free, multi-producer multi-consumer queue of pointers.
+ * Each slot carries a sequence number, which tells producers and consumers
+ * whether the slot is ready for them, so neither side ever takes a lock.
+ */
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+typedef struct B1Ring B1Ring;
+typedef struct B1RingSlot B1RingSlot;
+
+struct B1RingSlot {
+        _Atomic size_t sequence;
+        void *data;
+        uint64_t timestamp;
+};
+
+struct B1Ring {
+        B1RingSlot *slots;
+        size_t mask;
+
+        _Alignas(64) _Atomic size_t head; /* next slot to push to */
+        _Alignas(64) _Atomic size_t tail; /* next slot to pop from */
+};
+
+int b1_ring_init(B1Ring *ring, size_t n_slots);
+void b1_ring_deinit(B1Ring *ring);
+
+bool b1_ring_push(B1Ring *ring, void *data, uint64_t timestamp);
+bool b1_ring_pop(B1Ring *ring, void **datap, uint64_t *timestampp);
+
+static inline size_t b1_ring_get_depth(B1Ring *ring) {
+        size_t head, tail;
+
+        tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+        return head - tail;
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <assert.h>
+#include <c-macro.h>
+#include <c-ref.h>
+#include <errno.h>
+#include "peer.h"
+#include "slice.h"
+#include <stdlib.h>
+
+int b1_slice_new(B1Peer *peer, B1Slice **slicep, const void *data, size_t n_bytes, uint64_t generation) {
+        B1Slice *slice;
+
+        assert(peer);
+        assert(slicep);
+
+        slice = calloc(1, sizeof(*slice));
+        if (!slice)
+                return -ENOMEM;
+
+        slice->ref = C_REF_INIT;
+        slice->peer = b1_peer_ref(peer);
+        slice->data = data;
+        slice->n_bytes = n_bytes;
+        slice->generation = generation;
+
+        *slicep = slice;
+        return 0;
+}
+
+/**
+ * b1_slice_ref() - acquire reference
+ * @slice:              slice to acquire reference to, or NULL
+ *
+ * Slices use atomic reference counting regardless of the flags of their peer,
+ * so they may be passed between threads freely.
+ *
+ * Return: @slice is returned.
+ */
+_c_public_ B1Slice *b1_slice_ref(B1Slice *slice) {
+        if (slice)
+                c_ref_inc(&slice->ref);
+
+        return slice;
+}
+
+static void b1_slice_free(_Atomic unsigned long *ref, void *userdata) {
+        B1Slice *slice = userdata;
+
+        /* a reset of the peer released all slices already */
+        if (slice->generation == slice->peer->generation)
+                b1_peer_release_slice(slice->peer, &slice->pool_entry, slice->data);
+
+        b1_peer_unref(slice->peer);
+        free(slice);
+}
+
+/**
+ * b1_slice_unref() - release reference
+ * @slice:              slice to release reference to, or NULL
+ *
+ * Release a single reference to a slice. If this is the last reference, the
+ * slice is returned to the pool of its peer.
+ *
+ * Return: NULL is returned.
+ */
+_c_public_ B1Slice *b1_slice_unref(B1Slice *slice) {
+        if (slice)
+                c_ref_dec(&slice->ref, b1_slice_free, slice);
+
+        return NULL;
+}
+
+/**
+ * b1_slice_get_data() - get the data of a slice
+ * @slice:              the slice
+ * @n_bytesp:           pointer to the size of the data, or NULL
+ *
+ * The data is read-only and remains valid as long as a reference to the slice
+ * is held.
+ *
+ * Return: Pointer to the data.
+ */
+_c_public_ const void *b1_slice_get_data(B1Slice *slice, size_t *n_bytesp) {
+        if (n_bytesp)
+                *n_bytesp = slice->n_bytes;
+
+        return slice->data;
+}
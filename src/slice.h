@@ -0,0 +1,24 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <stdatomic.h>
+#include "org.bus1/b1-peer.h"
+#include "pool.h"
+
+struct B1Slice {
+        _Atomic unsigned long ref; /* always atomic, slices may cross threads */
+        B1Peer *peer;
+
+        const void *data;
+        size_t n_bytes;
+        uint64_t generation; /* peer generation the slice belongs to */
+        B1PoolEntry pool_entry;
+};
+
+int b1_slice_new(B1Peer *peer, B1Slice **slicep, const void *data, size_t n_bytes, uint64_t generation);
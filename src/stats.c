@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <c-macro.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "stats.h"
+
+static void b1_stats_get_path(char *path, size_t n_path, const char *prefix, pid_t pid, int fd) {
+        snprintf(path, n_path, B1_STATS_DIRECTORY "/%s" B1_STATS_PREFIX "%d-%d", prefix, (int)pid, fd);
+}
+
+/**
+ * b1_stats_new() - create the stats page of a peer
+ * @pagep:              the new page
+ * @fd:                 the fd of the peer
+ *
+ * The page is set up under a temporary name, which monitors do not list, and
+ * only renamed into place once it is complete. A stale page left behind by an
+ * earlier process with the same pid is replaced, but never truncated, so
+ * monitors still mapping it are not affected.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+int b1_stats_new(B1StatsPage **pagep, int fd) {
+        char path[sizeof(B1_STATS_DIRECTORY B1_STATS_PREFIX) + 32];
+        char path_tmp[sizeof(B1_STATS_DIRECTORY B1_STATS_PREFIX) + 32];
+        B1StatsPage *page;
+        int page_fd, r = 0;
+
+        b1_stats_get_path(path, sizeof(path), "", getpid(), fd);
+        b1_stats_get_path(path_tmp, sizeof(path_tmp), ".", getpid(), fd);
+
+        page_fd = open(path_tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW, 0644);
+        if (page_fd < 0)
+                return -errno;
+
+        if (ftruncate(page_fd, sizeof(*page)) < 0) {
+                r = -errno;
+                goto error;
+        }
+
+        page = mmap(NULL, sizeof(*page), PROT_READ | PROT_WRITE, MAP_SHARED, page_fd, 0);
+        if (page == MAP_FAILED) {
+                r = -errno;
+                goto error;
+        }
+
+        close(page_fd);
+
+        page->version = B1_STATS_VERSION;
+        page->pid = getpid();
+        page->fd = fd;
+
+        /* readers ignore the page until it is fully initialized */
+        atomic_thread_fence(memory_order_release);
+        page->magic = B1_STATS_MAGIC;
+
+        if (rename(path_tmp, path) < 0) {
+                r = -errno;
+                munmap(page, sizeof(*page));
+                unlink(path_tmp);
+                return r;
+        }
+
+        *pagep = page;
+        return 0;
+
+error:
+        close(page_fd);
+        unlink(path_tmp);
+        return r;
+}
+
+/**
+ * b1_stats_free() - remove the stats page of a peer
+ * @page:               the page to remove, or NULL
+ *
+ * Return: NULL is returned.
+ */
+B1StatsPage *b1_stats_free(B1StatsPage *page) {
+        char path[sizeof(B1_STATS_DIRECTORY B1_STATS_PREFIX) + 32];
+
+        if (!page)
+                return NULL;
+
+        b1_stats_get_path(path, sizeof(path), "", page->pid, page->fd);
+        unlink(path);
+        munmap(page, sizeof(*page));
+
+        return NULL;
+}
@@ -0,0 +1,227 @@
+#pragma once
+
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+/*
+ * Peer Stats Pages
+ *
+ * Peers created with B1_PEER_FLAG_STATS publish their counters in a file in
+ * /dev/shm, named after the process id and the peer fd, which other processes
+ * can map read-only. All updates are plain memory writes into the mapping.
+ *
+ * Updates are serialized by a seqlock: writers make the sequence number odd
+ * while they update the page, and even again once they are done. Readers
+ * copy the page, and retry if the sequence number was odd or changed in the
+ * meantime.
+ */
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define B1_STATS_MAGIC UINT64_C(0x0073746174733162) /* "b1stats" */
+#define B1_STATS_VERSION (1)
+#define B1_STATS_DIRECTORY "/dev/shm"
+#define B1_STATS_PREFIX "bus1-stats-"
+#define B1_STATS_LATENCY_BUCKETS (32)
+
+typedef struct B1StatsPage B1StatsPage;
+
+enum {
+        B1_STATS_IOCTL_PEER_RESET,
+        B1_STATS_IOCTL_HANDLE_RELEASE,
+        B1_STATS_IOCTL_HANDLE_TRANSFER,
+        B1_STATS_IOCTL_NODES_DESTROY,
+        B1_STATS_IOCTL_SLICE_RELEASE,
+        B1_STATS_IOCTL_SEND,
+        B1_STATS_IOCTL_RECV,
+        _B1_STATS_IOCTL_N,
+};
+
+struct B1StatsPage {
+        uint64_t magic;
+        uint32_t version;
+        int32_t pid;
+        int32_t fd; /* fd of the peer in process @pid */
+        uint32_t reserved;
+        _Atomic uint64_t seq; /* odd while an update is in progress */
+
+        uint64_t n_sent;
+        uint64_t n_sent_bytes;
+        uint64_t n_received;
+        uint64_t n_received_bytes;
+        uint64_t n_nodes;
+        uint64_t n_handles;
+        uint64_t n_pool_slices;
+        uint64_t n_pool_bytes;
+        uint64_t n_ioctls[_B1_STATS_IOCTL_N];
+        uint64_t latency[B1_STATS_LATENCY_BUCKETS]; /* send to recv delay of stamped messages, bucket i counts [2^i, 2^(i+1)) nsecs */
+};
+
+int b1_stats_new(B1StatsPage **pagep, int fd);
+B1StatsPage *b1_stats_free(B1StatsPage *page);
+
+static inline uint64_t b1_stats_now(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static inline unsigned int b1_stats_bucket(uint64_t latency) {
+        unsigned int bucket;
+
+        bucket = latency ? 63 - __builtin_clzll(latency) : 0;
+        return bucket < B1_STATS_LATENCY_BUCKETS ? bucket : B1_STATS_LATENCY_BUCKETS - 1;
+}
+
+static inline void b1_stats_begin(B1StatsPage *page) {
+        uint64_t seq;
+
+        /* writers of the same peer may run on multiple threads */
+        seq = atomic_load_explicit(&page->seq, memory_order_relaxed);
+        do {
+                while (seq & 1)
+                        seq = atomic_load_explicit(&page->seq, memory_order_relaxed);
+        } while (!atomic_compare_exchange_weak_explicit(&page->seq, &seq, seq + 1,
+                                                        memory_order_acquire,
+                                                        memory_order_relaxed));
+
+        /* readers must see the odd sequence number before any update */
+        atomic_thread_fence(memory_order_release);
+}
+
+static inline void b1_stats_end(B1StatsPage *page) {
+        atomic_fetch_add_explicit(&page->seq, 1, memory_order_release);
+}
+
+/*
+ * The helpers below accept a NULL page, so callers do not need to check
+ * whether the peer publishes its stats.
+ */
+
+static inline void b1_stats_count_ioctl(B1StatsPage *page, unsigned int ioctl, uint64_t n) {
+        if (!page)
+                return;
+
+        b1_stats_begin(page);
+        page->n_ioctls[ioctl] += n;
+        b1_stats_end(page);
+}
+
+static inline void b1_stats_count_send(B1StatsPage *page, uint64_t n_bytes) {
+        if (!page)
+                return;
+
+        b1_stats_begin(page);
+        ++page->n_sent;
+        page->n_sent_bytes += n_bytes;
+        b1_stats_end(page);
+}
+
+/*
+ * Account a received message: the ioctl, the message, its latency if it was
+ * stamped, and the pool usage including its slice, all in a single section.
+ */
+static inline void b1_stats_count_recv(B1StatsPage *page,
+                                       uint64_t n_bytes,
+                                       bool stamped,
+                                       uint64_t latency,
+                                       uint64_t n_pool_slices,
+                                       uint64_t n_pool_bytes) {
+        unsigned int bucket;
+
+        if (!page)
+                return;
+
+        bucket = b1_stats_bucket(latency);
+
+        b1_stats_begin(page);
+        ++page->n_ioctls[B1_STATS_IOCTL_RECV];
+        ++page->n_received;
+        page->n_received_bytes += n_bytes;
+        if (stamped)
+                ++page->latency[bucket];
+        page->n_pool_slices = n_pool_slices;
+        page->n_pool_bytes = n_pool_bytes;
+        b1_stats_end(page);
+}
+
+/* account a released slice, and the pool usage without it */
+static inline void b1_stats_count_release(B1StatsPage *page, uint64_t n_pool_slices, uint64_t n_pool_bytes) {
+        if (!page)
+                return;
+
+        b1_stats_begin(page);
+        ++page->n_ioctls[B1_STATS_IOCTL_SLICE_RELEASE];
+        page->n_pool_slices = n_pool_slices;
+        page->n_pool_bytes = n_pool_bytes;
+        b1_stats_end(page);
+}
+
+static inline void b1_stats_add_objects(B1StatsPage *page, int64_t n_nodes, int64_t n_handles) {
+        if (!page)
+                return;
+
+        b1_stats_begin(page);
+        page->n_nodes += n_nodes;
+        page->n_handles += n_handles;
+        b1_stats_end(page);
+}
+
+static inline void b1_stats_set_pool(B1StatsPage *page, uint64_t n_slices, uint64_t n_bytes) {
+        if (!page)
+                return;
+
+        b1_stats_begin(page);
+        page->n_pool_slices = n_slices;
+        page->n_pool_bytes = n_bytes;
+        b1_stats_end(page);
+}
+
+/* copy a consistent snapshot of a page that is concurrently updated */
+static inline void b1_stats_read(const B1StatsPage *page, B1StatsPage *snapshot) {
+        uint64_t seq;
+
+        for (;;) {
+                seq = atomic_load_explicit((_Atomic uint64_t *)&page->seq, memory_order_acquire);
+                if (seq & 1)
+                        continue;
+
+                *snapshot = (B1StatsPage){
+                        .magic = page->magic,
+                        .version = page->version,
+                        .pid = page->pid,
+                        .fd = page->fd,
+                        .n_sent = page->n_sent,
+                        .n_sent_bytes = page->n_sent_bytes,
+                        .n_received = page->n_received,
+                        .n_received_bytes = page->n_received_bytes,
+                        .n_nodes = page->n_nodes,
+                        .n_handles = page->n_handles,
+                        .n_pool_slices = page->n_pool_slices,
+                        .n_pool_bytes = page->n_pool_bytes,
+                };
+                for (unsigned int i = 0; i < _B1_STATS_IOCTL_N; i++)
+                        snapshot->n_ioctls[i] = page->n_ioctls[i];
+                for (unsigned int i = 0; i < B1_STATS_LATENCY_BUCKETS; i++)
+                        snapshot->latency[i] = page->latency[i];
+
+                atomic_thread_fence(memory_order_acquire);
+                if (seq == atomic_load_explicit((_Atomic uint64_t *)&page->seq, memory_order_relaxed))
+                        break;
+        }
+
+        snapshot->seq = seq;
+}
@@ -16,11 +16,20 @@
 #include <assert.h>
 #include <c-macro.h>
 #include <c-syscall.h>
+#include <c-variant.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <linux/bus1.h>
+#include <poll.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#include "capture.h"
+#include "stats.h"
 #include "org.bus1/b1-peer.h"
 
 static void test_peer(void) {
@@ -37,11 +46,116 @@ static void test_peer(void) {
 
         r = b1_peer_new_from_fd(&peer2, fd);
         assert(r >= 0);
-        assert(peer2);
+        assert(peer2 == peer1);
 
         r = b1_peer_new(&peer3);
         assert(r >= 0);
         assert(peer3);
+
+        peer3 = b1_peer_unref(peer3);
+
+        r = b1_peer_new_with_flags(&peer3, -1);
+        assert(r == -EINVAL);
+
+        r = b1_peer_new_with_flags(&peer3, B1_PEER_FLAG_SINGLE_THREADED);
+        assert(r >= 0);
+        assert(peer3);
+        assert(b1_peer_ref(peer3) == peer3);
+        b1_peer_unref(peer3);
+}
+
+static void test_single_threaded(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL, *payload_node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
+        B1Handle *payload_handle, *received;
+        B1Message *message;
+        uint64_t payload = 42;
+        const uint64_t *data;
+        int r;
+
+        r = b1_peer_new_with_flags(&src, B1_PEER_FLAG_SINGLE_THREADED);
+        assert(r >= 0);
+
+        r = b1_peer_new_with_flags(&dst, B1_PEER_FLAG_SINGLE_THREADED);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
+        assert(r >= 0);
+
+        r = b1_node_new(src, &payload_node);
+        assert(r >= 0);
+
+        payload_handle = b1_node_get_handle(payload_node);
+
+        /* messages and handles use the non-atomic reference counts */
+        for (unsigned int i = 0; i < 2; i++) {
+                r = b1_message_new(src, &message);
+                assert(r >= 0);
+                assert(b1_message_ref(message) == message);
+                b1_message_unref(message);
+
+                r = B1_MESSAGE_SET_PAYLOAD(message, &payload);
+                assert(r >= 0);
+
+                r = b1_message_set_handles(message, &payload_handle, 1);
+                assert(r >= 0);
+
+                r = b1_message_send(message, &handle, 1);
+                assert(r >= 0);
+
+                b1_message_unref(message);
+
+                r = b1_peer_recv(dst, &message);
+                assert(r >= 0);
+
+                r = B1_MESSAGE_PEEK_PAYLOAD(message, 0, uint64_t, &data);
+                assert(r >= 0);
+                assert(*data == payload);
+
+                r = b1_message_get_handle(message, 0, &received);
+                assert(r >= 0);
+                assert(b1_handle_get_peer(received) == dst);
+
+                received = b1_handle_ref(received);
+                b1_message_unref(message);
+                b1_handle_unref(received);
+        }
+
+        /* the handle was released, the node is destroyed without notification */
+        payload_node = b1_node_free(payload_node);
+
+        r = b1_peer_recv(dst, &message);
+        assert(r == -EAGAIN);
+}
+
+static void test_factory(void) {
+        _c_cleanup_(b1_peer_factory_freep) B1PeerFactory *factory = NULL;
+        _c_cleanup_(b1_peer_unrefp) B1Peer *peer1 = NULL, *peer2 = NULL;
+        int r;
+
+        r = b1_peer_factory_new(&factory, 0, 0, true);
+        assert(r == -EINVAL);
+
+        r = b1_peer_factory_new(&factory, 1, 0, true);
+        assert(r >= 0);
+        assert(factory);
+
+        /* the first peer comes from the stock, the second is created */
+        r = b1_peer_factory_take(factory, &peer1);
+        assert(r >= 0);
+        assert(peer1);
+
+        r = b1_peer_factory_take(factory, &peer2);
+        assert(r >= 0);
+        assert(peer2);
+        assert(peer2 != peer1);
+
+        r = b1_peer_factory_fill(factory);
+        assert(r >= 0);
 }
 
 static void test_node(void) {
@@ -67,6 +181,107 @@ static void test_node(void) {
         b1_handle_unref(handle);
 }
 
+static void test_node_reservoir(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        int r;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_peer_reserve_nodes(dst, 4);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
+        assert(b1_node_get_peer(node) == dst);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
+        assert(r >= 0);
+
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        r = b1_message_send(message, &handle, 1);
+        assert(r >= 0);
+
+        message = b1_message_unref(message);
+
+        r = b1_peer_recv(dst, &message);
+        assert(r >= 0);
+        assert(b1_message_get_destination_node(message) == node);
+
+        /* shrink the reservoir, the rest is released with the peer */
+        r = b1_peer_reserve_nodes(dst, 1);
+        assert(r >= 0);
+}
+
+static void test_reset(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *owner = NULL, *holder = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *persistent = NULL, *node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle1 = NULL, *handle2 = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        int r;
+
+        r = b1_peer_new(&owner);
+        assert(r >= 0);
+
+        r = b1_peer_new(&holder);
+        assert(r >= 0);
+
+        r = b1_node_new_with_flags(owner, &persistent, -1);
+        assert(r == -EINVAL);
+
+        r = b1_node_new_with_flags(owner, &persistent, B1_NODE_FLAG_PERSISTENT);
+        assert(r >= 0);
+
+        r = b1_node_new(owner, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(persistent), holder, &handle1);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), holder, &handle2);
+        assert(r >= 0);
+
+        r = b1_peer_reset(owner, 0);
+        assert(r >= 0);
+
+        /* the regular node is gone */
+        r = b1_peer_recv(holder, &message);
+        assert(r >= 0);
+        assert(b1_message_get_type(message) == BUS1_MSG_NODE_DESTROY);
+        assert(b1_message_get_destination_handle(message) == handle2);
+        message = b1_message_unref(message);
+
+        /* the persistent node is still reachable */
+        r = b1_message_new(holder, &message);
+        assert(r >= 0);
+
+        r = b1_message_send(message, &handle1, 1);
+        assert(r >= 0);
+
+        message = b1_message_unref(message);
+
+        r = b1_peer_recv(owner, &message);
+        assert(r >= 0);
+        assert(b1_message_get_type(message) == BUS1_MSG_DATA);
+        assert(b1_message_get_destination_node(message) == persistent);
+        message = b1_message_unref(message);
+
+        /* a disconnected peer drops everything */
+        r = b1_peer_reset(owner, B1_PEER_RESET_FLAG_DISCONNECT);
+        assert(r >= 0);
+
+        r = b1_node_destroy(persistent);
+        assert(r >= 0);
+}
+
 static void test_handle(void) {
         _c_cleanup_(b1_peer_unrefp) B1Peer *peer = NULL;
         _c_cleanup_(b1_node_freep) B1Node *node = NULL;
@@ -85,6 +300,120 @@ static void test_handle(void) {
         assert(handle == b1_node_get_handle(node));
 }
 
+static void test_handle_cache(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        B1Handle *handle1, *handle2;
+        B1Message *message;
+        int r;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_node_new(src, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), dst, &handle1);
+        assert(r >= 0);
+
+        /* repeated transfers reuse the destination handle */
+        r = b1_handle_transfer(b1_node_get_handle(node), dst, &handle2);
+        assert(r >= 0);
+        assert(handle2 == handle1);
+
+        handle2 = b1_handle_unref(handle2);
+
+        r = b1_node_destroy(node);
+        assert(r >= 0);
+
+        r = b1_peer_recv(dst, &message);
+        assert(r >= 0);
+        assert(b1_message_get_type(message) == BUS1_MSG_NODE_DESTROY);
+        assert(b1_message_get_destination_handle(message) == handle1);
+        b1_message_unref(message);
+
+        b1_handle_unref(handle1);
+}
+
+static void test_handles(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL, *fresh = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        B1Node *nodes[32] = {}, *node;
+        B1Handle *src_handles[32], *dst_handles[32], *handle;
+        int r;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        for (unsigned int i = 0; i < C_ARRAY_SIZE(nodes); i++) {
+                r = b1_node_new(src, &nodes[i]);
+                assert(r >= 0);
+
+                src_handles[i] = b1_node_get_handle(nodes[i]);
+        }
+
+        r = b1_handles_transfer(src_handles, C_ARRAY_SIZE(src_handles), dst, dst_handles);
+        assert(r >= 0);
+
+        for (unsigned int i = 0; i < C_ARRAY_SIZE(dst_handles); i++) {
+                assert(dst_handles[i]);
+                assert(b1_handle_get_peer(dst_handles[i]) == dst);
+
+                r = b1_handle_transfer(src_handles[i], dst, &handle);
+                assert(r >= 0);
+                assert(handle == dst_handles[i]);
+                b1_handle_unref(handle);
+        }
+
+        /* the internal bootstrap node left no trace */
+        r = b1_peer_recv(dst, &message);
+        assert(r == -EAGAIN);
+
+        for (unsigned int i = 0; i < C_ARRAY_SIZE(dst_handles); i++)
+                dst_handles[i] = b1_handle_unref(dst_handles[i]);
+
+        /* notifications of a node that is gone are still queued */
+        r = b1_peer_new(&fresh);
+        assert(r >= 0);
+
+        r = b1_node_new(fresh, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
+        assert(r >= 0);
+
+        b1_handle_unref(handle);
+        node = b1_node_free(node);
+
+        r = b1_handles_transfer(src_handles, C_ARRAY_SIZE(src_handles), fresh, dst_handles);
+        assert(r >= 0);
+
+        /* they must reach the application, and nothing else must */
+        r = b1_peer_recv(fresh, &message);
+        assert(r >= 0);
+        assert(b1_message_get_type(message) == BUS1_MSG_NODE_RELEASE);
+        message = b1_message_unref(message);
+
+        r = b1_peer_recv(fresh, &message);
+        assert(r >= 0);
+        assert(b1_message_get_type(message) == BUS1_MSG_NODE_DESTROY);
+        message = b1_message_unref(message);
+
+        r = b1_peer_recv(fresh, &message);
+        assert(r == -EAGAIN);
+
+        for (unsigned int i = 0; i < C_ARRAY_SIZE(nodes); i++) {
+                b1_handle_unref(dst_handles[i]);
+                b1_node_free(nodes[i]);
+        }
+}
+
 static void test_message(void) {
         _c_cleanup_(b1_peer_unrefp) B1Peer *peer = NULL;
         _c_cleanup_(b1_node_freep) B1Node *node = NULL;
@@ -238,70 +567,240 @@ static void test_transaction(void) {
         assert(r == -EAGAIN);
 }
 
-static void test_multicast(void) {
-        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst1 = NULL, *dst2 = NULL;
-        _c_cleanup_(b1_node_freep) B1Node *node1 = NULL, *node2 = NULL;
-        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
-        const char *payload = "WOOF";
-        struct iovec vec = {
-                .iov_base = (void*)payload,
-                .iov_len = strlen(payload) + 1,
-        };
-        struct iovec *vec_out;
-        size_t n_vec;
-        B1Handle *handles[2], *handle;
-        int r, fd;
+static void test_duplicates(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
+        B1Node *nodes[64] = {};
+        B1Handle *handles[64];
+        B1Message *message;
+        size_t sizes[] = { 2, 64 };
+        int r;
 
         r = b1_peer_new(&src);
         assert(r >= 0);
 
-        r = b1_peer_new(&dst1);
+        r = b1_peer_new(&dst);
         assert(r >= 0);
 
-        r = b1_peer_new(&dst2);
+        r = b1_node_new(dst, &node);
         assert(r >= 0);
 
-        r = b1_node_new(dst1, &node1);
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
         assert(r >= 0);
 
-        r = b1_node_new(dst2, &node2);
-        assert(r >= 0);
+        for (size_t i = 0; i < C_ARRAY_SIZE(nodes); i++) {
+                r = b1_node_new(src, &nodes[i]);
+                assert(r >= 0);
 
-        r = b1_handle_transfer(b1_node_get_handle(node1), src, &handles[0]);
+                handles[i] = b1_node_get_handle(nodes[i]);
+        }
+
+        /* both the pairwise and the sorted check, with the duplicate last */
+        for (size_t i = 0; i < C_ARRAY_SIZE(sizes); i++) {
+                r = b1_message_new(src, &message);
+                assert(r >= 0);
+
+                r = b1_message_set_handles(message, handles, sizes[i]);
+                assert(r >= 0);
+
+                r = b1_message_send(message, &handle, 1);
+                assert(r >= 0);
+
+                handles[sizes[i] - 1] = handles[0];
+
+                r = b1_message_set_handles(message, handles, sizes[i]);
+                assert(r >= 0);
+
+                r = b1_message_send(message, &handle, 1);
+                assert(r == -ENOTUNIQ);
+
+                handles[sizes[i] - 1] = b1_node_get_handle(nodes[sizes[i] - 1]);
+                b1_message_unref(message);
+        }
+
+        r = b1_peer_recv(dst, &message);
         assert(r >= 0);
+        b1_message_unref(message);
 
-        r = b1_handle_transfer(b1_node_get_handle(node2), src, &handles[1]);
+        r = b1_peer_recv(dst, &message);
         assert(r >= 0);
+        b1_message_unref(message);
 
-        r = b1_message_new(src, &message);
+        r = b1_peer_recv(dst, &message);
+        assert(r == -EAGAIN);
+
+        for (size_t i = 0; i < C_ARRAY_SIZE(nodes); i++)
+                b1_node_free(nodes[i]);
+}
+
+static void test_messages(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *other = NULL, *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL, *new_node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL, *other_handle = NULL;
+        B1Message *messages[6] = {}, *message;
+        B1Handle **destinations[6], *new_handle, *received[2];
+        size_t n_destinations[6], n_sent;
+        static const uint64_t expected[] = { 0, 1, 2, 5 };
+        uint64_t payloads[6];
+        int errors[6], r;
+
+        r = b1_peer_new(&src);
         assert(r >= 0);
 
-        r = b1_message_set_payload(message, &vec, 1);
+        r = b1_peer_new(&other);
         assert(r >= 0);
 
-        r = b1_message_set_handles(message, handles, 2);
+        r = b1_peer_new(&dst);
         assert(r >= 0);
 
-        fd = eventfd(0, 0);
-        assert(fd >= 0);
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
 
-        r = b1_message_set_fds(message, &fd, 1);
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
         assert(r >= 0);
 
-        assert(close(fd) >= 0);
+        r = b1_handle_transfer(b1_node_get_handle(node), other, &other_handle);
+        assert(r >= 0);
 
-        r = b1_message_send(message, handles, 2);
+        r = b1_node_new(src, &new_node);
         assert(r >= 0);
 
-        message = b1_message_unref(message);
-        assert(!message);
-        handles[0] = b1_handle_unref(handles[0]);
-        assert(!handles[0]);
-        handles[1] = b1_handle_unref(handles[1]);
-        assert(!handles[1]);
+        new_handle = b1_node_get_handle(new_node);
 
-        r = b1_peer_recv(dst1, &message);
-        assert(r >= 0);
+        for (size_t i = 0; i < C_ARRAY_SIZE(messages); i++) {
+                /* the second message is sent by another peer, the fourth is left out */
+                if (i == 3)
+                        continue;
+
+                r = b1_message_new(i == 1 ? other : src, &messages[i]);
+                assert(r >= 0);
+
+                payloads[i] = i;
+                r = B1_MESSAGE_SET_PAYLOAD(messages[i], &payloads[i]);
+                assert(r >= 0);
+
+                destinations[i] = i == 1 ? &other_handle : &handle;
+                n_destinations[i] = 1;
+        }
+        destinations[3] = &handle;
+        n_destinations[3] = 1;
+
+        /*
+         * The third message allocates a node, the fifth carries it twice, the
+         * last one carries it again and must use the id of the node.
+         */
+        r = b1_message_set_handles(messages[2], &new_handle, 1);
+        assert(r >= 0);
+        r = b1_message_set_handles(messages[4], (B1Handle *[]){ new_handle, new_handle }, 2);
+        assert(r >= 0);
+        r = b1_message_set_handles(messages[5], &new_handle, 1);
+        assert(r >= 0);
+
+        n_sent = b1_messages_send(messages, destinations, n_destinations, C_ARRAY_SIZE(messages), errors);
+        assert(n_sent == 4);
+        assert(errors[0] == 0);
+        assert(errors[1] == 0);
+        assert(errors[2] == 0);
+        assert(errors[3] == -EINVAL);
+        assert(errors[4] == -ENOTUNIQ);
+        assert(errors[5] == 0);
+
+        for (size_t i = 0; i < C_ARRAY_SIZE(expected); i++) {
+                const uint64_t *data;
+
+                r = b1_peer_recv(dst, &message);
+                assert(r >= 0);
+
+                r = B1_MESSAGE_PEEK_PAYLOAD(message, 0, uint64_t, &data);
+                assert(r >= 0);
+                assert(*data == expected[i]);
+
+                if (i >= 2) {
+                        r = b1_message_get_handle(message, 0, &received[i - 2]);
+                        assert(r >= 0);
+                        b1_handle_ref(received[i - 2]);
+                }
+
+                b1_message_unref(message);
+        }
+
+        /* both messages carry the same node */
+        assert(received[0] == received[1]);
+        b1_handle_unref(received[0]);
+        b1_handle_unref(received[1]);
+
+        r = b1_peer_recv(dst, &message);
+        assert(r == -EAGAIN);
+
+        for (size_t i = 0; i < C_ARRAY_SIZE(messages); i++)
+                b1_message_unref(messages[i]);
+}
+
+static void test_multicast(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst1 = NULL, *dst2 = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node1 = NULL, *node2 = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        const char *payload = "WOOF";
+        struct iovec vec = {
+                .iov_base = (void*)payload,
+                .iov_len = strlen(payload) + 1,
+        };
+        struct iovec *vec_out;
+        size_t n_vec;
+        B1Handle *handles[2], *handle;
+        int r, fd;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst1);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst2);
+        assert(r >= 0);
+
+        r = b1_node_new(dst1, &node1);
+        assert(r >= 0);
+
+        r = b1_node_new(dst2, &node2);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node1), src, &handles[0]);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node2), src, &handles[1]);
+        assert(r >= 0);
+
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        r = b1_message_set_payload(message, &vec, 1);
+        assert(r >= 0);
+
+        r = b1_message_set_handles(message, handles, 2);
+        assert(r >= 0);
+
+        fd = eventfd(0, 0);
+        assert(fd >= 0);
+
+        r = b1_message_set_fds(message, &fd, 1);
+        assert(r >= 0);
+
+        assert(close(fd) >= 0);
+
+        r = b1_message_send(message, handles, 2);
+        assert(r >= 0);
+
+        message = b1_message_unref(message);
+        assert(!message);
+        handles[0] = b1_handle_unref(handles[0]);
+        assert(!handles[0]);
+        handles[1] = b1_handle_unref(handles[1]);
+        assert(!handles[1]);
+
+        r = b1_peer_recv(dst1, &message);
+        assert(r >= 0);
         assert(message);
         assert(b1_message_get_type(message) == BUS1_MSG_DATA);
         assert(b1_message_get_destination_node(message) == node1);
@@ -413,16 +912,1267 @@ static void test_multicast(void) {
         assert(r == -EAGAIN);
 }
 
+static void test_peek(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL, *node2 = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        B1MessageHeader header;
+        B1Handle *payload_handle;
+        uint64_t payload = 7;
+        int r;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
+
+        r = b1_node_new(src, &node2);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
+        assert(r >= 0);
+
+        r = b1_peer_peek(dst, &header);
+        assert(r == -EAGAIN);
+
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        r = B1_MESSAGE_SET_PAYLOAD(message, &payload);
+        assert(r >= 0);
+
+        payload_handle = b1_node_get_handle(node2);
+        r = b1_message_set_handles(message, &payload_handle, 1);
+        assert(r >= 0);
+
+        for (unsigned int i = 0; i < 2; i++) {
+                r = b1_message_send(message, &handle, 1);
+                assert(r >= 0);
+        }
+
+        message = b1_message_unref(message);
+
+        /* peeking is idempotent */
+        for (unsigned int i = 0; i < 2; i++) {
+                r = b1_peer_peek(dst, &header);
+                assert(r >= 0);
+                assert(header.type == BUS1_MSG_DATA);
+                assert(header.destination_node == node);
+                assert(header.uid == getuid());
+                assert(header.n_bytes == sizeof(payload));
+                assert(header.n_handles == 1);
+                assert(header.n_fds == 0);
+        }
+
+        r = b1_peer_discard(dst);
+        assert(r >= 0);
+
+        r = b1_peer_peek(dst, &header);
+        assert(r >= 0);
+        assert(header.type == BUS1_MSG_DATA);
+
+        r = b1_peer_recv_peeked(dst, &message);
+        assert(r >= 0);
+        assert(b1_message_get_destination_node(message) == node);
+
+        r = b1_message_get_handle(message, 0, &payload_handle);
+        assert(r >= 0);
+        assert(b1_handle_get_peer(payload_handle) == dst);
+
+        r = b1_peer_discard(dst);
+        assert(r == -EAGAIN);
+}
+
+static void test_defer_fds(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        uint64_t n_installed, n_used, n_dropped;
+        int r, fd;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new_with_flags(&dst, B1_PEER_FLAG_DEFER_FDS);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
+        assert(r >= 0);
+
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        fd = eventfd(0, 0);
+        assert(fd >= 0);
+
+        r = b1_message_set_fds(message, &fd, 1);
+        assert(r >= 0);
+
+        assert(close(fd) >= 0);
+
+        for (unsigned int i = 0; i < 2; i++) {
+                r = b1_message_send(message, &handle, 1);
+                assert(r >= 0);
+        }
+
+        message = b1_message_unref(message);
+
+        /* fds are not installed by default */
+        r = b1_peer_recv(dst, &message);
+        assert(r >= 0);
+        r = b1_message_get_fd(message, 0, &fd);
+        assert(r == -EBADF);
+        message = b1_message_unref(message);
+
+        /* but can be requested per message */
+        r = b1_peer_recv_with_fds(dst, &message);
+        assert(r >= 0);
+        r = b1_message_get_fd(message, 0, &fd);
+        assert(r >= 0);
+        assert(fd >= 0);
+        r = b1_message_get_fd(message, 0, &fd);
+        assert(r >= 0);
+        message = b1_message_unref(message);
+
+        b1_peer_get_fd_stats(dst, &n_installed, &n_used, &n_dropped);
+        assert(n_installed == 1);
+        assert(n_used == 1);
+        assert(n_dropped == 1);
+}
+
+static void test_forward(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *router = NULL, *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *router_node = NULL, *dst_node = NULL, *node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *router_handle = NULL, *dst_handle = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL, *forwarded = NULL;
+        B1Handle *handle;
+        const uint64_t *data;
+        uint64_t payload = 0xdeadbeef;
+        int r;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&router);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_node_new(router, &router_node);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &dst_node);
+        assert(r >= 0);
+
+        r = b1_node_new(src, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(router_node), src, &router_handle);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(dst_node), router, &dst_handle);
+        assert(r >= 0);
+
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        r = B1_MESSAGE_SET_PAYLOAD(message, &payload);
+        assert(r >= 0);
+
+        handle = b1_node_get_handle(node);
+        r = b1_message_set_handles(message, &handle, 1);
+        assert(r >= 0);
+
+        /* only received messages can be forwarded */
+        r = b1_message_forward(message, &router_handle, 1);
+        assert(r == -EINVAL);
+
+        r = b1_message_send(message, &router_handle, 1);
+        assert(r >= 0);
+
+        message = b1_message_unref(message);
+
+        r = b1_peer_recv(router, &message);
+        assert(r >= 0);
+
+        r = b1_message_forward(message, &dst_handle, 1);
+        assert(r >= 0);
+
+        r = b1_peer_recv(dst, &forwarded);
+        assert(r >= 0);
+        assert(b1_message_get_destination_node(forwarded) == dst_node);
+        assert(b1_message_get_pid(forwarded) == getpid());
+
+        r = B1_MESSAGE_PEEK_PAYLOAD(forwarded, 0, uint64_t, &data);
+        assert(r >= 0);
+        assert(*data == payload);
+
+        r = b1_message_get_handle(forwarded, 0, &handle);
+        assert(r >= 0);
+        assert(b1_handle_get_peer(handle) == dst);
+}
+
+static void test_slice(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        _c_cleanup_(b1_slice_unrefp) B1Slice *slice = NULL;
+        const char *payload = "WOOF";
+        const char *data;
+        size_t n_data;
+        int r;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
+        assert(r >= 0);
+
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        r = b1_message_set_payload(message, &(struct iovec){ (void*)payload, strlen(payload) + 1 }, 1);
+        assert(r >= 0);
+
+        /* messages not received have no slice */
+        r = b1_message_detach_payload(message, &slice);
+        assert(r == -EINVAL);
+
+        r = b1_message_send(message, &handle, 1);
+        assert(r >= 0);
+
+        message = b1_message_unref(message);
+
+        r = b1_peer_recv(dst, &message);
+        assert(r >= 0);
+
+        r = b1_message_detach_payload(message, &slice);
+        assert(r >= 0);
+
+        /* the payload outlives the message */
+        message = b1_message_unref(message);
+
+        data = b1_slice_get_data(slice, &n_data);
+        assert(n_data == strlen(payload) + 1);
+        assert(!strcmp(data, payload));
+}
+
+static void test_pool_stats(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
+        B1Message *message, *message1, *message2;
+        B1Slice *slice;
+        B1PoolStats stats;
+        uint8_t payload[256] = {};
+        int r;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
+        assert(r >= 0);
+
+        b1_peer_get_pool_stats(dst, &stats);
+        assert(stats.n_mapped == 0);
+        assert(stats.n_slices == 0);
+
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        r = b1_message_set_payload(message, &(struct iovec){ payload, 8 }, 1);
+        assert(r >= 0);
+
+        r = b1_message_send(message, &handle, 1);
+        assert(r >= 0);
+
+        r = b1_message_set_payload(message, &(struct iovec){ payload, sizeof(payload) }, 1);
+        assert(r >= 0);
+
+        r = b1_message_send(message, &handle, 1);
+        assert(r >= 0);
+
+        b1_message_unref(message);
+
+        r = b1_peer_recv(dst, &message1);
+        assert(r >= 0);
+
+        r = b1_peer_recv(dst, &message2);
+        assert(r >= 0);
+
+        b1_peer_get_pool_stats(dst, &stats);
+        assert(stats.n_mapped > 0);
+        assert(stats.n_slices == 2);
+        assert(stats.n_bytes == 8 + sizeof(payload));
+        assert(stats.n_slice_max == sizeof(payload));
+        assert(stats.n_dropped == 0);
+
+        b1_message_unref(message1);
+
+        /* detached payloads are still accounted */
+        r = b1_message_detach_payload(message2, &slice);
+        assert(r >= 0);
+        b1_message_unref(message2);
+
+        b1_peer_get_pool_stats(dst, &stats);
+        assert(stats.n_slices == 1);
+        assert(stats.n_bytes == sizeof(payload));
+
+        b1_slice_unref(slice);
+
+        b1_peer_get_pool_stats(dst, &stats);
+        assert(stats.n_slices == 0);
+        assert(stats.n_bytes == 0);
+        assert(stats.oldest_age_ns == 0);
+
+        /* notifications do not occupy the pool */
+        handle = b1_handle_unref(handle);
+        node = b1_node_free(node);
+
+        r = b1_peer_recv(dst, &message1);
+        assert(r >= 0);
+        assert(b1_message_get_type(message1) == BUS1_MSG_NODE_RELEASE);
+
+        r = b1_peer_recv(dst, &message2);
+        assert(r >= 0);
+        assert(b1_message_get_type(message2) == BUS1_MSG_NODE_DESTROY);
+
+        b1_peer_get_pool_stats(dst, &stats);
+        assert(stats.n_slices == 0);
+        assert(stats.n_bytes == 0);
+        assert(stats.oldest_age_ns == 0);
+
+        b1_message_unref(message2);
+        b1_message_unref(message1);
+
+        b1_peer_get_pool_stats(dst, &stats);
+        assert(stats.n_slices == 0);
+        assert(stats.n_bytes == 0);
+}
+
+static void test_pool_flags(void) {
+        static const uint64_t flags[] = {
+                B1_PEER_FLAG_POOL_POPULATE,
+                B1_PEER_FLAG_POOL_HUGEPAGE,
+                B1_PEER_FLAG_POOL_LOCAL,
+                B1_PEER_FLAG_POOL_POPULATE | B1_PEER_FLAG_POOL_HUGEPAGE | B1_PEER_FLAG_POOL_LOCAL,
+        };
+        uint64_t payload = 42;
+        const uint64_t *data;
+        int r;
+
+        for (size_t i = 0; i < C_ARRAY_SIZE(flags); i++) {
+                _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+                _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+                _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
+                B1Message *message;
+                B1PoolStats stats;
+
+                r = b1_peer_new(&src);
+                assert(r >= 0);
+
+                r = b1_peer_new_with_flags(&dst, flags[i]);
+                assert(r >= 0);
+
+                r = b1_node_new(dst, &node);
+                assert(r >= 0);
+
+                r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
+                assert(r >= 0);
+
+                r = b1_message_new(src, &message);
+                assert(r >= 0);
+
+                r = B1_MESSAGE_SET_PAYLOAD(message, &payload);
+                assert(r >= 0);
+
+                r = b1_message_send(message, &handle, 1);
+                assert(r >= 0);
+
+                b1_message_unref(message);
+
+                /* the hints are applied on the first receive */
+                r = b1_peer_recv(dst, &message);
+                assert(r >= 0);
+
+                r = B1_MESSAGE_PEEK_PAYLOAD(message, 0, uint64_t, &data);
+                assert(r >= 0);
+                assert(*data == payload);
+
+                b1_peer_get_pool_stats(dst, &stats);
+                assert(stats.n_mapped > 0);
+                assert(stats.n_slices == 1);
+
+                b1_message_unref(message);
+        }
+}
+
+static void test_timestamps(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL, *plain = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL, *plain_node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL, *plain_handle = NULL;
+        B1LatencyStats stats;
+        B1MessageHeader header;
+        B1Message *message;
+        uint64_t payload = 42, before, after;
+        const uint64_t *data;
+        int r;
+
+        r = b1_peer_new_with_flags(&src, B1_PEER_FLAG_TIMESTAMPS);
+        assert(r >= 0);
+
+        r = b1_peer_new_with_flags(&dst, B1_PEER_FLAG_TIMESTAMPS);
+        assert(r >= 0);
+
+        r = b1_peer_new(&plain);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
+        assert(r >= 0);
+
+        r = b1_node_new(plain, &plain_node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(plain_node), src, &plain_handle);
+        assert(r >= 0);
+
+        b1_peer_get_latency_stats(dst, &stats);
+        assert(stats.n_samples == 0);
+
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        r = B1_MESSAGE_SET_PAYLOAD(message, &payload);
+        assert(r >= 0);
+
+        before = b1_stats_now();
+        r = b1_message_send(message, &handle, 1);
+        assert(r >= 0);
+        after = b1_stats_now();
+
+        /* receivers without the flag see the trailer */
+        r = b1_message_send(message, &plain_handle, 1);
+        assert(r >= 0);
+
+        b1_message_unref(message);
+
+        /* the trailer is stripped from the payload */
+        r = b1_peer_peek(dst, &header);
+        assert(r >= 0);
+        assert(header.n_bytes == sizeof(payload));
+
+        r = b1_peer_recv(dst, &message);
+        assert(r >= 0);
+        assert(b1_message_get_send_time(message) >= before);
+        assert(b1_message_get_send_time(message) <= after);
+
+        r = B1_MESSAGE_PEEK_PAYLOAD(message, 0, uint64_t, &data);
+        assert(r >= 0);
+        assert(*data == payload);
+        r = b1_message_peek_payload(message, 0, sizeof(payload) + 1, 1, (const void **)&data);
+        assert(r < 0);
+
+        b1_message_unref(message);
+
+        b1_peer_get_latency_stats(dst, &stats);
+        assert(stats.n_samples == 1);
+        assert(stats.max_ns > 0);
+        assert(stats.p50_ns >= stats.max_ns);
+        assert(stats.p99_ns >= stats.p50_ns);
+
+        r = b1_peer_recv(plain, &message);
+        assert(r >= 0);
+        assert(b1_message_get_send_time(message) == 0);
+        r = b1_message_peek_payload(message, 0, sizeof(payload) + 16, 1, (const void **)&data);
+        assert(r >= 0);
+        b1_message_unref(message);
+}
+
+static void test_flow(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL, *credit = NULL;
+        _c_cleanup_(b1_flow_freep) B1Flow *flow = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        B1Message *received;
+        B1FlowStats stats;
+        B1Handle *unused;
+        uint64_t payload = 0;
+        int r;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
+        assert(r >= 0);
+
+        r = b1_flow_new(&flow, handle, 2, 2);
+        assert(r >= 0);
+
+        r = b1_peer_recv(dst, &received);
+        assert(r >= 0);
+        assert(b1_message_get_destination_node(received) == node);
+        r = b1_flow_accept(received, &credit);
+        assert(r >= 0);
+        b1_message_unref(received);
+
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        r = B1_MESSAGE_SET_PAYLOAD(message, &payload);
+        assert(r >= 0);
+
+        /* two messages fit in the window, two in the queue */
+        r = b1_flow_send(flow, message, false);
+        assert(r == 0);
+        r = b1_flow_send(flow, message, false);
+        assert(r == 0);
+        r = b1_flow_send(flow, message, false);
+        assert(r == 1);
+        r = b1_flow_send(flow, message, false);
+        assert(r == 1);
+        r = b1_flow_send(flow, message, false);
+        assert(r == -EAGAIN);
+
+        b1_flow_get_stats(flow, &stats);
+        assert(stats.n_credits == 0);
+        assert(stats.n_sent == 2);
+        assert(stats.n_stalls == 3);
+        assert(stats.n_depth == 2);
+        assert(stats.n_depth_max == 2);
+
+        for (unsigned int i = 0; i < 2; i++) {
+                r = b1_peer_recv(dst, &received);
+                assert(r >= 0);
+                r = b1_flow_accept(received, &unused);
+                assert(r == -EBADMSG);
+                b1_message_unref(received);
+        }
+
+        r = b1_peer_recv(dst, &received);
+        assert(r == -EAGAIN);
+
+        r = b1_flow_grant(credit, 3);
+        assert(r >= 0);
+
+        r = b1_flow_dispatch(flow);
+        assert(r == 0);
+
+        b1_flow_get_stats(flow, &stats);
+        assert(stats.n_credits == 1);
+        assert(stats.n_sent == 4);
+        assert(stats.n_grants == 1);
+        assert(stats.n_depth == 0);
+
+        r = b1_flow_send(flow, message, true);
+        assert(r == 0);
+
+        for (unsigned int i = 0; i < 3; i++) {
+                r = b1_peer_recv(dst, &received);
+                assert(r >= 0);
+                b1_message_unref(received);
+        }
+
+        /* the receiver going away breaks the flow */
+        credit = b1_handle_unref(credit);
+
+        r = b1_flow_send(flow, message, true);
+        assert(r == -ECONNRESET);
+}
+
+typedef struct {
+        int errors[4];
+        size_t n_completed;
+} TestSendQueueResult;
+
+static void test_send_queue_fn(B1Message *message, int error, void *userdata) {
+        TestSendQueueResult *result = userdata;
+
+        assert(result->n_completed < C_ARRAY_SIZE(result->errors));
+        result->errors[result->n_completed++] = error;
+}
+
+static void test_send_queue(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
+        _c_cleanup_(b1_send_queue_freep) B1SendQueue *queue = NULL;
+        B1SendQueueStats stats;
+        B1Message *message;
+        const uint64_t *value;
+        uint64_t payload[3] = { 0, 1, 2 };
+        TestSendQueueResult result = {};
+        struct pollfd pfd;
+        int r;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
+        assert(r >= 0);
+
+        r = b1_send_queue_new(&queue, src, test_send_queue_fn, &result);
+        assert(r >= 0);
+
+        pfd.fd = b1_send_queue_get_fd(queue);
+        pfd.events = POLLIN;
+
+        r = poll(&pfd, 1, 0);
+        assert(r == 0);
+
+        for (unsigned int i = 0; i < C_ARRAY_SIZE(payload); i++) {
+                r = b1_message_new(src, &message);
+                assert(r >= 0);
+
+                r = B1_MESSAGE_SET_PAYLOAD(message, &payload[i]);
+                assert(r >= 0);
+
+                r = b1_send_queue_push(queue, message, &handle, 1);
+                assert(r >= 0);
+
+                b1_message_unref(message);
+        }
+
+        /* a message carrying the same handle twice is rejected for good */
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        r = b1_message_set_handles(message, (B1Handle *[]){ handle, handle }, 2);
+        assert(r >= 0);
+
+        r = b1_send_queue_push(queue, message, &handle, 1);
+        assert(r >= 0);
+
+        b1_message_unref(message);
+
+        r = poll(&pfd, 1, 0);
+        assert(r == 1);
+
+        r = b1_send_queue_dispatch(queue);
+        assert(r == 0);
+
+        assert(result.n_completed == 4);
+        assert(result.errors[0] == 0);
+        assert(result.errors[1] == 0);
+        assert(result.errors[2] == 0);
+        assert(result.errors[3] == -ENOTUNIQ);
+
+        r = poll(&pfd, 1, 0);
+        assert(r == 0);
+
+        for (unsigned int i = 0; i < C_ARRAY_SIZE(payload); i++) {
+                r = b1_peer_recv(dst, &message);
+                assert(r >= 0);
+
+                r = B1_MESSAGE_PEEK_PAYLOAD(message, 0, uint64_t, &value);
+                assert(r >= 0);
+                assert(*value == i);
+
+                b1_message_unref(message);
+        }
+
+        b1_send_queue_get_stats(queue, &stats);
+        assert(stats.n_sent == 3);
+        assert(stats.n_failed == 1);
+        assert(stats.n_retries == 0);
+        assert(stats.n_depth == 0);
+        assert(stats.n_depth_max == 4);
+}
+
+static void test_capture(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
+        char path[] = "/tmp/test-capture-XXXXXX";
+        static const unsigned int kinds[] = {
+                B1_CAPTURE_RECORD_NODE,
+                B1_CAPTURE_RECORD_TRANSFER,
+                B1_CAPTURE_RECORD_SEND,
+                B1_CAPTURE_RECORD_RECV,
+        };
+        const B1CaptureHeader *header;
+        const B1CaptureRecord *record;
+        B1Message *message;
+        uint64_t payload = 42, n_dropped;
+        const uint8_t *log;
+        struct stat st;
+        size_t offset;
+        int r, fd;
+
+        fd = mkstemp(path);
+        assert(fd >= 0);
+        close(fd);
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
+
+        r = b1_capture_start(path, 1024 * 1024, B1_CAPTURE_FLAG_PAYLOAD);
+        assert(r >= 0);
+
+        r = b1_capture_start(path, 1024 * 1024, 0);
+        assert(r == -EBUSY);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
+        assert(r >= 0);
+
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        r = B1_MESSAGE_SET_PAYLOAD(message, &payload);
+        assert(r >= 0);
+
+        r = b1_message_send(message, &handle, 1);
+        assert(r >= 0);
+
+        b1_message_unref(message);
+
+        r = b1_peer_recv(dst, &message);
+        assert(r >= 0);
+
+        b1_message_unref(message);
+
+        r = b1_capture_stop(&n_dropped);
+        assert(r >= 0);
+        assert(n_dropped == 0);
+
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        assert(fd >= 0);
+        r = fstat(fd, &st);
+        assert(r >= 0);
+
+        log = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        assert(log != MAP_FAILED);
+        close(fd);
+
+        header = (const B1CaptureHeader *)log;
+        assert(header->magic == B1_CAPTURE_MAGIC);
+        assert(header->n_bytes == (uint64_t)st.st_size);
+
+        offset = sizeof(*header);
+        for (unsigned int i = 0; i < C_ARRAY_SIZE(kinds); i++) {
+                assert(offset < header->n_bytes);
+                record = (const B1CaptureRecord *)(log + offset);
+                assert(record->kind == kinds[i]);
+                offset += record->size;
+        }
+        assert(offset == header->n_bytes);
+
+        /* the send carries its payload, the receive only its size */
+        record = (const B1CaptureRecord *)(log + sizeof(*header));
+        record = (const B1CaptureRecord *)((const uint8_t *)record + record->size);
+        record = (const B1CaptureRecord *)((const uint8_t *)record + record->size);
+        assert(record->peer == b1_peer_get_fd(src));
+        assert(record->n_ids == 1);
+        assert(record->n_bytes == sizeof(payload));
+        assert(record->n_payload == sizeof(payload));
+        assert(!memcmp(record->ids + 1, &payload, sizeof(payload)));
+
+        record = (const B1CaptureRecord *)((const uint8_t *)record + record->size);
+        assert(record->peer == b1_peer_get_fd(dst));
+        assert(record->type == BUS1_MSG_DATA);
+        assert(record->n_bytes == sizeof(payload));
+        assert(record->n_payload == 0);
+
+        munmap((void *)log, st.st_size);
+        unlink(path);
+}
+
+static const B1StatsPage *test_stats_map(B1Peer *peer, char *path, size_t n_path) {
+        const B1StatsPage *page;
+        int fd;
+
+        snprintf(path, n_path, B1_STATS_DIRECTORY "/" B1_STATS_PREFIX "%d-%d",
+                 (int)getpid(), b1_peer_get_fd(peer));
+
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        assert(fd >= 0);
+
+        page = mmap(NULL, sizeof(*page), PROT_READ, MAP_SHARED, fd, 0);
+        assert(page != MAP_FAILED);
+        close(fd);
+
+        assert(page->magic == B1_STATS_MAGIC);
+        assert(page->version == B1_STATS_VERSION);
+        assert(page->pid == getpid());
+        assert(page->fd == b1_peer_get_fd(peer));
+
+        return page;
+}
+
+static void test_stats(void) {
+        char src_path[PATH_MAX], dst_path[PATH_MAX];
+        const B1StatsPage *src_page, *dst_page;
+        B1StatsPage snapshot;
+        B1Peer *src, *dst;
+        B1Node *node;
+        B1Handle *handle;
+        B1Message *message;
+        uint64_t payload = 42, n_latency = 0;
+        int r;
+
+        r = b1_peer_new_with_flags(&src, B1_PEER_FLAG_STATS | B1_PEER_FLAG_TIMESTAMPS);
+        assert(r >= 0);
+
+        r = b1_peer_new_with_flags(&dst, B1_PEER_FLAG_STATS | B1_PEER_FLAG_TIMESTAMPS);
+        assert(r >= 0);
+
+        src_page = test_stats_map(src, src_path, sizeof(src_path));
+        dst_page = test_stats_map(dst, dst_path, sizeof(dst_path));
+
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
+        assert(r >= 0);
+
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        r = B1_MESSAGE_SET_PAYLOAD(message, &payload);
+        assert(r >= 0);
+
+        r = b1_message_send(message, &handle, 1);
+        assert(r >= 0);
+
+        b1_message_unref(message);
+
+        r = b1_peer_recv(dst, &message);
+        assert(r >= 0);
+
+        b1_stats_read(src_page, &snapshot);
+        assert(!(snapshot.seq & 1));
+        assert(snapshot.n_sent == 1);
+        assert(snapshot.n_sent_bytes == sizeof(payload));
+        assert(snapshot.n_received == 0);
+        assert(snapshot.n_handles == 1);
+        assert(snapshot.n_nodes == 0);
+        assert(snapshot.n_ioctls[B1_STATS_IOCTL_SEND] == 1);
+
+        /* the timestamp trailer is not accounted */
+        b1_stats_read(dst_page, &snapshot);
+        assert(snapshot.n_sent == 0);
+        assert(snapshot.n_received == 1);
+        assert(snapshot.n_received_bytes == sizeof(payload));
+        assert(snapshot.n_nodes == 1);
+        assert(snapshot.n_handles == 1);
+        assert(snapshot.n_pool_slices == 1);
+        assert(snapshot.n_ioctls[B1_STATS_IOCTL_HANDLE_TRANSFER] == 1);
+        assert(snapshot.n_ioctls[B1_STATS_IOCTL_RECV] >= 1);
+
+        for (unsigned int i = 0; i < B1_STATS_LATENCY_BUCKETS; i++)
+                n_latency += snapshot.latency[i];
+        assert(n_latency == 1);
+
+        b1_message_unref(message);
+
+        b1_stats_read(dst_page, &snapshot);
+        assert(snapshot.n_pool_slices == 0);
+        assert(snapshot.n_ioctls[B1_STATS_IOCTL_SLICE_RELEASE] == 1);
+
+        b1_handle_unref(handle);
+        b1_node_free(node);
+
+        b1_stats_read(dst_page, &snapshot);
+        assert(snapshot.n_nodes == 0);
+        assert(snapshot.n_handles == 0);
+
+        /* reserved nodes are accounted until a reset drops them */
+        r = b1_peer_reserve_nodes(dst, 4);
+        assert(r >= 0);
+
+        b1_stats_read(dst_page, &snapshot);
+        assert(snapshot.n_nodes == 4);
+        assert(snapshot.n_handles == 4);
+
+        r = b1_peer_reset(dst, 0);
+        assert(r >= 0);
+
+        b1_stats_read(dst_page, &snapshot);
+        assert(snapshot.n_nodes == 0);
+        assert(snapshot.n_handles == 0);
+
+        munmap((void *)src_page, sizeof(*src_page));
+        munmap((void *)dst_page, sizeof(*dst_page));
+
+        /* the pages are removed with their peers */
+        b1_peer_unref(src);
+        b1_peer_unref(dst);
+        assert(access(src_path, F_OK) < 0 && errno == ENOENT);
+        assert(access(dst_path, F_OK) < 0 && errno == ENOENT);
+}
+
+static void test_payload(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        struct payload {
+                uint64_t cookie;
+                uint32_t values[4];
+        } payload = {
+                .cookie = 0xdeadbeef,
+                .values = { 1, 2, 3, 4 },
+        };
+        const struct payload *view;
+        const uint32_t *value;
+        int r;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
+        assert(r >= 0);
+
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        r = B1_MESSAGE_SET_PAYLOAD(message, &payload);
+        assert(r >= 0);
+
+        r = b1_message_send(message, &handle, 1);
+        assert(r >= 0);
+
+        message = b1_message_unref(message);
+
+        r = b1_peer_recv(dst, &message);
+        assert(r >= 0);
+        assert(b1_message_get_type(message) == BUS1_MSG_DATA);
+
+        r = B1_MESSAGE_PEEK_PAYLOAD(message, 0, struct payload, &view);
+        assert(r >= 0);
+        assert(view->cookie == 0xdeadbeef);
+        assert(view->values[3] == 4);
+
+        r = B1_MESSAGE_PEEK_PAYLOAD(message, offsetof(struct payload, values[2]), uint32_t, &value);
+        assert(r >= 0);
+        assert(*value == 3);
+
+        r = B1_MESSAGE_PEEK_PAYLOAD(message, sizeof(payload) - 2, uint32_t, &value);
+        assert(r == -ERANGE);
+
+        r = B1_MESSAGE_PEEK_PAYLOAD(message, 1, uint32_t, &value);
+        assert(r == -EINVAL);
+}
+
+static void test_variant(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        _c_cleanup_(c_variant_freep) CVariant *cv = NULL;
+        uint32_t array[] = { 1, 2, 3, 5, 8 };
+        const void *data;
+        size_t n_data;
+        uint64_t t;
+        uint32_t u;
+        int r;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
+        assert(r >= 0);
+
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        r = c_variant_new(&cv, "(tu)", strlen("(tu)"));
+        assert(r >= 0);
+
+        r = c_variant_write(cv, "(tu)", UINT64_C(0xdeadbeef), UINT32_C(7));
+        assert(r >= 0);
+
+        r = b1_message_set_variant(message, cv);
+        assert(r >= 0);
+
+        r = b1_message_send(message, &handle, 1);
+        assert(r >= 0);
+
+        message = b1_message_unref(message);
+        cv = c_variant_free(cv);
+
+        r = b1_peer_recv(dst, &message);
+        assert(r >= 0);
+        assert(b1_message_get_type(message) == BUS1_MSG_DATA);
+
+        r = b1_message_get_variant(message, &cv);
+        assert(r >= 0);
+
+        r = c_variant_read(cv, "(tu)", &t, &u);
+        assert(r >= 0);
+        assert(t == 0xdeadbeef);
+        assert(u == 7);
+
+        r = b1_message_peek_variant_array(message, "u", &data, &n_data);
+        assert(r == -EMEDIUMTYPE);
+
+        cv = c_variant_free(cv);
+        message = b1_message_unref(message);
+
+        /* arrays of fixed-size elements can be accessed in place */
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        r = c_variant_new(&cv, "au", strlen("au"));
+        assert(r >= 0);
+
+        r = c_variant_begin(cv, "a");
+        assert(r >= 0);
+
+        for (unsigned int i = 0; i < C_ARRAY_SIZE(array); i++) {
+                r = c_variant_write(cv, "u", array[i]);
+                assert(r >= 0);
+        }
+
+        r = c_variant_end(cv, "a");
+        assert(r >= 0);
+
+        r = b1_message_set_variant(message, cv);
+        assert(r >= 0);
+
+        r = b1_message_send(message, &handle, 1);
+        assert(r >= 0);
+
+        message = b1_message_unref(message);
+        cv = c_variant_free(cv);
+
+        r = b1_peer_recv(dst, &message);
+        assert(r >= 0);
+
+        r = b1_message_peek_variant_array(message, "t", &data, &n_data);
+        assert(r == -EMEDIUMTYPE);
+
+        r = b1_message_peek_variant_array(message, "u", &data, &n_data);
+        assert(r >= 0);
+        assert(n_data == C_ARRAY_SIZE(array));
+        assert(!memcmp(data, array, sizeof(array)));
+}
+
+static void test_pump(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
+        _c_cleanup_(b1_recv_pump_freep) B1RecvPump *pump = NULL;
+        B1RecvPumpStats stats;
+        B1Message *message;
+        struct pollfd pfd;
+        unsigned int n_received = 0;
+        int r;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
+        assert(r >= 0);
+
+        /* queue more messages than the ring can hold */
+        for (unsigned int i = 0; i < 8; i++) {
+                r = b1_message_new(src, &message);
+                assert(r >= 0);
+
+                r = b1_message_send(message, &handle, 1);
+                assert(r >= 0);
+
+                b1_message_unref(message);
+        }
+
+        r = b1_recv_pump_new(&pump, dst, 2, -1);
+        assert(r >= 0);
+
+        pfd.fd = b1_recv_pump_get_fd(pump);
+        pfd.events = POLLIN;
+
+        while (n_received < 8) {
+                r = poll(&pfd, 1, -1);
+                assert(r == 1);
+
+                while (b1_recv_pump_pop(pump, &message) >= 0) {
+                        assert(b1_message_get_type(message) == BUS1_MSG_DATA);
+                        b1_recv_pump_release(pump, message);
+                        ++n_received;
+                }
+        }
+
+        b1_recv_pump_get_stats(pump, &stats);
+        assert(stats.n_published == 8);
+        assert(stats.n_consumed == 8);
+        assert(stats.n_depth_max <= 2);
+        assert(stats.n_drops == 0);
+
+        r = b1_recv_pump_pop(pump, &message);
+        assert(r == -EAGAIN);
+
+        pump = b1_recv_pump_free(pump);
+}
+
+static void test_executor_fn(B1Peer *peer, B1Message *message, void *userdata) {
+        _Atomic unsigned int *n_received = userdata;
+
+        assert(b1_message_get_type(message) == BUS1_MSG_DATA);
+        atomic_fetch_add(n_received, 1);
+}
+
+static void test_executor(void) {
+        _c_cleanup_(b1_executor_freep) B1Executor *executor = NULL;
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL;
+        B1Peer *dsts[4] = {};
+        B1Node *nodes[4] = {};
+        B1Handle *handles[4] = {};
+        _Atomic unsigned int n_received = 0;
+        uint64_t n_messages;
+        B1Message *message;
+        int r;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_executor_new(&executor, 2, false, test_executor_fn, &n_received);
+        assert(r >= 0);
+
+        /* put all peers on the first worker, the second one has to steal */
+        for (unsigned int i = 0; i < C_ARRAY_SIZE(dsts); i++) {
+                r = b1_peer_new(&dsts[i]);
+                assert(r >= 0);
+
+                r = b1_node_new(dsts[i], &nodes[i]);
+                assert(r >= 0);
+
+                r = b1_handle_transfer(b1_node_get_handle(nodes[i]), src, &handles[i]);
+                assert(r >= 0);
+
+                r = b1_executor_add_peer(executor, dsts[i], 0);
+                assert(r >= 0);
+        }
+
+        r = b1_executor_add_peer(executor, src, 2);
+        assert(r == -ERANGE);
+
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        for (unsigned int i = 0; i < 16; i++) {
+                r = b1_message_send(message, handles, C_ARRAY_SIZE(handles));
+                assert(r >= 0);
+        }
+
+        message = b1_message_unref(message);
+
+        r = b1_executor_start(executor);
+        assert(r >= 0);
+
+        /* messages are accounted once the callback returned */
+        do {
+                usleep(1000);
+                b1_executor_get_stats(executor, &n_messages, NULL);
+        } while (n_messages < 16 * C_ARRAY_SIZE(dsts));
+
+        assert(n_messages == 16 * C_ARRAY_SIZE(dsts));
+        assert(atomic_load(&n_received) == 16 * C_ARRAY_SIZE(dsts));
+
+        executor = b1_executor_free(executor);
+
+        for (unsigned int i = 0; i < C_ARRAY_SIZE(dsts); i++) {
+                b1_handle_unref(handles[i]);
+                b1_node_free(nodes[i]);
+                b1_peer_unref(dsts[i]);
+        }
+}
+
 int main(int argc, char **argv) {
         if (access("/dev/bus1", F_OK) < 0 && errno == ENOENT)
                 return 77;
 
         test_peer();
+        test_single_threaded();
+        test_factory();
         test_node();
+        test_node_reservoir();
+        test_reset();
         test_handle();
+        test_handle_cache();
+        test_handles();
         test_message();
         test_transaction();
         test_multicast();
+        test_duplicates();
+        test_messages();
+        test_peek();
+        test_defer_fds();
+        test_forward();
+        test_slice();
+        test_pool_stats();
+        test_pool_flags();
+        test_timestamps();
+        test_flow();
+        test_send_queue();
+        test_capture();
+        test_stats();
+        test_payload();
+        test_variant();
+        test_pump();
+        test_executor();
 
         return 0;
 }